@@ -0,0 +1,194 @@
+/*
+ File:		TMCapture.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMCapture.h"
+
+static void putLE(UInt8 *out, UInt64 value, int bytes)
+{
+    for(int i = 0; i < bytes; i++)
+    {
+        out[i] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+static UInt64 getLE(const UInt8 *in, int bytes)
+{
+    UInt64 value = 0;
+    
+    for(int i = 0; i < bytes; i++)
+    {
+        value |= (UInt64)in[i] << (8 * i);
+    }
+    return value;
+}
+
+void TMCaptureWriter::init(UInt8 *buffer, UInt32 capacity, const TMCore *core)
+{
+    TMProfile   profile;
+    
+    fBuffer = buffer;
+    fCapacity = capacity;
+    fLength = 0;
+    fLastTimestamp = 0;
+    fDropped = 0;
+    
+    if(capacity < kCaptureHeaderSize)
+    {
+        fCapacity = 0;
+        return;
+    }
+    
+    // save the settings so a replay translates the same way we did
+    profile.init(core, NULL);
+    
+    fBuffer[0] = 'T';
+    fBuffer[1] = 'M';
+    fBuffer[2] = 'C';
+    fBuffer[3] = 'P';
+    putLE(fBuffer + 4, kCaptureVersion, 2);
+    fBuffer[6] = profile.fSettings;
+    fBuffer[7] = 0;
+    putLE(fBuffer + 8, profile.fButtons, 2);
+    putLE(fBuffer + 10, profile.fLayerButtons, 2);
+    putLE(fBuffer + 12, 0, 8);
+    
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        TMProfile::putAxis(fBuffer + kCaptureV1HeaderSize + i * kCaptureAxisSize, &profile.fAxes[i]);
+    }
+    fLength = kCaptureHeaderSize;
+}
+
+bool TMCaptureWriter::add(UInt64 timestamp, const UInt8 *data, UInt32 length)
+{
+    UInt8   *record;
+    UInt64  delta;
+    
+    if(fCapacity == 0 || isFull())
+    {
+        fDropped++;
+        return false;
+    }
+    
+    // the first record sets the start time
+    if(fLength == kCaptureHeaderSize)
+    {
+        putLE(fBuffer + 12, timestamp, 8);
+        fLastTimestamp = timestamp;
+    }
+    
+    delta = (timestamp - fLastTimestamp) / 1000;
+    if(delta > 0xffffffffULL)
+    {
+        delta = 0xffffffffULL;
+    }
+    // keep the rounding from piling up
+    fLastTimestamp += delta * 1000;
+    
+    if(length > kHalfFrameSize)
+    {
+        length = kHalfFrameSize;
+    }
+    
+    record = fBuffer + fLength;
+    putLE(record, delta, 4);
+    record[4] = length;
+    for(UInt32 i = 0; i < kHalfFrameSize; i++)
+    {
+        record[5 + i] = (i < length) ? data[i] : 0;
+    }
+    fLength += kCaptureRecordSize;
+    
+    return true;
+}
+
+bool TMCaptureReader::init(const UInt8 *buffer, UInt32 length)
+{
+    UInt32  version;
+    
+    fBuffer = buffer;
+    fLength = length;
+    fOffset = 0;
+    fAxes = NULL;
+    
+    if(length < kCaptureV1HeaderSize)
+    {
+        return false;
+    }
+    if(buffer[0] != 'T' || buffer[1] != 'M' || buffer[2] != 'C' || buffer[3] != 'P')
+    {
+        return false;
+    }
+    version = getLE(buffer + 4, 2);
+    if(version < 1 || version > kCaptureVersion)
+    {
+        return false;
+    }
+    
+    fSettings = buffer[6];
+    fButtons = getLE(buffer + 8, 2);
+    fLayerButtons = (version >= 4) ? getLE(buffer + 10, 2) : 0;
+    fTimestamp = getLE(buffer + 12, 8);
+    fOffset = kCaptureV1HeaderSize;
+    
+    // version 2 added the axis calibration, 3 the jitter filter, 4 the layer
+    // buttons
+    if(version >= 2)
+    {
+        fAxisSize = (version == 2) ? kCaptureV2AxisSize : kCaptureAxisSize;
+        if(length < kCaptureV1HeaderSize + kNumAxes * fAxisSize)
+        {
+            return false;
+        }
+        fAxes = buffer + kCaptureV1HeaderSize;
+        fOffset = kCaptureV1HeaderSize + kNumAxes * fAxisSize;
+    }
+    
+    return true;
+}
+
+bool TMCaptureReader::next(TMCaptureRecord *record)
+{
+    const UInt8 *in;
+    
+    if(fOffset + kCaptureRecordSize > fLength)
+    {
+        return false;
+    }
+    
+    in = fBuffer + fOffset;
+    fTimestamp += getLE(in, 4) * 1000;
+    record->timestamp = fTimestamp;
+    record->length = in[4];
+    if(record->length > kHalfFrameSize)
+    {
+        record->length = kHalfFrameSize;
+    }
+    for(int i = 0; i < kHalfFrameSize; i++)
+    {
+        record->data[i] = in[5 + i];
+    }
+    fOffset += kCaptureRecordSize;
+    
+    return true;
+}
+
+void TMCaptureReader::applySettings(TMCore *core) const
+{
+    TMProfile   profile;
+    
+    // version 1 has no calibration, so the axes are left as they always were
+    core->loadAxisCalibration(NULL);
+    profile.init(core, NULL);
+    profile.fSettings = fSettings;
+    profile.fButtons = fButtons;
+    profile.fLayerButtons = fLayerButtons;
+    for(int i = 0; fAxes && i < kNumAxes; i++)
+    {
+        TMProfile::getAxis(fAxes + i * fAxisSize, fAxisSize, &profile.fAxes[i]);
+    }
+    
+    core->loadProfile(&profile);
+}
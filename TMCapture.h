@@ -0,0 +1,92 @@
+/*
+ File:		TMCapture.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ A compact binary record of the raw half frames the driver sees, so a flight
+ can be replayed through the same TMCore code later. Everything is little
+ endian.
+
+ Header (60 bytes, 20 in version 1, 52 in version 2)
+     0  'TMCP'
+     4  UInt16  version
+     6  UInt8   settings, see kCaptureHas...
+     7  UInt8   reserved
+     8  UInt16  Buttons, bit n set if button n is shifted by the rocker
+    10  UInt16  LayerButtons, bit n set if button n picks the layer. 0
+                before version 4.
+    12  UInt64  timestamp of the first record, ns
+    20  axis calibration, 10 bytes (8 in version 2) for each of X, Y,
+        rudder and throttle: min, max, center (255 for none), deadzone,
+        expo, s-curve, invert, 0, hysteresis, smoothing
+
+ Record (13 bytes)
+     0  UInt32  us since the previous record
+     4  UInt8   length of the read
+     5  UInt8   the raw half frame, header included [8]
+ */
+
+#ifndef __TMCAPTURE__
+#define __TMCAPTURE__
+
+#include "TMCore.h"
+#include "TMProfile.h"
+
+#define kCaptureVersion         4
+#define kCaptureV1HeaderSize    20
+#define kCaptureV2AxisSize      8
+#define kCaptureAxisSize        10
+#define kCaptureHeaderSize      (kCaptureV1HeaderSize + kNumAxes * kCaptureAxisSize)
+#define kCaptureRecordSize      (5 + kHalfFrameSize)
+
+// the same bits as a profile's settings
+enum {
+    kCaptureHasRudder           = kProfileHasRudder,
+    kCaptureHasThrottle         = kProfileHasThrottle,
+    kCaptureRockerIsModifier    = kProfileRockerIsModifier,
+    kCaptureModifierEffectsHat  = kProfileModifierEffectsHat,
+    kCaptureTwistRudder         = kProfileTwistRudder,
+    kCaptureHighResAxes         = kProfileHighResAxes
+};
+
+struct TMCaptureRecord
+{
+    UInt64      timestamp;      // ns, same clock as TMNanoseconds()
+    UInt32      length;
+    UInt8       data[kHalfFrameSize];
+};
+
+class TMCaptureWriter
+{
+public:
+    UInt8                       *fBuffer;
+    UInt32                      fCapacity;
+    UInt32                      fLength;
+    UInt64                      fLastTimestamp;
+    UInt32                      fDropped;
+
+public:
+    void init(UInt8 *buffer, UInt32 capacity, const TMCore *core);
+    bool add(UInt64 timestamp, const UInt8 *data, UInt32 length);
+    bool isFull() const { return fLength + kCaptureRecordSize > fCapacity; }
+};
+
+class TMCaptureReader
+{
+public:
+    const UInt8                 *fBuffer;
+    UInt32                      fLength;
+    UInt32                      fOffset;
+    UInt8                       fSettings;
+    UInt16                      fButtons;
+    UInt16                      fLayerButtons;
+    UInt64                      fTimestamp;
+    const UInt8                 *fAxes;             // NULL for version 1
+    UInt32                      fAxisSize;
+
+public:
+    bool init(const UInt8 *buffer, UInt32 length);
+    bool next(TMCaptureRecord *record);
+    void applySettings(TMCore *core) const;
+};
+
+#endif
@@ -0,0 +1,1275 @@
+/*
+ File:		TMCore.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMCore.h"
+#include "TMProfile.h"
+
+// rocker position from the top two bits of the WCS byte. 0 is up, 1 is the
+// middle and 2 is down. If both bits are set up wins.
+static const UInt8 gRockerPositions[4] = {1, 0, 2, 0};
+
+// every branch in buildReportDescriptor() has a fixed size, so if the worst
+// case fits, every setting does. This fails to compile if it doesn't.
+typedef char TMReportDescriptorFits[(kDescWorstCaseBytes <= kMaxReportDescriptorSize) ? 1 : -1];
+
+// the most buttons there can be is with every layer button in use and every
+// other button shifted, so that has to fit in the widest report too
+typedef char TMButtonsFit[((kNumOfButtons - kMaxLayerButtons) * kMaxLayers <= kMaxButtons) ? 1 : -1];
+
+// FCS button bits, in the order of the Buttons array
+static const UInt8 gFCSButtonMasks[kNumOfFCSButtons] =
+    {kFCSTriggerMask, kFCSThumbHighMask, kFCSThumbLowMask, kFCSPinkyMask};
+
+// where each axis comes from in the iMate data, they go in the report in this order
+static const UInt8 gAxisInputBytes[kNumAxes] = {kXAxisByte, kYAxisByte, kRuddersByte, kThrottleByte};
+static const char *gAxisNames[kNumAxes] = {"X", "Y", "Rudder", "Throttle"};
+
+// the button bytes of the iMate data read as one little endian number
+static const UInt64 gButtonBits = (0xffULL << (8 * kWCSButtonsByte)) | (0xffULL << (8 * kFCSButtonsByte));
+
+// the bits of fPendingData that a frame with these halves brings in
+static const UInt64 gHalfBits[4] = {0, 0x00000000ffffffffULL, 0xffffffff00000000ULL, ~0ULL};
+
+// looks up a number in a dictionary from the personality
+static int getNumber(OSDictionary *dict, const char *key, int defaultValue)
+{
+    OSNumber *number = dict ? OSDynamicCast(OSNumber, dict->getObject(key)) : NULL;
+    
+    return number ? (int)number->unsigned32BitValue() : defaultValue;
+}
+
+// looks up a boolean in the personality, returns NULL if it isn't there
+static OSBoolean* getBoolean(OSDictionary *properties, const char *key)
+{
+    if(!properties)
+    {
+        return NULL;
+    }
+    return OSDynamicCast(OSBoolean, properties->getObject(key));
+}
+
+void TMCore::init()
+{
+    fHasRudders = false;
+    fHasThrottle = true;
+    fRockerIsModifier = false;
+    fShiftedButtons = 0;
+    fLayerButtons = 0;
+    fNumLayers = 1;
+    fNumButtons = 0;
+    fButtonBytes = 4;
+    fHatIsModified = false;
+    fTwistRudder = false;
+    fHighResAxes = false;
+    fReportSize = kReportSize;
+    fFilterAxes = false;
+    fMap = this;
+    setReportBuffers(NULL, NULL);
+    loadAxisCalibration(NULL);
+    
+    for(int i = 0; i < kNumOfButtons; i++)
+    {
+        for(int j = 0; j < kMaxLayers; j++)
+        {
+            fButtonShifts[i][j] = 0;
+        }
+    }
+    for(int i = 0; i < kNumModifiers; i++)
+    {
+        fHatSwitchShifts[i] = 0;
+    }
+    for(int i = 0; i < kControlDataSize; i++)
+    {
+        fControlData[i] = 0;
+    }
+    fReportDescriptorLength = 0;
+    
+    for(int i = 0; i < kControlDataSize; i++)
+    {
+        fPendingData[i] = 0;
+    }
+    fPendingHalves = 0;
+    fFrames = 0;
+    fBadHalves = 0;
+    fUnpairedHalves = 0;
+    fSuppressedFrames = 0;
+    fChangedFrames = 0;
+    fReports = 0;
+    resetAxisFilter();
+}
+
+void TMCore::loadProperties(OSDictionary *properties)
+{
+    OSBoolean		*result;
+    UInt16              shifted, layers;
+    OSData              *data = properties ? OSDynamicCast(OSData, properties->getObject("Profile")) : NULL;
+    
+    // a good Profile has everything, and wins over the separate settings
+    if(data)
+    {
+        TMProfile   profile;
+        int         error = profile.read((const UInt8*)data->getBytesNoCopy(), data->getLength());
+        
+        if(error == kProfileOK)
+        {
+            loadProfile(&profile);
+            return;
+        }
+        IOLog("%s: The Profile is no good (%s), using the separate settings\n", NAME, TMProfile::errorString(error));
+    }
+    
+    // I need to know this info to create the device descriptor, but I can't
+    // dynamicly look this up until I finish initing the iMate, but that blocks...
+    // So we be stupid and just read from a config file.
+    fHasRudders = false;
+    fHasThrottle = true;
+    result = getBoolean(properties, "HasRudder");
+    if(result)
+    {
+        fHasRudders = result->getValue();
+    }
+    result = getBoolean(properties, "HasThrottle");
+    if(result)
+    {
+        fHasThrottle = result->getValue();
+    }
+    
+    // check to see if the rocker switch should act as a modifier
+    if(fHasThrottle)
+    {
+        result = getBoolean(properties, "RockerIsModifier");
+        if(!result)
+        {
+            IOLog("%s: Failed to find an entry for RockerIsModifier, assuming false.\n", NAME);
+            fRockerIsModifier = false;
+        }
+        else
+        {
+            fRockerIsModifier = result->getValue();
+        }
+    }
+    else
+    {
+        fRockerIsModifier = false;
+    }
+    
+    // which buttons the rocker shifts
+    OSArray *buttonArray = properties ? OSDynamicCast(OSArray, properties->getObject("Buttons")) : NULL;
+    shifted = 0;
+    for(int i = 0; buttonArray && i < kNumOfButtons; i++)
+    {
+        result = OSDynamicCast(OSBoolean, buttonArray->getObject(i));
+        if(result && result->getValue())
+        {
+            shifted |= 1 << i;
+        }
+    }
+    
+    // and which ones pick the layer instead of being buttons
+    OSArray *layerArray = properties ? OSDynamicCast(OSArray, properties->getObject("LayerButtons")) : NULL;
+    layers = 0;
+    for(unsigned int i = 0; layerArray && i < layerArray->getCount(); i++)
+    {
+        OSNumber *number = OSDynamicCast(OSNumber, layerArray->getObject(i));
+        
+        if(number && number->unsigned32BitValue() < (UInt32)kNumOfButtons)
+        {
+            layers |= 1 << number->unsigned32BitValue();
+        }
+        else
+        {
+            IOLog("%s: LayerButtons entry %u isn't a button, skipping it\n", NAME, i);
+        }
+    }
+    
+    result = getBoolean(properties, "ModifierEffectsHat");
+    fHatIsModified = result && result->getValue();
+    layoutButtons(shifted, layers);
+    
+    result = getBoolean(properties, "TwistRudder");
+    fTwistRudder = result && result->getValue();
+    
+    loadAxisCalibration(properties);
+    
+    buildTranslationTables();
+    fReportDescriptorLength = buildReportDescriptor(fReportDescriptor);
+}
+
+void TMCore::loadProfile(const TMProfile *profile)
+{
+    // the same settings loadProperties() reads, already checked by TMProfile::read()
+    fHasRudders = (profile->fSettings & kProfileHasRudder) != 0;
+    fHasThrottle = (profile->fSettings & kProfileHasThrottle) != 0;
+    fRockerIsModifier = fHasThrottle && (profile->fSettings & kProfileRockerIsModifier);
+    fHatIsModified = (profile->fSettings & kProfileModifierEffectsHat) != 0;
+    layoutButtons(profile->fButtons, profile->fLayerButtons);
+    fTwistRudder = (profile->fSettings & kProfileTwistRudder) != 0;
+    
+    fHighResAxes = (profile->fSettings & kProfileHighResAxes) != 0;
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        fAxisCalibration[i] = profile->fAxes[i];
+        checkAxisCalibration(i);
+    }
+    
+    buildTranslationTables();
+    fReportDescriptorLength = buildReportDescriptor(fReportDescriptor);
+}
+
+void TMCore::layoutButtons(UInt16 shifted, UInt16 layers)
+{
+    int     count, layerBits = 0;
+    
+    // setup buttons
+    fNumButtons = 0;
+    if(fHasThrottle)
+    {
+        count = kNumOfButtons;
+    }
+    else
+    {
+        count = kNumOfFCSButtons;
+    }
+    
+    // only so many layer buttons, and only ones the stick has
+    fShiftedButtons = shifted;
+    fLayerButtons = 0;
+    for(int i = 0; i < count; i++)
+    {
+        if(!(layers & (1 << i)))
+        {
+            continue;
+        }
+        if(layerBits == kMaxLayerButtons)
+        {
+            IOLog("%s: Only %d LayerButtons fit, skipping the rest\n", NAME, kMaxLayerButtons);
+            break;
+        }
+        fLayerButtons |= 1 << i;
+        layerBits++;
+    }
+    fNumLayers = (fRockerIsModifier ? kNumModifiers : 1) << layerBits;
+    
+    // a shifted button gets a bit for each layer, the rest get one for all of
+    // them. The layer is the rocker position times 2^layerBits plus the layer
+    // buttons held, so with just the rocker this is the order it always was.
+    for(int i = 0; i < count; i++)
+    {
+        if(fLayerButtons & (1 << i))
+        {
+            for(int j = 0; j < kMaxLayers; j++)
+            {
+                fButtonShifts[i][j] = kNoButton;
+            }
+        }
+        else if((shifted & (1 << i)) && fNumLayers > 1)
+        {
+            for(int j = 0; j < fNumLayers; j++)
+            {
+                fButtonShifts[i][j] = fNumButtons;
+                fNumButtons++;
+            }
+        }
+        else
+        {
+            for(int j = 0; j < fNumLayers; j++)
+            {
+                fButtonShifts[i][j] = fNumButtons;
+            }
+            fNumButtons++;
+        }
+    }
+    fButtonBytes = (fNumButtons <= 32) ? 4 : (fNumButtons <= 64) ? 8 : 16;
+    
+    // same thing with the hat switch
+    if(fHatIsModified && fRockerIsModifier)
+    {
+        fHatSwitchShifts[0] = 0;
+        fHatSwitchShifts[1] = 1;
+        fHatSwitchShifts[2] = 2;
+    }
+    else
+    {
+        fHatSwitchShifts[0] = fHatSwitchShifts[1] = fHatSwitchShifts[2] = 0;
+        fHatIsModified = false;
+    }
+}
+
+// turns on report bit, unless the button doesn't have one
+static inline void setButton(TMButtonBits *buttons, int bit)
+{
+    if(bit != kNoButton)
+    {
+        buttons->word[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+void TMCore::buildTranslationTables()
+{
+    int     layerWeight[kNumOfButtons];
+    int     layerBits = 0;
+    
+    // the next reports can't reuse anything from the last
+    forgetReports();
+    
+    // each layer button held adds its own power of two to the layer, and the
+    // rocker position counts for the next one up
+    for(int i = 0; i < kNumOfButtons; i++)
+    {
+        layerWeight[i] = 0;
+        if(fLayerButtons & (1 << i))
+        {
+            layerWeight[i] = 1 << layerBits;
+            layerBits++;
+        }
+    }
+    for(int nibble = 0; nibble < 16; nibble++)
+    {
+        fFCSLayerTable[nibble] = 0;
+        for(int i = 0; i < kNumOfFCSButtons; i++)
+        {
+            if(nibble & (gFCSButtonMasks[i] >> 4))
+            {
+                fFCSLayerTable[nibble] += layerWeight[i];
+            }
+        }
+    }
+    for(int value = 0; value < 256; value++)
+    {
+        fWCSLayerTable[value] = fRockerIsModifier ? gRockerPositions[value >> 6] << layerBits : 0;
+        for(int i = 0; i < kNumOfWCSButtons; i++)
+        {
+            if(value & (1 << i))
+            {
+                fWCSLayerTable[value] += layerWeight[kNumOfFCSButtons + i];
+            }
+        }
+    }
+    
+    // set up the buttons, reordering the bits so that they make more sense, trigger as button
+    // six is just lame... There is one table per layer so the modifier
+    // shifts are already applied. The FCS buttons are the top nibble of
+    // their byte and the WCS ones the bottom 6 bits of theirs.
+    for(int layer = 0; layer < kMaxLayers; layer++)
+    {
+        for(int nibble = 0; nibble < 16; nibble++)
+        {
+            TMButtonBits    *buttons = &fFCSButtonTable[layer][nibble];
+            
+            for(int w = 0; w < kButtonWords; w++)
+            {
+                buttons->word[w] = 0;
+            }
+            for(int i = 0; i < kNumOfFCSButtons && layer < fNumLayers; i++)
+            {
+                if(nibble & (gFCSButtonMasks[i] >> 4))
+                {
+                    setButton(buttons, fButtonShifts[i][layer]);
+                }
+            }
+        }
+        
+        for(int value = 0; value < 64; value++)
+        {
+            TMButtonBits    *buttons = &fWCSButtonTable[layer][value];
+            
+            for(int w = 0; w < kButtonWords; w++)
+            {
+                buttons->word[w] = 0;
+            }
+            for(int i = 0; i < kNumOfWCSButtons && layer < fNumLayers && fHasThrottle; i++)
+            {
+                if(value & (1 << i))
+                {
+                    setButton(buttons, fButtonShifts[kNumOfFCSButtons + i][layer]);
+                }
+            }
+        }
+    }
+    
+    // the hat switch is a pain
+    // As near as I can tell 15 == null, 0 == up, 1 == up right, 2 == right, and so on...
+    // The table is indexed by the low nibble of the FCS byte and holds report
+    // bytes 4 and 5, including the rocker (which is already known from r).
+    static const UInt8 hatValues[16] =
+    {
+        0,  // nothing
+        1,  // up
+        5,  // down
+        1,  // up + down, up wins
+        3,  // right
+        2,  // up + right
+        4,  // down + right
+        2,  // up + down + right
+        7,  // left
+        8,  // up + left
+        6,  // down + left
+        6,  // up + down + left
+        3,  // right + left, right wins
+        2,  // up + right + left
+        4,  // down + right + left
+        2   // everything
+    };
+    static const UInt8 rockerHat[kNumModifiers] = {1, 0, 5};
+    
+    for(int r = 0; r < kNumModifiers; r++)
+    {
+        for(int nibble = 0; nibble < 16; nibble++)
+        {
+            UInt8 hat = hatValues[nibble];
+            UInt8 low, high;
+            
+            // move the data around based on the rockers position
+            if(fHatIsModified)
+            {
+                if(r == 0)
+                {
+                    low = 0xf0 | hat;
+                    high = 0xff;
+                }
+                else if(r == 1)
+                {
+                    low = (hat << 4) | 0x0f;
+                    high = 0xff;
+                }
+                else
+                {
+                    low = 0xff;
+                    high = hat;
+                }
+            }
+            else
+            {
+                low = hat;
+                high = 0;
+            }
+            
+            // and the rocker switch
+            if(!fRockerIsModifier)
+            {
+                high |= rockerHat[r] << 4;
+            }
+            
+            fHatTable[r][nibble] = low | (high << 8);
+        }
+    }
+    
+    // the hats come after the buttons, then the axes
+    fReportSize = fButtonBytes + 2 + (fHighResAxes ? 2 : 1) * kNumAxes;
+    
+    buildAxisTables();
+}
+
+void TMCore::loadAxisCalibration(OSDictionary *properties)
+{
+    OSDictionary    *axes = properties ? OSDynamicCast(OSDictionary, properties->getObject("Axes")) : NULL;
+    OSBoolean       *result = getBoolean(properties, "HighResolutionAxes");
+    
+    fHighResAxes = result && result->getValue();
+    
+    // each axis can have a dictionary of its own under Axes, anything left out
+    // stays as it always was
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        TMAxisCalibration   *cal = &fAxisCalibration[i];
+        OSDictionary        *axis = axes ? OSDynamicCast(OSDictionary, axes->getObject(gAxisNames[i])) : NULL;
+        
+        cal->min = getNumber(axis, "Min", 0);
+        cal->max = getNumber(axis, "Max", 255);
+        cal->center = getNumber(axis, "Center", (i == kThrottleAxis) ? kNoCenter : 128);
+        cal->deadzone = getNumber(axis, "Deadzone", 0);
+        cal->expo = getNumber(axis, "Expo", 0);
+        cal->sCurve = getNumber(axis, "SCurve", 0);
+        result = axis ? OSDynamicCast(OSBoolean, axis->getObject("Invert")) : NULL;
+        cal->invert = result && result->getValue();
+        cal->hysteresis = getNumber(axis, "Hysteresis", 0);
+        cal->smoothing = getNumber(axis, "Smoothing", 0);
+        checkAxisCalibration(i);
+    }
+}
+
+// pulls anything out of range back in, and gives up on a calibration that
+// doesn't make sense
+void TMCore::checkAxisCalibration(int axis)
+{
+    TMAxisCalibration   *cal = &fAxisCalibration[axis];
+    
+    if(cal->max > 255)
+        cal->max = 255;
+    if(cal->expo > 100)
+        cal->expo = 100;
+    if(cal->sCurve > 100)
+        cal->sCurve = 100;
+    if(cal->hysteresis > 255)
+        cal->hysteresis = 255;
+    if(cal->smoothing > 100)
+        cal->smoothing = 100;
+    if(cal->min < 0 || cal->min >= cal->max ||
+       (cal->center != kNoCenter && (cal->center <= cal->min || cal->center >= cal->max)))
+    {
+        IOLog("%s: The calibration for the %s axis doesn't make sense, ignoring it\n", NAME, gAxisNames[axis]);
+        cal->min = 0;
+        cal->max = 255;
+        cal->center = (axis == kThrottleAxis) ? kNoCenter : 128;
+    }
+}
+
+// the response curve, t and the result are 0 - 65536
+static UInt32 shapeAxis(UInt32 t, int expo, int sCurve)
+{
+    UInt64  t2 = ((UInt64)t * t) >> 16;
+    UInt64  t3 = (t2 * t) >> 16;
+    UInt64  e = expo * 65536 / 100;
+    UInt64  s = sCurve * 65536 / 100;
+    UInt64  y;
+    
+    // expo blends in t^3, the s-curve blends in smoothstep (3t^2 - 2t^3)
+    y = ((65536 - e) * t + e * t3) >> 16;
+    y = ((65536 - s) * y + s * (3 * t2 - 2 * t3)) >> 16;
+    return y;
+}
+
+// how far pos is from start towards end, 0 - 65536
+static UInt32 axisFraction(int pos, int start, int end)
+{
+    if(end <= start || pos >= end)
+        return 65536;
+    if(pos <= start)
+        return 0;
+    return (UInt32)(((UInt64)(pos - start) << 16) / (end - start));
+}
+
+void TMCore::buildAxisTables()
+{
+    UInt32  outMax = fHighResAxes ? 65535 : 255;
+    UInt32  outMid = fHighResAxes ? 32768 : 128;
+    
+    // how much of each new sample the jitter filter takes, out of 256
+    fFilterAxes = false;
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        fAxisFilterWeight[i] = 256 - fAxisCalibration[i].smoothing * 256 / 100;
+        if(fAxisFilterWeight[i] < 1)
+        {
+            fAxisFilterWeight[i] = 1;
+        }
+        fFilterAxes |= fAxisCalibration[i].hysteresis || fAxisCalibration[i].smoothing;
+    }
+    resetAxisFilter();
+    
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        const TMAxisCalibration *cal = &fAxisCalibration[i];
+        bool    identity = cal->min == 0 && cal->max == 255 && cal->deadzone == 0 &&
+                           cal->expo == 0 && cal->sCurve == 0 &&
+                           cal->center == ((i == kThrottleAxis) ? kNoCenter : 128);
+        
+        for(int raw = 0; raw < 256; raw++)
+        {
+            UInt32  out;
+            int     pos;
+            
+            // the x, y and rudder come in as -128 to 127. I convert that to 0 - 255 because a
+            // few programs don't seem to like negative values... The throttle is backwards.
+            pos = (i == kThrottleAxis) ? 255 - raw : (raw + 128) & 0xff;
+            
+            if(identity)
+            {
+                // just the old mapping, spread over 16 bits if need be
+                out = fHighResAxes ? pos * 257 : pos;
+            }
+            else if(cal->center == kNoCenter)
+            {
+                out = (UInt64)shapeAxis(axisFraction(pos, cal->min + cal->deadzone, cal->max), cal->expo, cal->sCurve) * outMax >> 16;
+            }
+            else if(pos > cal->center + cal->deadzone)
+            {
+                UInt32 t = axisFraction(pos, cal->center + cal->deadzone, cal->max);
+                out = outMid + ((UInt64)shapeAxis(t, cal->expo, cal->sCurve) * (outMax - outMid) >> 16);
+            }
+            else if(pos < cal->center - cal->deadzone)
+            {
+                UInt32 t = axisFraction(cal->center - cal->deadzone - pos + cal->min, cal->min, cal->center - cal->deadzone);
+                out = outMid - ((UInt64)shapeAxis(t, cal->expo, cal->sCurve) * outMid >> 16);
+            }
+            else
+            {
+                out = outMid;
+            }
+            
+            if(out > outMax)
+            {
+                out = outMax;
+            }
+            if(cal->invert)
+            {
+                out = outMax - out;
+            }
+            fAxisTable[i][raw] = out;
+        }
+    }
+}
+
+void TMCore::translateButtons(const UInt8 *TMData, UInt8 *data) const
+{
+    UInt8               wcs = TMData[kWCSButtonsByte];
+    UInt8               fcs = TMData[kFCSButtonsByte];
+    int                 rockerPosition = gRockerPositions[wcs >> 6];
+    int                 layer = fFCSLayerTable[fcs >> 4] + fWCSLayerTable[wcs];
+    const TMButtonBits  *fcsButtons = &fFCSButtonTable[layer][fcs >> 4];
+    const TMButtonBits  *wcsButtons = &fWCSButtonTable[layer][wcs & 0x3f];
+    UInt64              buttons[kButtonWords];
+    UInt16              hats;
+    int                 hatByte = fButtonBytes;
+
+    // all the button shuffling, layer picking and hat decoding was done up
+    // front in buildTranslationTables(), so this is just a few lookups
+    for(int w = 0; w < kButtonWords; w++)
+    {
+        buttons[w] = fcsButtons->word[w] | wcsButtons->word[w];
+    }
+    hats = fHatTable[rockerPosition][fcs & 0x0f];
+
+    // the buttons go out little endian (USB order), nearly always in 32 bits
+    OSWriteLittleInt32(data, 0, (UInt32)buttons[0]);
+    for(int i = 4; i < fButtonBytes; i++)
+    {
+        data[i] = (buttons[i >> 3] >> (8 * (i & 7))) & 0xff;
+    }
+    data[hatByte] = hats & 0xff;
+    data[hatByte + 1] = hats >> 8;
+}
+
+void TMCore::translateAxes(const UInt8 *TMData, UInt8 *data) const
+{
+    int     axisByte = fButtonBytes + 2;
+    
+    // the calibration and curves are all in the table
+    if(fHighResAxes)
+    {
+        for(int i = 0; i < kNumAxes; i++)
+        {
+            UInt16 value = fAxisTable[i][TMData[gAxisInputBytes[i]]];
+            
+            data[axisByte + 2 * i] = value & 0xff;
+            data[axisByte + 2 * i + 1] = value >> 8;
+        }
+    }
+    else
+    {
+        for(int i = 0; i < kNumAxes; i++)
+        {
+            data[axisByte + i] = fAxisTable[i][TMData[gAxisInputBytes[i]]];
+        }
+    }
+}
+
+void TMCore::translate(const UInt8 *TMData, UInt8 *data) const
+{
+    translateButtons(TMData, data);
+    translateAxes(TMData, data);
+    
+/*
+    IOLog("%s: Input Data: %02x%02x %02x%02x %02x%02x %02x%02x\n", NAME, TMData[0], TMData[1], TMData[2], TMData[3], TMData[4], TMData[5], TMData[6], TMData[7]);
+    IOLog("%s: Output Data: %02x%02x %02x%02x %02x%02x %02x%02x\n", NAME, data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7]);
+*/
+}
+
+// only the fields of report that depend on the bits of TMData that changed,
+// the rest is left as it was. The axes are a lookup each, cheaper to just
+// redo than to pick out one at a time, it is the buttons that are worth
+// skipping.
+void TMCore::translateChanges(const UInt8 *TMData, UInt64 changed, UInt8 *data) const
+{
+    if(changed & gButtonBits)
+    {
+        translateButtons(TMData, data);
+    }
+    if(changed & ~gButtonBits)
+    {
+        translateAxes(TMData, data);
+    }
+}
+
+int TMCore::buildReport(const UInt8 *TMData)
+{
+    int     next = (fPublished + 1) % kReportBuffers;
+    UInt8   *data = fReportBytes[next];
+    UInt64  input = OSReadLittleInt64(TMData, 0);
+    
+    // the buffer was last built a frame or two ago. The axes move a lot more
+    // often than the buttons, so most of the time only they need doing. New
+    // tables or another profile's mean starting over.
+    if(fReportMap[next] != fMap)
+    {
+        fMap->translate(TMData, data);
+        fReportMap[next] = fMap;
+    }
+    else if(input != fReportInput[next])
+    {
+        fMap->translateChanges(TMData, input ^ fReportInput[next], data);
+    }
+    fReportInput[next] = input;
+    
+    // the other one is left alone until the next report
+    fPublished = next;
+    fReports++;
+    return next;
+}
+
+IOReturn TMCore::getReport(IOMemoryDescriptor *report, const UInt8 *TMData)
+{
+    int     index = buildReport(TMData);
+    
+    report->writeBytes(0, fReportBytes[index], fReportSize);
+    return kIOReturnSuccess;
+}
+
+IOReturn TMCore::copyLastReport(IOMemoryDescriptor *report) const
+{
+    UInt8   data[kMaxReportSize];
+    
+    // nothing sent yet, what the stick is doing
+    if(fPublished < 0)
+    {
+        fMap->translate(fControlData, data);
+        report->writeBytes(0, data, fReportSize);
+    }
+    else
+    {
+        report->writeBytes(0, fReportBytes[fPublished], fReportSize);
+    }
+    return kIOReturnSuccess;
+}
+
+void TMCore::setReportBuffers(UInt8 *first, UInt8 *second)
+{
+    fReportBytes[0] = first ? first : fReportStore[0];
+    fReportBytes[1] = second ? second : fReportStore[1];
+    fPublished = -1;
+    forgetReports();
+}
+
+void TMCore::forgetReports()
+{
+    for(int i = 0; i < kReportBuffers; i++)
+    {
+        fReportMap[i] = NULL;
+    }
+}
+
+int TMCore::buildReportDescriptor(UInt8 *data) const
+{
+    int		x = 0;
+
+    /*
+     we need to build this very evil data structure that lets the hid device
+     know what we look like (ie what buttons and what axis we have).
+
+     Each entry in the data has an one byte op code which looks like this
+     ----------------------------------------
+     | Tag              |  Type  |   Size   |
+     ----------------------------------------
+      7    6    5    4    3    2    1    0
+
+     The size is either 0, 1, 2 or 4 bytes.
+     The type is either main, global, or local
+     The tag specfies what in main global or local we are setting or executing.
+
+     The main items are the ones that cause things to be executed, I am only
+     going to use the inupt command, which takes data that has been set in local
+     or global settings to create a field in the report. After the input
+     command the local data is cleared, but the global data remains and will
+     be used for the next input command unless it is changed.
+
+     Local contains settings specific to a control, such as what it is. =)
+
+     Global contains more general data, such as min and max values. This way
+     if you create 10 different contols that have the same min and max values
+     and you only have to set it once.
+
+     following the op code is a data value, or paramater for the operation
+
+     In the end this is what the report will look like
+    ----------------------------------------------------
+     0 | 1b2 | 0b2 | 2b1 | 1b1 | 0b1 | 2b0 | 1b0 | 0b0 |
+     ----------------------------------------------------
+     1 | 0b5 | 2b4 | 1b4 | 0b4 | 2b3 | 1b3 | 0b3 | 2b2 |
+     ----------------------------------------------------
+     2 | 2b7 | 1b7 | 0b7 | 2b6 | 1b6 | 0b6 | 2b5 | 1b5 |
+     ----------------------------------------------------
+     3 |  u  |  u  | 2b9 | 1b9 | 0b9 | 2b8 | 1b8 | 0b8 |
+     ----------------------------------------------------
+     4 |   FCS Hat Switch 1    |   FCS Hat Switch 0    |
+     ----------------------------------------------------
+     5 |     WCS Hat Switch    |   FCS Hat Switch 2    |
+     ----------------------------------------------------
+     6 |                      X Axis                   |
+     ----------------------------------------------------
+     7 |                      Y Axis                   |
+     ----------------------------------------------------
+     8 |                 Z (Rudder) Axis               |
+     ----------------------------------------------------
+     9 |             Slider (Throttle) Axis            |
+     ----------------------------------------------------
+     
+     With HighResolutionAxes each axis is 16 bits, low byte first, so they
+     take bytes 6 - 13 instead. With more than 32 buttons, from layers, the
+     buttons take 8 or 16 bytes and everything after them moves down.
+     */
+    
+    
+    // first we need to tell the hid thing what sort of device we are
+    // in our case we are a joystick from the generic desktop catagory
+
+    // set the catagory to the generic desktop
+    // usage page (generic desktop)
+    data[x++] = kHIDTagUsagePage | kHIDTypeGlobal | kOneByte;
+    data[x++] = kHIDPage_GenericDesktop;
+    // usaage (joystick)
+    data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
+    data[x++] = kHIDUsage_GD_Joystick;
+
+    // a collection is a grouping of inputs.
+
+    // so start the joystick collection
+    // collection (application)
+    data[x++] = kHIDTagCollection | kHIDTypeMain | kOneByte;
+    data[x++] = 0x01;	// application
+    
+    // setup buttons
+    
+    // switch to the button page
+    data[x++] = kHIDTagUsagePage | kHIDTypeGlobal | kOneByte;
+    data[x++] = kHIDPage_Button;
+    // since it is a button our minimum value is 0
+    data[x++] = kHIDTagLogicalMinimum | kHIDTypeGlobal | kOneByte;
+    data[x++] = 0;
+    data[x++] = kHIDTagPhysicalMinimum | kHIDTypeGlobal | kOneByte;
+    data[x++] = 0;
+    // button has a max value of 1
+    data[x++] = kHIDTagLogicalMaximum | kHIDTypeGlobal | kOneByte;
+    data[x++] = 1;
+    data[x++] = kHIDTagPhysicalMaximum | kHIDTypeGlobal | kOneByte;
+    data[x++] = 1;
+    // we need one bit for each button
+    data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
+    data[x++] = 1;
+    // now tell it the minimum button 1 in our case
+    data[x++] = kHIDTagUsageMinimum | kHIDTypeLocal | kOneByte;
+    data[x++] = 1;
+    // then tell it the maximum button number... which is what we counted when we started
+    data[x++] = kHIDTagUsageMaximum | kHIDTypeLocal | kOneByte;
+    data[x++] = fNumButtons;
+    // we need how ever many fields for the buttons we have
+    data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
+    data[x++] = fNumButtons;
+    // now we need to create the input field...
+    data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
+    data[x++] = 2;	// flag the data as being variable
+    
+    if(fNumButtons < fButtonBytes * 8)
+    {
+        // skip over however many buttons where left over, plus the extra
+        // 2 buttons to round it to the nearest byte
+        data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
+        data[x++] = fButtonBytes * 8 - fNumButtons;
+        // and one count
+        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
+        data[x++] = 1;
+        // create an empty input thing
+        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
+        data[x++] = 1;	// is constant
+    }
+
+    // setup the hat switch
+    for(int i = 0; i < ((fHatIsModified) ? kNumModifiers : 1); i++)
+    {
+        // switch the generic desktop
+        data[x++] = kHIDTagUsagePage | kHIDTypeGlobal | kOneByte;
+        data[x++] = kHIDPage_GenericDesktop;
+        // say that we are a hat switch
+        data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
+        data[x++] = kHIDUsage_GD_Hatswitch;
+        // both logical starts at 1, and physical starts at 0
+        data[x++] = kHIDTagLogicalMinimum | kHIDTypeGlobal | kOneByte;
+        data[x++] = 1;
+        data[x++] = kHIDTagPhysicalMinimum | kHIDTypeGlobal | kOneByte;
+        data[x++] = 0;
+        // we report only 8 different values, but in reality, we move 315 degrees
+        data[x++] = kHIDTagLogicalMaximum | kHIDTypeGlobal | kOneByte;
+        data[x++] = 8;
+        data[x++] = kHIDTagPhysicalMaximum | kHIDTypeGlobal | kTwoBytes;
+        data[x++] = 0x3B;
+        data[x++] = 0x01;
+        // set the report size 4...
+        data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
+        data[x++] = 4;
+        // set the report count to 1
+        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
+        data[x++] = 1;
+        // create the hat switch
+        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
+        data[x++] = 66;	// variable, and has a null state
+    }
+
+    if(!fHatIsModified)
+    {
+        // skip over the extra two entires for the hat switch
+        
+        // set to 8 bits
+        data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
+        data[x++] = 8;
+        // and one count
+        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
+        data[x++] = 1;
+        // create an empty input thing
+        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
+        data[x++] = 1;	// is constant
+    }
+
+
+    if(!fRockerIsModifier && fHasThrottle)
+    {
+        // we also treat the rocker as a hat switch, if it isn't acting as a modifier
+        // switch the generic desktop
+        data[x++] = kHIDTagUsagePage | kHIDTypeGlobal | kOneByte;
+        data[x++] = kHIDPage_GenericDesktop;
+        // say that we are a hat switch
+        data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
+        data[x++] = kHIDUsage_GD_Hatswitch;
+        // both logical starts at 1, and physical starts at 0
+        data[x++] = kHIDTagLogicalMinimum | kHIDTypeGlobal | kOneByte;
+        data[x++] = 1;
+        data[x++] = kHIDTagPhysicalMinimum | kHIDTypeGlobal | kOneByte;
+        data[x++] = 0;
+        // we report only 8 different values, but in reality, we do 2
+        data[x++] = kHIDTagLogicalMaximum | kHIDTypeGlobal | kOneByte;
+        data[x++] = 8;
+        data[x++] = kHIDTagPhysicalMaximum | kHIDTypeGlobal | kTwoBytes;
+        data[x++] = 0x3B;
+        data[x++] = 0x01;
+        // set the report size 8...
+        data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
+        data[x++] = 4;
+        // set the report count to 1
+        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
+        data[x++] = 1;
+        // create the hat switch
+        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
+        data[x++] = 66;	// variable, and has a null state
+    }
+    else
+    {
+        // rocker was used as modifer or we have no throttle... don't let it show up
+        
+        // set 4 bits
+        data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
+        data[x++] = 4;
+        // and one count
+        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
+        data[x++] = 1;
+        // create an empty input thing
+        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
+        data[x++] = 1;	// is constant
+    }
+    
+    // do axis
+    // set report size to 8, or 16 for high resolution
+    data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
+    data[x++] = fHighResAxes ? 16 : 8;
+    // set min to 0
+    data[x++] = kHIDTagLogicalMinimum | kHIDTypeGlobal | kOneByte;
+    data[x++] = 0;
+    data[x++] = kHIDTagPhysicalMinimum | kHIDTypeGlobal | kOneByte;
+    data[x++] = 0;
+    if(fHighResAxes)
+    {
+        // a max value of 65535, which needs 4 bytes or it would be -1
+        data[x++] = kHIDTagLogicalMaximum | kHIDTypeGlobal | kFourBytes;
+        data[x++] = 0xff;
+        data[x++] = 0xff;
+        data[x++] = 0;
+        data[x++] = 0;
+        data[x++] = kHIDTagPhysicalMaximum | kHIDTypeGlobal | kFourBytes;
+        data[x++] = 0xff;
+        data[x++] = 0xff;
+        data[x++] = 0;
+        data[x++] = 0;
+    }
+    else
+    {
+        // button has a max value of 255
+        data[x++] = kHIDTagLogicalMaximum | kHIDTypeGlobal | kTwoBytes;
+        data[x++] = 255;
+        data[x++] = 0;
+        data[x++] = kHIDTagPhysicalMaximum | kHIDTypeGlobal | kTwoBytes;
+        data[x++] = 255;
+        data[x++] = 0;
+    }
+
+    // say that we are coming from the generic desktop catagory
+    data[x++] = kHIDTagUsagePage | kHIDTypeGlobal | kOneByte;
+    data[x++] = kHIDPage_GenericDesktop;
+    // say that we are using x, and y
+    data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
+    data[x++] = kHIDUsage_GD_X;
+    data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
+    data[x++] = kHIDUsage_GD_Y;
+    // we need two spots
+    data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
+    data[x++] = 2;
+    // create the input
+    data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
+    data[x++] = 2;	// flag as being variable
+
+    if(fHasRudders)
+    {
+        // we need the z axis
+        data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
+        
+        if(fTwistRudder)
+        {
+            data[x++] = kHIDUsage_GD_Rz;
+        }
+        else
+        {
+            data[x++] = kHIDUsage_GD_Z;
+        }
+        // we need one spots
+        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
+        data[x++] = 1;
+        // create the input
+        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
+        data[x++] = 2;	// flag as being variable
+    }
+    else
+    {
+        // even though we didn't have one, I still want to leave space to make it easier
+        // when actually creating the report
+        // and one count
+        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
+        data[x++] = 1;
+        // create an empty input thing
+        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
+        data[x++] = 1;	// is constant
+    }
+
+    if(fHasThrottle)
+    {
+        // we need the slider
+        data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
+        data[x++] = kHIDUsage_GD_Slider;
+        // we need two spots
+        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
+        data[x++] = 1;
+        // create the input
+        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
+        data[x++] = 2;	// flag as being variable
+    }
+    else
+    {
+        // even though we didn't have one, I still want to leave space to make it easier
+        // when actually creating the report
+        // and one count
+        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
+        data[x++] = 1;
+        // create an empty input thing
+        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
+        data[x++] = 1;	// is constant
+    }
+
+    // and end the joystick collection
+    data[x++] = kHIDTagEndCollection | kHIDTypeMain | kZeroBytes;
+
+    return x;
+}
+
+bool TMCore::handleHalfFrame(const UInt8 *data, IOByteCount length)
+{
+    int     index = 0;
+    int     half = kFirstHalfPending;
+    
+    // anything short is junk, we can't tell what it belongs to
+    if(length != kHalfFrameSize)
+    {
+        fBadHalves++;
+        return false;
+    }
+    
+    // the full 8 bytes of data is returned in two 4 byte chucks, pick
+    // the right offset into the 8 byte control data. Any other tag isn't
+    // one of the stick's halves.
+    if(data[kHalfFrameTagByte] == kSecondHalfTag)
+    {
+        index = 4;
+        half = kSecondHalfPending;
+    }
+    else if(data[kHalfFrameTagByte] != kFirstHalfTag)
+    {
+        fBadHalves++;
+        return false;
+    }
+    
+    // if we already have this half then its partner got lost, the newer one wins
+    if(fPendingHalves & half)
+    {
+        fUnpairedHalves++;
+    }
+    
+    for(int i = 0; i < kHalfFrameDataSize; i++)
+    {
+        fPendingData[index + i] = data[4 + i];
+    }
+    fPendingHalves |= half;
+    
+    // wait until we have both halves so we never report half of a move
+    if(fPendingHalves != kBothHalvesPending)
+    {
+        return false;
+    }
+    
+    return flushHalfFrame();
+}
+
+bool TMCore::flushHalfFrame()
+{
+    bool    changed = false;
+    bool    jittered = false;
+    UInt64  control, diff;
+    
+    if(fPendingHalves == 0)
+    {
+        return false;
+    }
+    
+    // a lone half gets paired up with whatever we had last time
+    if(fPendingHalves != kBothHalvesPending)
+    {
+        fUnpairedHalves++;
+    }
+    
+    // the axes are all in the first half
+    if(fMap->fFilterAxes && (fPendingHalves & kFirstHalfPending))
+    {
+        for(int i = 0; i < kNumAxes; i++)
+        {
+            jittered |= fControlData[gAxisInputBytes[i]] != fPendingData[gAxisInputBytes[i]];
+        }
+        filterAxes();
+    }
+    
+    // check to see if there was a change, all 8 bytes at once
+    control = OSReadLittleInt64(fControlData, 0);
+    diff = (control ^ OSReadLittleInt64(fPendingData, 0)) & gHalfBits[fPendingHalves];
+    if(diff)
+    {
+        OSWriteLittleInt64(fControlData, 0, control ^ diff);
+        fChangedFrames++;
+        changed = true;
+    }
+    fPendingHalves = 0;
+    fFrames++;
+    
+    if(jittered && !changed)
+    {
+        fSuppressedFrames++;
+    }
+    
+    return changed;
+}
+
+// the x, y and rudder are signed, flip the top bit so they are in order
+static inline int axisFlip(int axis)
+{
+    return (axis == kThrottleAxis) ? 0 : 0x80;
+}
+
+void TMCore::filterAxes()
+{
+    // Rewrites the axes in fPendingData before they are compared against
+    // fControlData. A move bigger than the hysteresis goes straight through
+    // so real movement is never held back. Anything smaller is either dropped,
+    // or with smoothing, fed into a running average which is what gets
+    // reported, so a stick that really did move by a hair gets there in the end.
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        const TMAxisCalibration *cal = &fMap->fAxisCalibration[i];
+        int     byte = gAxisInputBytes[i];
+        int     flip = axisFlip(i);
+        int     value = fPendingData[byte] ^ flip;
+        int     reported = fControlData[byte] ^ flip;
+        int     delta = value - reported;
+        
+        if(delta > cal->hysteresis || delta < -cal->hysteresis)
+        {
+            fAxisFiltered[i] = value << 8;
+            continue;
+        }
+        
+        if(cal->smoothing)
+        {
+            fAxisFiltered[i] += ((value << 8) - fAxisFiltered[i]) * fMap->fAxisFilterWeight[i] / 256;
+            value = (fAxisFiltered[i] + 128) >> 8;
+        }
+        else
+        {
+            value = reported;
+        }
+        fPendingData[byte] = value ^ flip;
+    }
+}
+
+void TMCore::adoptSettings(const TMCore *from)
+{
+    fHasRudders = from->fHasRudders;
+    fHasThrottle = from->fHasThrottle;
+    fRockerIsModifier = from->fRockerIsModifier;
+    fShiftedButtons = from->fShiftedButtons;
+    fLayerButtons = from->fLayerButtons;
+    fNumLayers = from->fNumLayers;
+    fNumButtons = from->fNumButtons;
+    fButtonBytes = from->fButtonBytes;
+    fHatIsModified = from->fHatIsModified;
+    fTwistRudder = from->fTwistRudder;
+    fHighResAxes = from->fHighResAxes;
+    fReportSize = from->fReportSize;
+    fFilterAxes = from->fFilterAxes;
+    
+    bcopy(from->fButtonShifts, fButtonShifts, sizeof(fButtonShifts));
+    bcopy(from->fHatSwitchShifts, fHatSwitchShifts, sizeof(fHatSwitchShifts));
+    bcopy(from->fAxisCalibration, fAxisCalibration, sizeof(fAxisCalibration));
+    bcopy(from->fAxisFilterWeight, fAxisFilterWeight, sizeof(fAxisFilterWeight));
+    
+    bcopy(from->fFCSLayerTable, fFCSLayerTable, sizeof(fFCSLayerTable));
+    bcopy(from->fWCSLayerTable, fWCSLayerTable, sizeof(fWCSLayerTable));
+    bcopy(from->fFCSButtonTable, fFCSButtonTable, sizeof(fFCSButtonTable));
+    bcopy(from->fWCSButtonTable, fWCSButtonTable, sizeof(fWCSButtonTable));
+    bcopy(from->fHatTable, fHatTable, sizeof(fHatTable));
+    bcopy(from->fAxisTable, fAxisTable, sizeof(fAxisTable));
+    
+    bcopy(from->fReportDescriptor, fReportDescriptor, from->fReportDescriptorLength);
+    fReportDescriptorLength = from->fReportDescriptorLength;
+    
+    forgetReports();
+    
+    // the filter may have been off, start it from where the axes are now
+    resetAxisFilter();
+}
+
+bool TMCore::sameLayout(const TMCore *other) const
+{
+    return fReportSize == other->fReportSize &&
+           fReportDescriptorLength == other->fReportDescriptorLength &&
+           bcmp(fReportDescriptor, other->fReportDescriptor, fReportDescriptorLength) == 0;
+}
+
+void TMCore::resetAxisFilter()
+{
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        fAxisFiltered[i] = (fControlData[gAxisInputBytes[i]] ^ axisFlip(i)) << 8;
+    }
+}
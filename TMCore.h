@@ -0,0 +1,246 @@
+/*
+ File:		TMCore.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ The part of the driver that doesn't care about IOKit. It turns the raw data
+ from the iMate into HID reports and builds the report descriptor. The kext
+ wraps this up in com_milvich_driver_Thrustmaster, and on other platforms it
+ is built against the stand-ins in shim/ so we can poke at it off a Mac.
+ */
+
+#ifndef __TMCORE__
+#define __TMCORE__
+
+#ifdef KERNEL
+#include <IOKit/IOTypes.h>
+#include <IOKit/IOLib.h>
+#include <IOKit/IOMemoryDescriptor.h>
+#include <IOKit/hidsystem/IOHidUsageTables.h>
+#include <libkern/c++/OSContainers.h>
+#include <libkern/OSAtomic.h>
+#include <libkern/OSByteOrder.h>
+#include <kern/clock.h>
+#else
+#include "IOKitShim.h"
+#endif
+
+#include "Constants.h"
+
+#define NAME "TM"
+
+// this is the size of the HID report
+#define kReportSize		10
+
+// the axes, in report order
+enum {
+    kXAxis                      = 0,
+    kYAxis,
+    kRudderAxis,
+    kThrottleAxis,
+    kNumAxes
+};
+
+// Layers: each button can report as a different button depending on which
+// layer is picked. The rocker picks one of kNumModifiers when it is a
+// modifier, and each of the LayerButtons doubles that while it is held, so
+// two of them and the rocker make 12 layers. A layer button doesn't report
+// itself.
+#define kMaxLayerButtons	2
+#define kMaxLayers		(kNumModifiers << kMaxLayerButtons)
+
+// the buttons go out as 32, 64 or 128 bits, whatever the count fits in
+#define kMaxButtons		128
+#define kButtonWords		(kMaxButtons / 64)
+#define kNoButton		0xff
+
+struct TMButtonBits
+{
+    UInt64                      word[kButtonWords];
+};
+
+// with HighResolutionAxes each axis takes two bytes, and more buttons push
+// the hats and axes further down
+#define kMaxReportSize		(kReportSize + kNumAxes + (kMaxButtons - 32) / 8)
+
+// reports are built in turn into this many buffers
+#define kReportBuffers		2
+
+// an axis with no center, like the throttle
+#define kNoCenter		-1
+
+// the iMate hands us the 8 bytes of control data in two halves, each read is
+// a 4 byte header followed by 4 bytes of data
+#define kHalfFrameSize		8
+#define kHalfFrameDataSize	4
+#define kControlDataSize	8
+
+// byte 2 of the header tells the halves apart. Anything else in it is an
+// answer to an ADB command, see TMPoll.h
+#define kHalfFrameTagByte	2
+#define kFirstHalfTag		0x18
+#define kSecondHalfTag		0x98
+
+// which halves are waiting for their partner
+enum {
+    kFirstHalfPending		= 1,
+    kSecondHalfPending		= 2,
+    kBothHalvesPending		= kFirstHalfPending | kSecondHalfPending
+};
+
+// uptime in nanoseconds, for timestamping frames
+static inline UInt64 TMNanoseconds()
+{
+    UInt64  now, ns;
+    
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now, &ns);
+    return ns;
+}
+
+// the most the report descriptor can grow to
+#define kMaxReportDescriptorSize	255
+
+// the size of each piece of the report descriptor, see buildReportDescriptor().
+// These are only used to check at compile time that the worst case fits.
+enum {
+    kDescHeaderBytes            = 6,
+    kDescButtonBytes            = 20,
+    kDescPaddingBytes           = 6,
+    kDescHatBytes               = 19,
+    kDescAxisBytes              = 26,     // 16 bit axes need 4 byte maximums
+    kDescExtraAxisBytes         = 6,
+    kDescEndBytes               = 1,
+    kDescWorstCaseBytes         = kDescHeaderBytes + kDescButtonBytes + kDescPaddingBytes +
+                                  kNumModifiers * kDescHatBytes + kDescHatBytes +
+                                  kDescAxisBytes + 2 * kDescExtraAxisBytes + kDescEndBytes
+};
+
+// how to map one axis, all in the 0 - 255 units of the 8 bit report
+struct TMAxisCalibration
+{
+    int                         min;
+    int                         max;
+    int                         center;             // kNoCenter for the throttle
+    int                         deadzone;           // either side of center, or above min
+    int                         expo;               // 0 - 100, flatter in the middle
+    int                         sCurve;             // 0 - 100, flatter at the middle and the ends
+    bool                        invert;
+
+    // jitter filter, in raw units, see filterAxes()
+    int                         hysteresis;         // changes this size or smaller don't count
+    int                         smoothing;          // 0 - 100, how slowly small changes creep in
+};
+
+class TMProfile;
+
+class TMCore
+{
+public:
+    bool                        fHasRudders;
+    bool                        fHasThrottle;
+    bool                        fRockerIsModifier;
+    UInt16                      fShiftedButtons;    // bit n if button n differs by layer
+    UInt16                      fLayerButtons;      // bit n if button n picks the layer
+    int                         fNumLayers;
+    UInt8                       fButtonShifts[kNumOfButtons][kMaxLayers];     // report bit, or kNoButton
+    char                        fHatSwitchShifts[kNumModifiers];
+    int                         fNumButtons;
+    int                         fButtonBytes;       // 4, 8 or 16
+    bool                        fHatIsModified;
+    bool                        fTwistRudder;
+
+    // axis calibration, compiled into fAxisTable
+    TMAxisCalibration           fAxisCalibration[kNumAxes];
+    bool                        fHighResAxes;
+    int                         fReportSize;
+
+    // translation tables, built by buildTranslationTables(). The layer is
+    // fFCSLayerTable[] + fWCSLayerTable[], then the buttons in the top nibble
+    // of the FCS byte and the bottom 6 bits of the WCS byte are looked up
+    // in that layer.
+    UInt8                       fFCSLayerTable[16];
+    UInt8                       fWCSLayerTable[256];
+    TMButtonBits                fFCSButtonTable[kMaxLayers][16];
+    TMButtonBits                fWCSButtonTable[kMaxLayers][64];
+    UInt16                      fHatTable[kNumModifiers][16];
+    UInt16                      fAxisTable[kNumAxes][256];     // by raw byte
+
+    // jitter filter state, the filtered value of each axis in 1/256ths
+    bool                        fFilterAxes;
+    int                         fAxisFilterWeight[kNumAxes];
+    int                         fAxisFiltered[kNumAxes];
+
+    // whose tables getReport() and the jitter filter use. This core's own
+    // unless another profile has been switched in, see TMProfileSet.
+    const TMCore                *fMap;
+
+    // the report descriptor for the current settings, built along with the tables
+    UInt8                       fReportDescriptor[kMaxReportDescriptorSize];
+    int                         fReportDescriptorLength;
+
+    // the last full state we got from the stick
+    UInt8                       fControlData[kControlDataSize];
+
+    // the reports buildReport() builds, taking turns so the one last sent is
+    // left alone while the next is built. They are the kext's report buffers
+    // once setReportBuffers() is called, fReportStore until then. Each
+    // remembers what it was built from so only the fields that changed since
+    // are translated again, fReportMap is NULL when it has to start over.
+    UInt8                       *fReportBytes[kReportBuffers];
+    UInt8                       fReportStore[kReportBuffers][kMaxReportSize];
+    UInt64                      fReportInput[kReportBuffers];
+    const TMCore                *fReportMap[kReportBuffers];
+    int                         fPublished;         // the last one built, -1 for none
+    
+    // the halves we have seen so far of the frame being put together
+    UInt8                       fPendingData[kControlDataSize];
+    int                         fPendingHalves;
+
+    // frame assembly counters
+    UInt32                      fFrames;            // committed to fControlData, changed or not
+    UInt32                      fBadHalves;         // wrong size or tag
+    UInt32                      fUnpairedHalves;    // replaced or flushed before the partner showed up
+    UInt32                      fSuppressedFrames;  // changed, but only by jitter
+    UInt32                      fChangedFrames;     // changed fControlData
+    UInt32                      fReports;           // built by buildReport()
+
+public:
+    void init();
+    void loadProperties(OSDictionary *properties);
+    void loadProfile(const TMProfile *profile);
+    void layoutButtons(UInt16 shifted, UInt16 layers);
+    void buildTranslationTables();
+    void loadAxisCalibration(OSDictionary *properties);
+    void checkAxisCalibration(int axis);
+    void buildAxisTables();
+
+    // new settings are loaded into a core of their own, then the settings
+    // and tables are copied over. The frame being put together and the
+    // counters stay.
+    void adoptSettings(const TMCore *from);
+    bool sameLayout(const TMCore *other) const;
+
+    void translate(const UInt8 *TMData, UInt8 *report) const;
+    void translateChanges(const UInt8 *TMData, UInt64 changed, UInt8 *report) const;
+    void translateButtons(const UInt8 *TMData, UInt8 *report) const;
+    void translateAxes(const UInt8 *TMData, UInt8 *report) const;
+    int buildReportDescriptor(UInt8 *data) const;
+
+    // builds the next report in place and returns which buffer it is in.
+    // getReport() copies it out as well, copyLastReport() copies out the
+    // last one without building anything. All of them on the same thread,
+    // a report can be rebuilt while somebody else is copying it.
+    int buildReport(const UInt8 *TMData);
+    IOReturn getReport(IOMemoryDescriptor *report, const UInt8 *TMData);
+    IOReturn copyLastReport(IOMemoryDescriptor *report) const;
+    void setReportBuffers(UInt8 *first, UInt8 *second);
+    void forgetReports();
+
+    bool handleHalfFrame(const UInt8 *data, IOByteCount length);
+    bool flushHalfFrame();
+    void filterAxes();
+    void resetAxisFilter();
+    bool isPairing() const { return fPendingHalves != 0; }
+};
+
+#endif
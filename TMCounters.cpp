@@ -0,0 +1,136 @@
+/*
+ File:		TMCounters.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMCounters.h"
+
+void TMCounters::init(UInt64 now)
+{
+    for(int i = 0; i < kNumCounts; i++)
+    {
+        fCounts[i] = 0;
+        fRates[i] = 0;
+    }
+    fTime = now;
+    fInterval = 0;
+    fPeakOutstandingIO = 0;
+}
+
+void TMCounters::update(const TMLink *link, const TMCore *core, UInt64 now)
+{
+    UInt32  counts[kNumCounts];
+    
+    for(int i = 0; i < kNumCounts; i++)
+    {
+        counts[i] = 0;
+    }
+    for(int i = 0; i < kMaxReadsInFlight; i++)
+    {
+        counts[kCountHalves] += link->fReadCounters[i].halves;
+        counts[kCountRearms] += link->fReadCounters[i].rearms;
+    }
+    for(int i = 0; i < kMaxReadErrorCodes; i++)
+    {
+        counts[kCountReadErrors] += link->fReadErrors[i].count;
+    }
+    counts[kCountReadErrors] += link->fOtherReadErrors;
+    counts[kCountChangedFrames] = core->fChangedFrames;
+    counts[kCountReports] = core->fReports;
+    counts[kCountBadHalves] = core->fBadHalves;
+    counts[kCountUnpairedHalves] = core->fUnpairedHalves;
+    counts[kCountSuppressedFrames] = core->fSuppressedFrames;
+    counts[kCountOverlappedReads] = link->fOverlappedReads;
+    
+    // the counts wrap, the difference is still right for one wrap
+    if(now > fTime)
+    {
+        fInterval = now - fTime;
+        for(int i = 0; i < kNumCounts; i++)
+        {
+            fRates[i] = (UInt32)((UInt64)(counts[i] - fCounts[i]) * 1000000000ULL / fInterval);
+        }
+        fTime = now;
+    }
+    for(int i = 0; i < kNumCounts; i++)
+    {
+        fCounts[i] = counts[i];
+    }
+    fPeakOutstandingIO = link->fPeakOutstandingIO;
+}
+
+const char* TMCounters::countName(int count)
+{
+    static const char *names[kNumCounts] =
+    {
+        "Halves",
+        "ChangedFrames",
+        "Reports",
+        "Rearms",
+        "ReadErrors",
+        "BadHalves",
+        "UnpairedHalves",
+        "SuppressedFrames",
+        "OverlappedReads"
+    };
+    
+    if(count < 0 || count >= kNumCounts)
+    {
+        return "Unknown";
+    }
+    return names[count];
+}
+
+OSDictionary* TMCounters::copyDictionary(const TMLink *link) const
+{
+    OSDictionary    *result = OSDictionary::withCapacity(kNumCounts * 2 + 3);
+    OSDictionary    *errors = OSDictionary::withCapacity(kMaxReadErrorCodes + 1);
+    OSNumber        *number;
+    char            key[32];
+    
+    if(!result || !errors)
+    {
+        if(result)
+            result->release();
+        if(errors)
+            errors->release();
+        return NULL;
+    }
+    
+    // each count, and how many a second as "<count>PerSecond"
+    for(int i = 0; i < kNumCounts; i++)
+    {
+        number = OSNumber::withNumber(fCounts[i], 32);
+        result->setObject(countName(i), number);
+        number->release();
+        snprintf(key, sizeof(key), "%sPerSecond", countName(i));
+        number = OSNumber::withNumber(fRates[i], 32);
+        result->setObject(key, number);
+        number->release();
+    }
+    number = OSNumber::withNumber(fInterval / 1000000, 32);
+    result->setObject("RateInterval", number);
+    number->release();
+    number = OSNumber::withNumber(fPeakOutstandingIO, 32);
+    result->setObject("PeakOutstandingIO", number);
+    number->release();
+    
+    // the read errors by status, in hex like the log has them
+    for(int i = 0; i < kMaxReadErrorCodes && link->fReadErrors[i].status; i++)
+    {
+        snprintf(key, sizeof(key), "%08x", (unsigned)link->fReadErrors[i].status);
+        number = OSNumber::withNumber(link->fReadErrors[i].count, 32);
+        errors->setObject(key, number);
+        number->release();
+    }
+    if(link->fOtherReadErrors)
+    {
+        number = OSNumber::withNumber(link->fOtherReadErrors, 32);
+        errors->setObject("Other", number);
+        number->release();
+    }
+    result->setObject("ReadErrorsByStatus", errors);
+    errors->release();
+    
+    return result;
+}
@@ -0,0 +1,63 @@
+/*
+ File:		TMCounters.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Always on counters, for finding out what the driver has been doing over a
+ long session without turning anything on. Each count is kept where the work
+ happens and only ever written by the one thread doing it: the halves and
+ re-arms per read slot in TMLink, whose completions run one at a time, the
+ frames and reports in TMCore on the dispatch loop. Counting is one
+ increment, with no locking. OverlappedReads says if the completions ever
+ did run at the same time, in which case the rest can't be trusted.
+
+ TMCounters adds them up every kCountersInterval on the dispatch loop, and
+ works out how many a second there were since the time before. The driver
+ puts the result in the registry from there, so looking at it doesn't
+ change anything.
+ */
+
+#ifndef __TMCOUNTERS__
+#define __TMCOUNTERS__
+
+#include "TMCore.h"
+#include "TMLink.h"
+
+enum {
+    kCountHalves                = 0,    // reads that came back with data
+    kCountChangedFrames,                // frames that changed the stick's state
+    kCountReports,                      // reports built
+    kCountRearms,                       // reads put back on the pipe
+    kCountReadErrors,                   // reads that failed, by status in the dictionary
+    kCountBadHalves,
+    kCountUnpairedHalves,
+    kCountSuppressedFrames,
+    kCountOverlappedReads,              // read completions that ran at the same time, should be 0
+    kNumCounts
+};
+
+// ms between update()s
+#define kCountersInterval       1000
+
+class TMCounters
+{
+public:
+    UInt32                      fCounts[kNumCounts];
+    UInt32                      fRates[kNumCounts]; // a second, since the update() before
+    UInt64                      fTime;              // ns, when update() last ran
+    UInt64                      fInterval;          // ns the rates are over
+    SInt32                      fPeakOutstandingIO;
+
+public:
+    void init(UInt64 now);
+
+    // reads the link's and the core's counters, none of which are locked, so
+    // they can be a frame behind
+    void update(const TMLink *link, const TMCore *core, UInt64 now);
+
+    static const char* countName(int count);
+
+    // the counts from the last update, their rates and the read errors
+    OSDictionary* copyDictionary(const TMLink *link) const;
+};
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ File:		TMFrameRing.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMFrameRing.h"
+
+void TMFrameRing::init()
+{
+    fHead = 0;
+    fTail = 0;
+    fOverruns = 0;
+}
+
+void TMFrameRing::push(const UInt8 *data, UInt32 length, UInt64 timestamp)
+{
+    UInt32      head = fHead;
+    UInt32      tail = fTail;
+    TMRawFrame  *frame;
+    
+    // if we are full, throw away the oldest frame. If the swap fails the
+    // consumer just took it, so there is room either way.
+    if(head - tail == kFrameRingSize)
+    {
+        if(OSCompareAndSwap(tail, tail + 1, &fTail))
+        {
+            fOverruns++;
+        }
+    }
+    
+    frame = &fFrames[head & kFrameRingMask];
+    frame->timestamp = timestamp;
+    frame->length = (length > kHalfFrameSize) ? kHalfFrameSize : length;
+    for(UInt32 i = 0; i < frame->length; i++)
+    {
+        frame->data[i] = data[i];
+    }
+    
+    // make sure the frame is all there before the consumer can see it
+    OSMemoryBarrier();
+    fHead = head + 1;
+}
+
+bool TMFrameRing::pop(TMRawFrame *frame)
+{
+    for(;;)
+    {
+        UInt32 tail = fTail;
+        
+        if(tail == fHead)
+        {
+            return false;
+        }
+        OSMemoryBarrier();
+        
+        *frame = fFrames[tail & kFrameRingMask];
+        OSMemoryBarrier();
+        
+        // the producer only writes over this slot after moving the tail past
+        // it, so if the swap works the copy is good. If it fails the frame
+        // was dropped while we were copying it, so try the next one.
+        if(OSCompareAndSwap(tail, tail + 1, &fTail))
+        {
+            return true;
+        }
+    }
+}
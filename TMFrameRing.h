@@ -0,0 +1,45 @@
+/*
+ File:		TMFrameRing.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ A lock free ring that carries raw half frames from the USB completion (the
+ only producer) to the dispatch work loop (the only consumer). The producer
+ never waits: if the consumer falls behind the oldest frame is thrown away
+ so the newest state always gets through.
+ */
+
+#ifndef __TMFRAMERING__
+#define __TMFRAMERING__
+
+#include "TMCore.h"
+
+// must be a power of 2
+#define kFrameRingSize		32
+#define kFrameRingMask		(kFrameRingSize - 1)
+
+struct TMRawFrame
+{
+    UInt64      timestamp;              // TMNanoseconds() when the read completed
+    UInt32      length;                 // how many bytes the read returned
+    UInt8       data[kHalfFrameSize];
+};
+
+class TMFrameRing
+{
+public:
+    // fHead is only written by the producer. fTail is moved by the consumer
+    // as it takes frames, and by the producer when it has to drop one, so
+    // both of them move it with a compare and swap.
+    volatile UInt32             fHead;
+    volatile UInt32             fTail;
+    UInt32                      fOverruns;
+    TMRawFrame                  fFrames[kFrameRingSize];
+
+public:
+    void init();
+    void push(const UInt8 *data, UInt32 length, UInt64 timestamp);
+    bool pop(TMRawFrame *frame);
+    bool isEmpty() const { return fHead == fTail; }
+};
+
+#endif
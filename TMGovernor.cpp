@@ -0,0 +1,145 @@
+/*
+ File:		TMGovernor.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMGovernor.h"
+
+// never tick faster than this, it would just be a busier no limit
+#define kMaxReportRate		1000
+
+// everything after the axes is buttons and the hat
+static bool buttonsChanged(const UInt8 *data, const UInt8 *sent)
+{
+    for(int i = kWCSButtonsByte; i < kControlDataSize; i++)
+    {
+        if(data[i] != sent[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TMGovernor::noteDelay(UInt64 delay)
+{
+    fDelayed++;
+    fTotalDelay += delay;
+    if(delay > fMaxDelay)
+    {
+        fMaxDelay = delay;
+    }
+}
+
+void TMGovernor::init()
+{
+    fRate = 0;
+    fPeriod = 0;
+    fNextTick = 0;
+    fHolding = false;
+    fHeldSince = 0;
+    for(int i = 0; i < kControlDataSize; i++)
+    {
+        fHeldData[i] = 0;
+    }
+    
+    fPublished = 0;
+    fButtonFlushes = 0;
+    fCoalesced = 0;
+    fWakeups = 0;
+    fDelayed = 0;
+    fMaxDelay = 0;
+    fTotalDelay = 0;
+}
+
+void TMGovernor::loadProperties(OSDictionary *properties)
+{
+    OSNumber    *rate = properties ? OSDynamicCast(OSNumber, properties->getObject("ReportRate")) : NULL;
+    
+    init();
+    if(!rate || rate->unsigned32BitValue() == 0)
+    {
+        return;
+    }
+    
+    fRate = rate->unsigned32BitValue();
+    if(fRate > kMaxReportRate)
+    {
+        fRate = kMaxReportRate;
+    }
+    fPeriod = 1000000000ULL / fRate;
+}
+
+int TMGovernor::offer(UInt64 now, const UInt8 *data, const UInt8 *sent)
+{
+    if(!fRate)
+    {
+        fPublished++;
+        return kGovernorSend;
+    }
+    
+    // a button or the hat, send it and anything held along with it
+    if(buttonsChanged(data, sent))
+    {
+        if(fHolding)
+        {
+            noteDelay(now - fHeldSince);
+            fHolding = false;
+        }
+        fNextTick = tickAfter(now);
+        fButtonFlushes++;
+        fPublished++;
+        return kGovernorSend;
+    }
+    
+    // nothing has gone out this tick, no need to wait
+    if(!fHolding && now >= fNextTick)
+    {
+        fNextTick = tickAfter(now);
+        fPublished++;
+        return kGovernorSend;
+    }
+    
+    for(int i = 0; i < kControlDataSize; i++)
+    {
+        fHeldData[i] = data[i];
+    }
+    if(fHolding)
+    {
+        fCoalesced++;
+        return kGovernorCoalesced;
+    }
+    fHolding = true;
+    fHeldSince = now;
+    return kGovernorHold;
+}
+
+bool TMGovernor::tick(UInt64 now, const UInt8 *sent, UInt8 *data)
+{
+    bool    same = true;
+    
+    if(!fHolding)
+    {
+        return false;
+    }
+    fHolding = false;
+    fWakeups++;
+    
+    // an early timer mustn't let two reports into the same tick
+    fNextTick = tickAfter(now > fNextTick ? now : fNextTick);
+    
+    // the axes may have gone back to where they were
+    for(int i = 0; i < kControlDataSize; i++)
+    {
+        data[i] = fHeldData[i];
+        same = same && (data[i] == sent[i]);
+    }
+    if(same)
+    {
+        return false;
+    }
+    
+    noteDelay(now - fHeldSince);
+    fPublished++;
+    return true;
+}
@@ -0,0 +1,66 @@
+/*
+ File:		TMGovernor.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Caps how many reports go out a second. A quick sweep of the stick can
+ change the axes far more often than anything reads them, so with a
+ ReportRate set, axis changes are held and only the latest one is sent at
+ the next tick of a fixed cadence. Ticks are multiples of the period in
+ uptime, so at most one report goes out per tick and none waits longer
+ than a period. Button and hat changes never wait, they go out right away
+ along with whatever axis changes were being held.
+ */
+
+#ifndef __TMGOVERNOR__
+#define __TMGOVERNOR__
+
+#include "TMCore.h"
+
+// what to do with a change, see offer()
+enum {
+    kGovernorSend               = 0,        // publish it now
+    kGovernorHold,                          // held, start the timer for fNextTick
+    kGovernorCoalesced                      // replaced what was held, the timer is already going
+};
+
+class TMGovernor
+{
+public:
+    UInt32                      fRate;              // reports/s, 0 for no limit
+    UInt64                      fPeriod;            // ns
+    UInt64                      fNextTick;          // ns, nothing more goes out before this
+    bool                        fHolding;
+    UInt64                      fHeldSince;         // ns, when the oldest held change came in
+    UInt8                       fHeldData[kControlDataSize];
+
+    // what it did, for the registry
+    UInt32                      fPublished;         // reports sent, by either path
+    UInt32                      fButtonFlushes;     // sent early for a button or hat
+    UInt32                      fCoalesced;         // changes replaced by a later one
+    UInt32                      fWakeups;           // times the timer went off
+    UInt32                      fDelayed;           // reports that were held first
+    UInt64                      fMaxDelay;          // ns, the longest a change was held
+    UInt64                      fTotalDelay;        // ns, summed over fDelayed
+
+public:
+    void init();
+    void loadProperties(OSDictionary *properties);
+    bool isEnabled() const { return fRate != 0; }
+
+    // data differs from what was last offered and is ready to go out at now,
+    // sent is what was last published
+    int offer(UInt64 now, const UInt8 *data, const UInt8 *sent);
+
+    // the timer went off, true with the held data in data if it should go out
+    bool tick(UInt64 now, const UInt8 *sent, UInt8 *data);
+
+    // what the next change has to differ from
+    const UInt8 *latest(const UInt8 *sent) const { return fHolding ? fHeldData : sent; }
+
+    void noteDelay(UInt64 delay);
+
+    // the next tick after now
+    UInt64 tickAfter(UInt64 now) const { return (now / fPeriod + 1) * fPeriod; }
+};
+
+#endif
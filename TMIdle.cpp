@@ -0,0 +1,111 @@
+/*
+ File:		TMIdle.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMIdle.h"
+
+// looks up a number in the personality
+static UInt32 getNumber(OSDictionary *properties, const char *key, UInt32 defaultValue)
+{
+    OSNumber *number = properties ? OSDynamicCast(OSNumber, properties->getObject(key)) : NULL;
+    
+    return number ? number->unsigned32BitValue() : defaultValue;
+}
+
+void TMIdlePolicy::init()
+{
+    fTimeout = 0;
+    fInterval = kDefaultIdlePollInterval;
+    fBackedOff = false;
+    fLastChange = 0;
+    fSince = 0;
+    
+    for(int i = 0; i < kNumIdleStates; i++)
+    {
+        fWakeups[i] = 0;
+        fTime[i] = 0;
+    }
+    fBackOffs = 0;
+    fFirstInput.reset();
+}
+
+void TMIdlePolicy::loadProperties(OSDictionary *properties)
+{
+    init();
+    fTimeout = getNumber(properties, "IdleTimeout", 0);
+    fInterval = getNumber(properties, "IdlePollInterval", kDefaultIdlePollInterval);
+    if(fInterval == 0)
+    {
+        fInterval = 1;
+    }
+}
+
+bool TMIdlePolicy::changed(UInt64 timestamp, UInt64 emptySince)
+{
+    fLastChange = timestamp;
+    if(!fBackedOff)
+    {
+        return false;
+    }
+    
+    // anything that came in while the pipe was empty waited for the timer
+    if(emptySince && emptySince < timestamp)
+    {
+        fFirstInput.add(timestamp - emptySince);
+    }
+    enter(false, timestamp);
+    return true;
+}
+
+bool TMIdlePolicy::tick(UInt64 now, UInt64 *next)
+{
+    UInt64  timeout = fTimeout * 1000000ULL;
+    
+    if(fBackedOff)
+    {
+        *next = now + fInterval * 1000000ULL;
+        return false;
+    }
+    
+    // the first tick after starting counts from then
+    if(!fSince)
+    {
+        fSince = now;
+    }
+    if(!fLastChange)
+    {
+        fLastChange = now;
+    }
+    if(now - fLastChange < timeout)
+    {
+        *next = fLastChange + timeout;
+        return false;
+    }
+    
+    enter(true, now);
+    fBackOffs++;
+    *next = now + fInterval * 1000000ULL;
+    return true;
+}
+
+UInt32 TMIdlePolicy::rate(int state, UInt64 now) const
+{
+    UInt64  time = fTime[state];
+    
+    if(fSince && (state == kIdleBackedOff) == fBackedOff && now > fSince)
+    {
+        time += now - fSince;
+    }
+    return time ? (UInt32)(fWakeups[state] * 1000000000ULL / time) : 0;
+}
+
+void TMIdlePolicy::enter(bool backedOff, UInt64 now)
+{
+    if(fSince && now > fSince)
+    {
+        fTime[fBackedOff ? kIdleBackedOff : kIdleFullRate] += now - fSince;
+    }
+    fBackedOff = backedOff;
+    fSince = now;
+}
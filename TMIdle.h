@@ -0,0 +1,75 @@
+/*
+ File:		TMIdle.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Backing off the interrupt pipe while nobody is touching the stick. Every
+ read that comes back normally goes straight back on the pipe, and the axes
+ jitter enough that the iMate keeps sending even when the stick sits still,
+ so the driver wakes up for every frame forever. With an IdleTimeout set,
+ once that many ms go by without a frame that changed anything, reads that
+ come back are parked instead, and a timer puts them back on the pipe every
+ IdlePollInterval ms. The first frame that changes something puts them all
+ back and it is full rate again.
+
+ Input that comes while no read is queued waits for the next one, so this
+ trades wakeups for latency. The counters show both sides: wakeups a second
+ at full rate and backed off, and how late the first input after backing
+ off can have been, which is from when the pipe last went empty to when the
+ frame came in.
+ */
+
+#ifndef __TMIDLE__
+#define __TMIDLE__
+
+#include "TMCore.h"
+#include "TMLatency.h"
+
+// ms between reads while backed off, unless IdlePollInterval says otherwise
+#define kDefaultIdlePollInterval    50
+
+enum {
+    kIdleFullRate               = 0,
+    kIdleBackedOff,
+    kNumIdleStates
+};
+
+class TMIdlePolicy
+{
+public:
+    UInt32                      fTimeout;           // ms without a change, 0 for never
+    UInt32                      fInterval;          // ms between reads while backed off
+    bool                        fBackedOff;
+    UInt64                      fLastChange;        // ns
+    UInt64                      fSince;             // ns, when it last backed off or came back
+
+    // what it did, for the registry
+    UInt32                      fWakeups[kNumIdleStates];
+    UInt64                      fTime[kNumIdleStates];      // ns spent in each
+    UInt32                      fBackOffs;
+    TMLatencyHistogram          fFirstInput;        // ns, see changed()
+
+public:
+    void init();
+    void loadProperties(OSDictionary *properties);
+    bool isEnabled() const { return fTimeout != 0; }
+
+    // a read came back or the timer went off
+    void wakeup() { fWakeups[fBackedOff ? kIdleBackedOff : kIdleFullRate]++; }
+
+    // a frame at timestamp changed something. emptySince is when the pipe
+    // last went without a read before they were put back, 0 if it hasn't.
+    // True if it was backed off, and every read has to go back on the pipe.
+    bool changed(UInt64 timestamp, UInt64 emptySince);
+
+    // the timer went off, true if it just backed off. *next is when it
+    // wants to go off again, in ns.
+    bool tick(UInt64 now, UInt64 *next);
+
+    // wakeups a second in a state, counting the time in it so far
+    UInt32 rate(int state, UInt64 now) const;
+
+protected:
+    void enter(bool backedOff, UInt64 now);
+};
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ File:		TMLatency.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMLatency.h"
+
+void TMLatencyHistogram::reset()
+{
+    for(int i = 0; i < kLatencyBuckets; i++)
+    {
+        fBuckets[i] = 0;
+    }
+    fCount = 0;
+    fMax = 0;
+}
+
+void TMLatencyHistogram::add(UInt64 ns)
+{
+    int bucket = 0;
+    
+    // find the highest bit set
+    if(ns > 1)
+    {
+        bucket = 63 - __builtin_clzll(ns);
+    }
+    if(bucket >= kLatencyBuckets)
+    {
+        bucket = kLatencyBuckets - 1;
+    }
+    
+    fBuckets[bucket]++;
+    fCount++;
+    if(ns > fMax)
+    {
+        fMax = ns;
+    }
+}
+
+UInt64 TMLatencyHistogram::percentile(int percent) const
+{
+    UInt64  wanted = ((UInt64)fCount * percent + 99) / 100;
+    UInt64  seen = 0;
+    
+    if(fCount == 0)
+    {
+        return 0;
+    }
+    
+    // report the top of the bucket the sample fell in, but never more than
+    // the worst we actually saw
+    for(int i = 0; i < kLatencyBuckets; i++)
+    {
+        seen += fBuckets[i];
+        if(seen >= wanted)
+        {
+            UInt64 top = (2ULL << i) - 1;
+            
+            return (top < fMax) ? top : fMax;
+        }
+    }
+    return fMax;
+}
+
+void TMLatencyStats::init(bool enabled)
+{
+    fEnabled = enabled;
+    reset();
+}
+
+void TMLatencyStats::reset()
+{
+    for(int i = 0; i < kNumLatencyStages; i++)
+    {
+        fStages[i].reset();
+    }
+}
+
+const char* TMLatencyStats::stageName(int stage)
+{
+    static const char *names[kNumLatencyStages] =
+    {
+        "Queue",
+        "Assembly",
+        "Translation",
+        "Report",
+        "Total"
+    };
+    
+    if(stage < 0 || stage >= kNumLatencyStages)
+    {
+        return "Unknown";
+    }
+    return names[stage];
+}
+
+OSDictionary* TMLatencyStats::copyDictionary() const
+{
+    OSDictionary    *result = OSDictionary::withCapacity(kNumLatencyStages);
+    
+    if(!result)
+    {
+        return NULL;
+    }
+    
+    // one dictionary per stage, all the times are in ns
+    for(int i = 0; i < kNumLatencyStages; i++)
+    {
+        const TMLatencyHistogram    *stage = &fStages[i];
+        OSDictionary                *entry = OSDictionary::withCapacity(4);
+        OSNumber                    *number;
+        
+        if(!entry)
+        {
+            continue;
+        }
+        
+        number = OSNumber::withNumber(stage->fCount, 32);
+        entry->setObject("Count", number);
+        number->release();
+        number = OSNumber::withNumber(stage->percentile(50), 64);
+        entry->setObject("P50", number);
+        number->release();
+        number = OSNumber::withNumber(stage->percentile(99), 64);
+        entry->setObject("P99", number);
+        number->release();
+        number = OSNumber::withNumber(stage->fMax, 64);
+        entry->setObject("Max", number);
+        number->release();
+        
+        result->setObject(stageName(i), entry);
+        entry->release();
+    }
+    
+    return result;
+}
@@ -0,0 +1,82 @@
+/*
+ File:		TMLatency.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Timestamp based latency tracking for each stage a frame goes through on its
+ way to handleReport. Each stage gets a histogram with power of 2 buckets,
+ which is plenty to see p50/p99 and cheap enough to leave in. When tracking
+ is turned off every call is just a test of fEnabled.
+ */
+
+#ifndef __TMLATENCY__
+#define __TMLATENCY__
+
+#include "TMCore.h"
+
+// bucket i holds samples from 2^i up to 2^(i + 1) - 1 ns, the last one
+// holds everything bigger
+#define kLatencyBuckets		40
+
+enum {
+    kLatencyQueue           = 0,    // USB completion to the dispatch loop picking it up
+    kLatencyAssembly,               // putting the halves together
+    kLatencyTranslation,            // getReport
+    kLatencyReport,                 // handleReport
+    kLatencyTotal,                  // USB completion to handleReport returning
+    kNumLatencyStages
+};
+
+class TMLatencyHistogram
+{
+public:
+    UInt32                      fBuckets[kLatencyBuckets];
+    UInt32                      fCount;
+    UInt64                      fMax;
+
+public:
+    void reset();
+    void add(UInt64 ns);
+    UInt64 percentile(int percent) const;
+};
+
+class TMLatencyStats
+{
+public:
+    bool                        fEnabled;
+    TMLatencyHistogram          fStages[kNumLatencyStages];
+
+public:
+    void init(bool enabled);
+    void reset();
+
+    // returns a timestamp to hand to mark(), or 0 if we aren't tracking
+    UInt64 start() const { return fEnabled ? TMNanoseconds() : 0; }
+
+    // records the time since since in stage, and returns now so the next
+    // stage can start from it
+    UInt64 mark(int stage, UInt64 since)
+    {
+        UInt64 now;
+        
+        if(!fEnabled)
+        {
+            return 0;
+        }
+        now = TMNanoseconds();
+        fStages[stage].add(now - since);
+        return now;
+    }
+
+    void record(int stage, UInt64 ns)
+    {
+        if(fEnabled)
+        {
+            fStages[stage].add(ns);
+        }
+    }
+
+    static const char* stageName(int stage);
+    OSDictionary* copyDictionary() const;
+};
+
+#endif
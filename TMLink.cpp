@@ -0,0 +1,691 @@
+/*
+ File:		TMLink.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMLink.h"
+
+// I don't know what these do, but I recorded this communication between
+// the iMate driver and the iMate device. And replaying them with a short pause
+// between them seems to get the iMate device to do what I want.
+static const TMInitStep gInitSequence[kNumInitCmds] =
+{
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0004, 0x00FF, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0002, 0x0000, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x0030, 0x0000, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x007f, 0x0000, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x00ff, 0x0000, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x007b, 0x0000, 2, {0x0f, 0xfe}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x00ff, 0x0000, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x007f, 0x0000, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x00fb, 0x0000, 2, {0x07, 0xfe}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x007f, 0x0000, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0001, 0x8000, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0004, 0x00FF, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0004, 0x000a, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0003, 0x0001, 0, {0}, kInitCommandDelay},
+    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x007e, 0x0000, 0, {0}, kInitCommandDelay}
+};
+
+static UInt32 getNumber(OSDictionary *dict, const char *key, UInt32 defaultValue)
+{
+    OSNumber *number = dict ? OSDynamicCast(OSNumber, dict->getObject(key)) : NULL;
+    
+    return number ? number->unsigned32BitValue() : defaultValue;
+}
+
+void TMLink::init(TMTransport *transport, void *target, TMFrameAction action, int numReads)
+{
+    fTransport = transport;
+    fTarget = target;
+    fFrameAction = action;
+    
+    fOutstandingIOOps = 0;
+    fClosed = 0;
+    fNeedToClose = false;
+    fFinishedInit = false;
+    fProbing = false;
+    fProbeReplies = 0;
+    fProbeCommand = 0;
+    fCommandBusy = 0;
+    fCommandCompletion.target = this;
+    fCommandCompletion.action = commandCallback;
+    fCommandCompletion.parameter = NULL;
+    fHoldReads = false;
+    fParked = 0;
+    fEmptySince = 0;
+    fBlindSince = 0;
+    
+    for(int i = 0; i < kMaxReadsInFlight; i++)
+    {
+        fReadCounters[i].halves = 0;
+        fReadCounters[i].rearms = 0;
+    }
+    for(int i = 0; i < kMaxReadErrorCodes; i++)
+    {
+        fReadErrors[i].status = 0;
+        fReadErrors[i].count = 0;
+    }
+    fOtherReadErrors = 0;
+    fPeakOutstandingIO = 0;
+    fInCompletion = 0;
+    fOverlappedReads = 0;
+    
+    fNumInitSteps = kNumInitCmds;
+    for(int i = 0; i < kNumInitCmds; i++)
+    {
+        fInitSteps[i] = gInitSequence[i];
+    }
+    fAdaptiveInit = false;
+    fVerifyTimeout = kInitVerifyTimeout;
+    fTiming.good = 100;
+    fTiming.failed = 0;
+    fValidFrames = 0;
+    fSkippedInit = false;
+    fInitScale = 100;
+    fInitTime = 0;
+    
+    fNumReads = numReads;
+    if(fNumReads < 1)
+    {
+        fNumReads = 1;
+    }
+    else if(fNumReads > kMaxReadsInFlight)
+    {
+        fNumReads = kMaxReadsInFlight;
+    }
+    for(int i = 0; i < kMaxReadsInFlight; i++)
+    {
+        fReadBuffers[i] = NULL;
+    }
+}
+
+void TMLink::free()
+{
+    // clear out any memory that we allocated
+    for(int i = 0; i < kMaxReadsInFlight; i++)
+    {
+        if(fReadBuffers[i] != NULL)
+        {
+            fReadBuffers[i]->release();
+            fReadBuffers[i] = NULL;
+        }
+    }
+}
+
+void TMLink::loadInitSequence(OSDictionary *properties)
+{
+    OSArray     *steps = properties ? OSDynamicCast(OSArray, properties->getObject("InitSequence")) : NULL;
+    OSBoolean   *adaptive = properties ? OSDynamicCast(OSBoolean, properties->getObject("AdaptiveInit")) : NULL;
+    UInt32      delay = getNumber(properties, "InitDelay", kInitCommandDelay);
+    
+    fAdaptiveInit = adaptive && adaptive->getValue();
+    fVerifyTimeout = getNumber(properties, "InitVerifyTimeout", kInitVerifyTimeout);
+    
+    // a sequence of our own, each step is a dictionary with Request, Value,
+    // Index and optionally RequestType, Data and Delay. If anything is off
+    // we stick with the recorded one.
+    if(steps)
+    {
+        int count = steps->getCount();
+        
+        for(int i = 0; i < count; i++)
+        {
+            OSDictionary    *step = OSDynamicCast(OSDictionary, steps->getObject(i));
+            OSData          *data = step ? OSDynamicCast(OSData, step->getObject("Data")) : NULL;
+            
+            if(count > kMaxInitSteps || !step || !step->getObject("Request") ||
+               (data && data->getLength() > kMaxInitData))
+            {
+                IOLog("%s: InitSequence step %d is no good, using the built in sequence\n", NAME, i);
+                steps = NULL;
+                break;
+            }
+        }
+    }
+    
+    if(steps)
+    {
+        fNumInitSteps = steps->getCount();
+        for(int i = 0; i < fNumInitSteps; i++)
+        {
+            OSDictionary    *step = OSDynamicCast(OSDictionary, steps->getObject(i));
+            OSData          *data = OSDynamicCast(OSData, step->getObject("Data"));
+            
+            fInitSteps[i].requestType = getNumber(step, "RequestType", USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface));
+            fInitSteps[i].request = getNumber(step, "Request", 0);
+            fInitSteps[i].value = getNumber(step, "Value", 0);
+            fInitSteps[i].index = getNumber(step, "Index", 0);
+            fInitSteps[i].length = data ? data->getLength() : 0;
+            memcpy(fInitSteps[i].data, data ? data->getBytesNoCopy() : fInitSteps[i].data, fInitSteps[i].length);
+            fInitSteps[i].delay = getNumber(step, "Delay", delay);
+        }
+    }
+    else
+    {
+        setInitDelay(delay);
+    }
+}
+
+void TMLink::setInitDelay(UInt32 delay)
+{
+    for(int i = 0; i < fNumInitSteps; i++)
+    {
+        fInitSteps[i].delay = delay;
+    }
+}
+
+IOReturn TMLink::runInitSequence()
+{
+    IOReturn    status;
+    UInt64      start = TMNanoseconds();
+    UInt32      frames;
+    
+    // if this iMate was set up by an earlier load of the driver and it has
+    // sent us anything since we attached there is nothing to do
+    if(fTransport->wasInitialized() && waitForFrames(0, fVerifyTimeout))
+    {
+        fSkippedInit = true;
+        fInitScale = 0;
+        fInitTime = TMNanoseconds() - start;
+        return kIOReturnSuccess;
+    }
+    
+    // adaptive init tries halfway between what is known to work and what is
+    // known not to, until the two are close enough
+    fInitScale = 100;
+    if(fAdaptiveInit)
+    {
+        fTransport->getInitTiming(&fTiming);
+        fInitScale = fTiming.good;
+        if(fTiming.good - fTiming.failed > kInitScaleStep)
+        {
+            fInitScale = (fTiming.good + fTiming.failed) / 2;
+        }
+    }
+    
+    frames = fValidFrames;
+    status = sendInitSequence(fInitScale);
+    if(status == kIOReturnSuccess && fAdaptiveInit && fInitScale < fTiming.good)
+    {
+        if(waitForFrames(frames, fVerifyTimeout))
+        {
+            fTiming.good = fInitScale;
+        }
+        else if(!fNeedToClose)
+        {
+            // too fast for it, go back to what worked
+            IOLog("%s: The iMate didn't come up with %u%% of the init delays, using %u%%\n", NAME, (unsigned)fInitScale, (unsigned)fTiming.good);
+            fTiming.failed = fInitScale;
+            fInitScale = fTiming.good;
+            status = sendInitSequence(fInitScale);
+        }
+        fTransport->setInitTiming(&fTiming);
+    }
+    
+    if(status == kIOReturnSuccess)
+    {
+        fTransport->setInitialized();
+    }
+    fInitTime = TMNanoseconds() - start;
+    
+    return status;
+}
+
+IOReturn TMLink::sendInitSequence(UInt32 scale)
+{
+    IOReturn        status = kIOReturnSuccess;
+    IOUSBDevRequest request;
+    
+    // loop through each init command and issue them. Stop if the need to close
+    // flag is set. (Due to threads, it might not be updated in time... hopefully
+    // DeviceRequest is smart enough to detect a problem and stop us.)
+    for(int i = 0; i < fNumInitSteps && status == kIOReturnSuccess; i++)
+    {
+        TMInitStep *step = &fInitSteps[i];
+        
+        IOSleep(step->delay * scale / 100);
+        if(fNeedToClose)
+        {
+            status = kIOReturnAborted;
+            break;
+        }
+        
+        request.bmRequestType = step->requestType;
+        request.bRequest = step->request;
+        request.wValue = step->value;
+        request.wIndex = step->index;
+        request.wLength = step->length;
+        request.pData = step->length ? step->data : NULL;
+        request.wLenDone = 0;
+        
+        status = fTransport->deviceRequest(&request);
+        if(status != kIOReturnSuccess)
+        {
+            IOLog("%s: Init sequence failed on command %d. Value = %d, Error = %08x\n", NAME, i, step->value, status);
+        }
+    }
+    
+    return status;
+}
+
+bool TMLink::waitForFrames(UInt32 since, UInt32 timeout)
+{
+    // the init thread has nothing better to do, so just poll
+    for(UInt32 waited = 0; fValidFrames == since; waited += 2)
+    {
+        if(waited >= timeout || fNeedToClose)
+        {
+            return false;
+        }
+        IOSleep(2);
+    }
+    return true;
+}
+
+IOReturn TMLink::sendADBCommand(UInt8 command)
+{
+    IOUSBDevRequest request;
+    
+    request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface);
+    request.bRequest = kADBCommandRequest;
+    request.wValue = command;
+    request.wIndex = 0;
+    request.wLength = 0;
+    request.pData = NULL;
+    request.wLenDone = 0;
+    
+    return fTransport->deviceRequest(&request);
+}
+
+IOReturn TMLink::postADBCommand(UInt8 command)
+{
+    IOReturn err;
+    
+    // the request has to stay put until the completion, so there is only one
+    if(!OSCompareAndSwap(0, 1, &fCommandBusy))
+    {
+        return kIOReturnBusy;
+    }
+    
+    fCommandRequest.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface);
+    fCommandRequest.bRequest = kADBCommandRequest;
+    fCommandRequest.wValue = command;
+    fCommandRequest.wIndex = 0;
+    fCommandRequest.wLength = 0;
+    fCommandRequest.pData = NULL;
+    fCommandRequest.wLenDone = 0;
+    
+    incrementOutstandingIO();
+    err = fTransport->deviceRequest(&fCommandRequest, &fCommandCompletion);
+    if(err != kIOReturnSuccess)
+    {
+        fCommandBusy = 0;
+        decrementOutstandingIO();
+    }
+    return err;
+}
+
+void TMLink::handleCommand(IOReturn status)
+{
+    if(status != kIOReturnSuccess)
+    {
+        IOLog("%s: handleCommand - status = %08x\n", NAME, status);
+    }
+    fCommandBusy = 0;
+    
+    // the interface can't close while the request is still out
+    decrementOutstandingIO();
+}
+
+void TMLink::commandCallback(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining)
+{
+    TMLink *link = (TMLink*)target;
+    
+    if(link)
+    {
+        link->handleCommand(status);
+    }
+}
+
+int TMLink::probeDevices(const TMPollScheduler *poll, UInt8 *found, int maxFound)
+{
+    int numFound = 0;
+    
+    // ask every address we don't already know about for its register 3, the
+    // answer has the handler ID in it. Only Thrustmasters are kept, we
+    // wouldn't know what to do with anything else.
+    for(int address = kADBFirstAddress; address <= kADBLastAddress && numFound < maxFound && !fNeedToClose; address++)
+    {
+        UInt32  replies = fProbeReplies;
+        UInt8   handlerID;
+        
+        if(poll->find(address) >= 0)
+        {
+            continue;
+        }
+        
+        fProbeCommand = ADBCommand(address, kADBTalk, 3);
+        OSMemoryBarrier();
+        fProbing = true;
+        if(sendADBCommand(fProbeCommand) != kIOReturnSuccess)
+        {
+            break;
+        }
+        for(UInt32 waited = 0; fProbeReplies == replies && waited < kADBProbeTimeout && !fNeedToClose; waited += 2)
+        {
+            IOSleep(2);
+        }
+        fProbing = false;
+        if(fProbeReplies == replies)
+        {
+            continue;
+        }
+        
+        OSMemoryBarrier();
+        handlerID = fProbeReply[kADBHandlerIDByte];
+        if(handlerID != kTMHandlerID)
+        {
+            IOLog("%s: Found handler ID %d at ADB address %d, leaving it alone\n", NAME, handlerID, address);
+            continue;
+        }
+        IOLog("%s: Found another Thrustmaster at ADB address %d\n", NAME, address);
+        found[numFound++] = address;
+    }
+    fProbing = false;
+    
+    return numFound;
+}
+
+void TMLink::finishInit()
+{
+    fFinishedInit = true;
+    OSMemoryBarrier();
+    
+    // see if we need to close. This can happen if the user disconnected the iMate
+    // before we finished the init sequence.
+    closeIfDone();
+}
+
+void TMLink::abort()
+{
+    // stop any IO operation that might be scheduled
+    fTransport->abort();
+}
+
+void TMLink::terminate()
+{
+    fNeedToClose = true;
+    
+    // the flag has to be visible before we look at the IO count, or the last
+    // completion and us can both decide the other one will do the close
+    OSMemoryBarrier();
+    
+    // we are done, so close the reference to our provider... assuming we don't
+    // have an IO operation currently going on... if we do then delay the close
+    // until the last IO operation completes.
+    closeIfDone();
+}
+
+IOReturn TMLink::startReadLoop()
+{
+    IOReturn err = kIOReturnSuccess;
+    int      started = 0;
+    
+    for(int i = 0; i < fNumReads; i++)
+    {
+        // setup the completion, the parameter is which slot in the ring it is
+        fReadCompletions[i].target = this;
+        fReadCompletions[i].action = readCallback;
+        fReadCompletions[i].parameter = (void*)(uintptr_t)i;
+        
+        // we need a buffer
+        if(!fReadBuffers[i])
+        {
+            fReadBuffers[i] = IOBufferMemoryDescriptor::withCapacity(kHalfFrameSize, kIODirectionIn);
+            if(!fReadBuffers[i])
+            {
+                IOLog("%s: Failed to create the buffer\n", NAME);
+                err = kIOReturnNoMemory;
+                break;
+            }
+        }
+    }
+    
+    // now lets kick off the chains of reads
+    for(int i = 0; i < fNumReads && err == kIOReturnSuccess; i++)
+    {
+        err = issueRead(i);
+        if(err != kIOReturnSuccess)
+        {
+            IOLog("%s: Failed to issue the first read request. Error = %08x\n", NAME, err);
+        }
+        else
+        {
+            started++;
+        }
+    }
+    
+    // as long as one chain got going we can run, just with less slack
+    if(started > 0)
+    {
+        return kIOReturnSuccess;
+    }
+    return err;
+}
+
+IOReturn TMLink::issueRead(int slot)
+{
+    IOReturn err;
+    
+    incrementOutstandingIO();
+    err = fTransport->read(fReadBuffers[slot], &fReadCompletions[slot]);
+    if(err != kIOReturnSuccess)
+    {
+        decrementOutstandingIO();
+    }
+    return err;
+}
+
+void TMLink::resumeReads()
+{
+    UInt32 parked;
+    
+    // take them all at once, a read coming back now parks after this
+    do
+    {
+        parked = fParked;
+    } while(!OSCompareAndSwap(parked, 0, &fParked));
+    if(parked)
+    {
+        fBlindSince = fEmptySince;
+    }
+    
+    // the slots are parked, so their completions aren't touching the counters
+    for(int i = 0; i < fNumReads; i++)
+    {
+        if(!(parked & (1 << i)) || fNeedToClose)
+        {
+            continue;
+        }
+        if(issueRead(i) != kIOReturnSuccess)
+        {
+            IOLog("%s: Failed to reschedule a read operation\n", NAME);
+        }
+        else
+        {
+            fReadCounters[i].rearms++;
+        }
+    }
+}
+
+void TMLink::handleRead(IOReturn status, UInt32 bufferSizeRemaining, int slot)
+{
+    bool readAgain = false;
+    
+    // nothing below locks because this never runs twice at once, see TMLink.h
+    if(OSIncrementAtomic(&fInCompletion) != 0)
+    {
+        OSIncrementAtomic(&fOverlappedReads);
+    }
+    
+    switch(status)
+    {
+        case kIOReturnSuccess:
+        {
+            unsigned char *data = (unsigned char*)fReadBuffers[slot]->getBytesNoCopy();
+            
+            fReadCounters[slot].halves++;
+            
+            // tells the init thread the iMate is up, it only looks for a change
+            if(bufferSizeRemaining == 0)
+            {
+                fValidFrames++;
+            }
+            
+            // the answer probeDevices() is waiting for isn't a frame
+            if(fProbing && bufferSizeRemaining == 0 && data[kHalfFrameTagByte] == fProbeCommand)
+            {
+                for(int i = 0; i < kHalfFrameSize; i++)
+                {
+                    fProbeReply[i] = data[i];
+                }
+                OSMemoryBarrier();
+                fProbeReplies++;
+                readAgain = true;
+                break;
+            }
+            
+            // hand the raw frame off and get straight back to re-arming the
+            // pipe. The pipe completes reads in the order they were queued,
+            // so the halves still go out in order.
+            fFrameAction(fTarget, data, kHalfFrameSize - bufferSizeRemaining, TMNanoseconds());
+            
+            // backed off, the timer puts it back
+            if(fHoldReads && !fProbing)
+            {
+                UInt32 parked;
+                
+                do
+                {
+                    parked = fParked;
+                } while(!OSCompareAndSwap(parked, parked | (1 << slot), &fParked));
+                if((parked | (1 << slot)) == (1U << fNumReads) - 1)
+                {
+                    fEmptySince = TMNanoseconds();
+                }
+                
+                // resumeReads() could have run between looking at fHoldReads
+                // and parking, and then nobody comes back for this slot. Take
+                // it back unless resumeReads() already has.
+                while(!fHoldReads)
+                {
+                    parked = fParked;
+                    if(!(parked & (1 << slot)))
+                    {
+                        break;
+                    }
+                    if(OSCompareAndSwap(parked, parked & ~(1 << slot), &fParked))
+                    {
+                        readAgain = true;
+                        break;
+                    }
+                }
+                break;
+            }
+            readAgain = true;
+            break;
+        }
+        default:
+            // assume some problem and stop reading
+            IOLog("%s: handleRead - status = %08x\n", NAME, status);
+            countReadError(status);
+            readAgain = false;
+    }
+    
+    // put this slot back on the pipe if we are still reading...
+    if(!fNeedToClose && readAgain)
+    {
+        if(issueRead(slot) != kIOReturnSuccess)
+        {
+            IOLog("%s: Failed to reschedule a read operation\n", NAME);
+        }
+        else
+        {
+            fReadCounters[slot].rearms++;
+        }
+    }
+    OSDecrementAtomic(&fInCompletion);
+    
+    // update our IO op count
+    decrementOutstandingIO();
+}
+
+void TMLink::countReadError(IOReturn status)
+{
+    // errors don't happen often, so this one can afford to be atomic and not
+    // lean on the completions coming in one at a time
+    for(int i = 0; i < kMaxReadErrorCodes; i++)
+    {
+        // claim a free entry, somebody else may just have for this status
+        if(fReadErrors[i].status == 0)
+        {
+            OSCompareAndSwap(0, status, &fReadErrors[i].status);
+        }
+        if(fReadErrors[i].status == (UInt32)status)
+        {
+            OSIncrementAtomic(&fReadErrors[i].count);
+            return;
+        }
+    }
+    OSIncrementAtomic(&fOtherReadErrors);
+}
+
+void TMLink::readCallback(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining)
+{
+    TMLink *link = (TMLink*)target;
+    
+    if(link)
+    {
+        link->handleRead(status, bufferSizeRemaining, (int)(uintptr_t)parameter);
+    }
+}
+
+void TMLink::incrementOutstandingIO()
+{
+    // the completions and the dispatch loop both get here, see TMLink.h
+    SInt32 count = OSIncrementAtomic(&fOutstandingIOOps) + 1;
+    SInt32 peak;
+    
+    do
+    {
+        peak = fPeakOutstandingIO;
+        if(count <= peak)
+        {
+            break;
+        }
+    } while(!OSCompareAndSwap(peak, count, (volatile UInt32*)&fPeakOutstandingIO));
+}
+
+void TMLink::decrementOutstandingIO()
+{
+    OSDecrementAtomic(&fOutstandingIOOps);
+    
+    // if we don't have any outstaind IO requests, and if we need to close, then
+    // close.
+    closeIfDone();
+}
+
+void TMLink::closeIfDone()
+{
+    // We can only close once the last read has come back and the init thread
+    // is done with the interface. Whoever gets here last does the close, and
+    // the swap makes sure only one of them does.
+    if(fNeedToClose && fFinishedInit && fOutstandingIOOps == 0 && fTransport)
+    {
+        if(OSCompareAndSwap(0, 1, &fClosed))
+        {
+            fTransport->close();
+        }
+    }
+}
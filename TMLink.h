@@ -0,0 +1,180 @@
+/*
+ File:		TMLink.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ The USB side of the driver: the init sequence, the ring of reads queued on
+ the interrupt pipe, and keeping track of when it is safe to close the
+ interface. It only talks to the device through a TMTransport, so the whole
+ life of a connection can be run against a mock device.
+
+ The read completions come in one at a time, never two at once: the USB
+ family calls them on its work loop, and the mock from its one thread. The
+ per slot counters and TMFrameRing, which only takes one producer, rely on
+ that and don't lock. handleRead() counts fOverlappedReads if it ever
+ isn't so. Reads are also put back from the dispatch loop by resumeReads(),
+ and the poll from postADBCommand(), so the count of IO still going is
+ atomic.
+ */
+
+#ifndef __TMLINK__
+#define __TMLINK__
+
+#include "TMCore.h"
+#include "TMTransport.h"
+#include "TMPoll.h"
+
+// how many reads we can keep queued on the interrupt pipe at once
+#define kMaxReadsInFlight       8
+#define kDefaultReadsInFlight   2
+
+// read errors are counted for this many different statuses, the rest together
+#define kMaxReadErrorCodes      8
+
+// how many commands it takes to get the iMate going, see TMLink.cpp
+#define kNumInitCmds            15
+
+// the pause before each init command, in ms
+#define kInitCommandDelay       50
+
+// room for a sequence loaded from the personality
+#define kMaxInitSteps           32
+#define kMaxInitData            8
+
+// how long to wait for the first frame after the init sequence, in ms
+#define kInitVerifyTimeout      100
+
+// adaptive init stops halving the delays once it is this close, in percent
+#define kInitScaleStep          5
+
+// one vendor request of the init sequence and the pause before it
+struct TMInitStep
+{
+    UInt8                       requestType;
+    UInt8                       request;
+    UInt16                      value;
+    UInt16                      index;
+    UInt16                      length;
+    UInt8                       data[kMaxInitData];
+    UInt32                      delay;              // ms
+};
+
+// what the reads on one slot did. There is only ever one read queued on a
+// slot, so only its completion writes these and they need no locking.
+struct TMReadCounters
+{
+    UInt32                      halves;             // came back with data
+    UInt32                      rearms;             // went back on the pipe
+};
+
+// how many reads failed with one status, status is 0 while the entry is free
+struct TMReadError
+{
+    volatile UInt32             status;
+    volatile SInt32             count;
+};
+
+// called from the read completion with each raw half frame
+typedef void (*TMFrameAction)(void *target, const UInt8 *data, UInt32 length, UInt64 timestamp);
+
+class TMLink
+{
+public:
+    TMTransport                 *fTransport;
+    void                        *fTarget;
+    TMFrameAction               fFrameAction;
+
+    volatile SInt32             fOutstandingIOOps;
+    volatile UInt32             fClosed;
+    volatile bool               fNeedToClose;
+    volatile bool               fFinishedInit;
+
+    // the ring of reads we keep queued on the interrupt pipe
+    int                         fNumReads;
+    IOUSBCompletion             fReadCompletions[kMaxReadsInFlight];
+    IOBufferMemoryDescriptor    *fReadBuffers[kMaxReadsInFlight];
+
+    // while fHoldReads is set, reads that come back are parked here instead
+    // of going straight back on the pipe, see TMIdle.h
+    volatile bool               fHoldReads;
+    volatile UInt32             fParked;            // bit per slot
+    volatile UInt64             fEmptySince;        // ns, when the last read was parked
+    UInt64                      fBlindSince;        // fEmptySince when they were last put back
+
+    // always on, see TMCounters.h
+    TMReadCounters              fReadCounters[kMaxReadsInFlight];
+    TMReadError                 fReadErrors[kMaxReadErrorCodes];
+    volatile SInt32             fOtherReadErrors;
+    volatile SInt32             fPeakOutstandingIO;
+
+    // read completions running right now, which should never be more than one
+    volatile SInt32             fInCompletion;
+    volatile SInt32             fOverlappedReads;
+
+    // the init sequence, see loadInitSequence()
+    TMInitStep                  fInitSteps[kMaxInitSteps];
+    int                         fNumInitSteps;
+    bool                        fAdaptiveInit;
+    UInt32                      fVerifyTimeout;
+    TMInitTiming                fTiming;            // this iMate's, from the transport
+
+    // how the last init went
+    volatile UInt32             fValidFrames;
+    bool                        fSkippedInit;
+    UInt32                      fInitScale;
+    UInt64                      fInitTime;          // ns
+    
+    // looking for other ADB devices, see probeDevices()
+    volatile bool               fProbing;
+    volatile UInt32             fProbeReplies;
+    UInt8                       fProbeCommand;
+    UInt8                       fProbeReply[kHalfFrameSize];
+
+    // the poll, sent without waiting, see postADBCommand()
+    IOUSBDevRequest             fCommandRequest;
+    IOUSBCompletion             fCommandCompletion;
+    volatile UInt32             fCommandBusy;
+
+public:
+    void init(TMTransport *transport, void *target, TMFrameAction action, int numReads);
+    void free();
+
+    void loadInitSequence(OSDictionary *properties);
+    void setInitDelay(UInt32 delay);
+
+    // blocks for the whole sequence, the kext runs it on its own thread
+    IOReturn runInitSequence();
+    IOReturn sendInitSequence(UInt32 scale);
+    bool waitForFrames(UInt32 since, UInt32 timeout);
+    
+    // talk to the ADB bus behind the iMate, see TMPoll.h
+    IOReturn sendADBCommand(UInt8 command);
+    
+    // sends it and returns straight away, for the poll timer which can't sit
+    // waiting on the bus. Only one at a time: kIOReturnBusy while the last
+    // one hasn't finished.
+    IOReturn postADBCommand(UInt8 command);
+    void handleCommand(IOReturn status);
+    static void commandCallback(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining);
+
+    // the addresses of the Thrustmasters poll doesn't have yet, at most
+    // maxFound of them. Runs next to the reads, so it leaves poll alone.
+    int probeDevices(const TMPollScheduler *poll, UInt8 *found, int maxFound);
+
+    // finishInit() and terminate() must not run at the same time as each other
+    void finishInit();
+    void abort();
+    void terminate();
+
+    IOReturn startReadLoop();
+    IOReturn issueRead(int slot);
+    void resumeReads();
+    void handleRead(IOReturn status, UInt32 bufferSizeRemaining, int slot);
+    void countReadError(IOReturn status);
+    static void readCallback(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining);
+
+    void incrementOutstandingIO();
+    void decrementOutstandingIO();
+    void closeIfDone();
+};
+
+#endif
@@ -0,0 +1,359 @@
+/*
+ File:		TMMacro.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMMacro.h"
+
+// FCS button bits, in the order of the Buttons array like buildTranslationTables()
+static const UInt8 gFCSButtonMasks[kNumOfFCSButtons] =
+    {kFCSTriggerMask, kFCSThumbHighMask, kFCSThumbLowMask, kFCSPinkyMask};
+
+// looks up a number in a Macros entry
+static int getNumber(OSDictionary *dict, const char *key, int defaultValue)
+{
+    OSNumber *number = OSDynamicCast(OSNumber, dict->getObject(key));
+    
+    return number ? (int)number->unsigned32BitValue() : defaultValue;
+}
+
+// the raw button bits as button numbers, bit n for button n
+static UInt16 buttonBits(const UInt8 *control)
+{
+    UInt16  buttons = (control[kWCSButtonsByte] & 0x3f) << kNumOfFCSButtons;
+    
+    for(int i = 0; i < kNumOfFCSButtons; i++)
+    {
+        if(control[kFCSButtonsByte] & gFCSButtonMasks[i])
+        {
+            buttons |= 1 << i;
+        }
+    }
+    return buttons;
+}
+
+void TMMacroEngine::init()
+{
+    fCount = 0;
+    fTriggers = 0;
+    fLastButtons = 0;
+    for(int i = 0; i < kMacroWheelSlots; i++)
+    {
+        fWheel[i] = kMacroNone;
+    }
+    fTick = 0;
+    fScheduled = 0;
+    for(int i = 0; i < kNumOfButtons; i++)
+    {
+        fOwners[i] = 0;
+        fPressers[i] = 0;
+    }
+    buildOverlay();
+    
+    fStarted = 0;
+    fSteps = 0;
+    fWakeups = 0;
+    fLateness.reset();
+}
+
+void TMMacroEngine::loadProperties(OSDictionary *properties)
+{
+    OSArray *macros = properties ? OSDynamicCast(OSArray, properties->getObject("Macros")) : NULL;
+    
+    init();
+    for(unsigned int i = 0; macros && i < macros->getCount(); i++)
+    {
+        OSDictionary    *entry = OSDynamicCast(OSDictionary, macros->getObject(i));
+        int             button = entry ? getNumber(entry, "Button", -1) : -1;
+        
+        if(!entry || !add(button, getNumber(entry, "Output", button), getNumber(entry, "Delay", 0),
+                          getNumber(entry, "On", kMacroDefaultOn), getNumber(entry, "Off", kMacroDefaultOff),
+                          getNumber(entry, "Count", 0)))
+        {
+            IOLog("%s: Macros entry %u is no good, skipping it\n", NAME, i);
+        }
+    }
+}
+
+bool TMMacroEngine::add(int button, int output, UInt32 delay, UInt32 on, UInt32 off, int count)
+{
+    TMMacro *macro;
+    
+    if(fCount >= kMaxMacros || button < 0 || button >= kNumOfButtons || output < 0 || output >= kNumOfButtons ||
+       count < 0 || count > 0xffff)
+    {
+        return false;
+    }
+    
+    macro = &fMacros[fCount];
+    macro->button = button;
+    macro->output = output;
+    macro->count = count;
+    macro->delay = delay;
+    
+    // a press or a gap of nothing would never show up in a report
+    macro->on = on ? on : 1;
+    macro->off = off ? off : 1;
+    macro->running = false;
+    macro->pressed = false;
+    macro->left = 0;
+    macro->due = 0;
+    macro->next = kMacroNone;
+    macro->prev = kMacroNone;
+    
+    fTriggers |= 1 << button;
+    fCount++;
+    return true;
+}
+
+bool TMMacroEngine::update(UInt64 now, const UInt8 *control)
+{
+    UInt16  buttons = buttonBits(control) & fTriggers;
+    UInt16  changed = buttons ^ fLastButtons;
+    UInt64  tick = now / kMacroTickNS;
+    
+    // nearly every frame, and all it costs with nothing going on
+    if(!changed)
+    {
+        return false;
+    }
+    fLastButtons = buttons;
+    
+    // the wheel stands still while nothing is on it
+    if(!fScheduled)
+    {
+        fTick = tick;
+    }
+    
+    for(int i = 0; i < fCount; i++)
+    {
+        TMMacro *macro = &fMacros[i];
+        
+        if(!(changed & (1 << macro->button)))
+        {
+            continue;
+        }
+        if(buttons & (1 << macro->button))
+        {
+            start(i, tick);
+        }
+        else if(macro->count == 0)
+        {
+            stop(i);
+        }
+    }
+    buildOverlay();
+    return true;
+}
+
+bool TMMacroEngine::advance(UInt64 now)
+{
+    UInt64  tick = now / kMacroTickNS;
+    UInt64  last = fTick;
+    UInt64  ticks = (tick > last) ? tick - last : 0;
+    UInt32  overlay = fOwnedFCS | fOwnedWCS << 8 | fPressedFCS << 16 | fPressedWCS << 24;
+    
+    fWakeups++;
+    
+    // slept through a whole turn of the wheel, so what was missed could be
+    // in any slot, including ones the loop below has already been past. Each
+    // step that is due runs once, now, and the rest of its macro is timed
+    // from now instead of catching up.
+    if(ticks > kMacroWheelSlots)
+    {
+        for(int i = 0; i < fCount; i++)
+        {
+            TMMacro *macro = &fMacros[i];
+            
+            if(macro->running && macro->due <= tick)
+            {
+                fLateness.add(now - macro->due * kMacroTickNS);
+                unschedule(i);
+                macro->due = tick;
+                step(i);
+            }
+        }
+        ticks = 0;
+    }
+    
+    // a step that comes due again before tick lands in a slot still to come
+    for(UInt64 t = last + 1; t <= last + ticks; t++)
+    {
+        int index = fWheel[t & (kMacroWheelSlots - 1)];
+        
+        while(index != kMacroNone)
+        {
+            TMMacro *macro = &fMacros[index];
+            int     next = macro->next;
+            
+            if(macro->due <= tick)
+            {
+                fLateness.add(now - macro->due * kMacroTickNS);
+                unschedule(index);
+                step(index);
+            }
+            index = next;
+        }
+    }
+    if(tick > fTick)
+    {
+        fTick = tick;
+    }
+    
+    buildOverlay();
+    return overlay != (UInt32)(fOwnedFCS | fOwnedWCS << 8 | fPressedFCS << 16 | fPressedWCS << 24);
+}
+
+bool TMMacroEngine::nextStep(UInt64 *when) const
+{
+    UInt64  soonest = ~0ULL;
+    
+    if(!fScheduled)
+    {
+        return false;
+    }
+    
+    // the first slot with a step due this time round, otherwise whichever
+    // is going round again the soonest
+    for(UInt64 t = fTick + 1; t <= fTick + kMacroWheelSlots; t++)
+    {
+        for(int index = fWheel[t & (kMacroWheelSlots - 1)]; index != kMacroNone; index = fMacros[index].next)
+        {
+            if(fMacros[index].due < soonest)
+            {
+                soonest = fMacros[index].due;
+            }
+        }
+        if(soonest <= t)
+        {
+            break;
+        }
+    }
+    *when = soonest * kMacroTickNS;
+    return true;
+}
+
+void TMMacroEngine::start(int index, UInt64 tick)
+{
+    TMMacro *macro = &fMacros[index];
+    
+    // pressing it again starts it over
+    stop(index);
+    macro->running = true;
+    macro->left = macro->count;
+    fOwners[macro->output]++;
+    fStarted++;
+    
+    macro->due = tick + macro->delay;
+    if(macro->delay)
+    {
+        schedule(index, macro->due);
+    }
+    else
+    {
+        step(index);
+    }
+}
+
+void TMMacroEngine::stop(int index)
+{
+    TMMacro *macro = &fMacros[index];
+    
+    if(!macro->running)
+    {
+        return;
+    }
+    unschedule(index);
+    setPressed(index, false);
+    fOwners[macro->output]--;
+    macro->running = false;
+}
+
+// the macro is due and off the wheel
+void TMMacroEngine::step(int index)
+{
+    TMMacro *macro = &fMacros[index];
+    
+    fSteps++;
+    if(!macro->pressed)
+    {
+        setPressed(index, true);
+        schedule(index, macro->due + macro->on);
+        return;
+    }
+    
+    setPressed(index, false);
+    if(macro->count && --macro->left == 0)
+    {
+        fOwners[macro->output]--;
+        macro->running = false;
+        return;
+    }
+    schedule(index, macro->due + macro->off);
+}
+
+void TMMacroEngine::setPressed(int index, bool pressed)
+{
+    TMMacro *macro = &fMacros[index];
+    
+    if(macro->pressed != pressed)
+    {
+        macro->pressed = pressed;
+        if(pressed)
+            fPressers[macro->output]++;
+        else
+            fPressers[macro->output]--;
+    }
+}
+
+void TMMacroEngine::schedule(int index, UInt64 tick)
+{
+    TMMacro *macro = &fMacros[index];
+    SInt16  *slot = &fWheel[tick & (kMacroWheelSlots - 1)];
+    
+    macro->due = tick;
+    macro->prev = kMacroNone;
+    macro->next = *slot;
+    if(*slot != kMacroNone)
+    {
+        fMacros[*slot].prev = index;
+    }
+    *slot = index;
+    fScheduled++;
+}
+
+void TMMacroEngine::unschedule(int index)
+{
+    TMMacro *macro = &fMacros[index];
+    
+    if(macro->prev != kMacroNone)
+        fMacros[macro->prev].next = macro->next;
+    else
+        fWheel[macro->due & (kMacroWheelSlots - 1)] = macro->next;
+    if(macro->next != kMacroNone)
+    {
+        fMacros[macro->next].prev = macro->prev;
+    }
+    macro->next = kMacroNone;
+    macro->prev = kMacroNone;
+    fScheduled--;
+}
+
+void TMMacroEngine::buildOverlay()
+{
+    fOwnedFCS = 0;
+    fOwnedWCS = 0;
+    fPressedFCS = 0;
+    fPressedWCS = 0;
+    for(int i = 0; i < kNumOfButtons; i++)
+    {
+        UInt8   *owned = (i < kNumOfFCSButtons) ? &fOwnedFCS : &fOwnedWCS;
+        UInt8   *pressed = (i < kNumOfFCSButtons) ? &fPressedFCS : &fPressedWCS;
+        UInt8   mask = (i < kNumOfFCSButtons) ? gFCSButtonMasks[i] : 1 << (i - kNumOfFCSButtons);
+        
+        if(fOwners[i])
+            *owned |= mask;
+        if(fPressers[i])
+            *pressed |= mask;
+    }
+}
@@ -0,0 +1,137 @@
+/*
+ File:		TMMacro.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Buttons that press other buttons on a schedule: autofire, press-hold-
+ release and pulse trains. The Macros key is a list of dictionaries, each
+ with the button that starts it (Button, numbered like the Buttons key),
+ the button it presses (Output, the same one if left out), how long to wait
+ first (Delay), how long to hold it down (On) and leave it up (Off), and how
+ many times (Count). Times are in ms.
+
+ With a Count the macro runs that many times from the moment Button goes
+ down, so {Button 5, Output 2, Delay 100, On 300, Count 1} holds button 2
+ for 300 ms a tenth of a second after button 5 is pressed. Several macros
+ on the same Button make a sequence. Count 0 keeps going for as long as
+ Button is held, which with Output the same as Button is autofire.
+
+ What the macros are doing goes on top of the raw button bits: a button a
+ running macro is pressing reads as down, one it is between presses of
+ reads as up, and everything else is whatever the stick says.
+
+ Every step is timed off a hashed timer wheel of 1 ms ticks, so any number
+ of running macros needs just the one timer, and it is only set while one
+ is running. Steps are scheduled off when the last one was due rather than
+ when it ran, so a late timer doesn't push the rest of a macro back. One
+ that is more than a turn of the wheel late runs each missed step once and
+ starts the timing over from then. How late each step actually ran is kept
+ in a histogram.
+ */
+
+#ifndef __TMMACRO__
+#define __TMMACRO__
+
+#include "TMCore.h"
+#include "TMLatency.h"
+
+#define kMaxMacros              256
+
+// the wheel covers this many ticks, longer waits go round more than once
+#define kMacroWheelSlots        256
+#define kMacroTickNS            1000000ULL
+
+// defaults for a Macros entry, in ms
+#define kMacroDefaultOn         50
+#define kMacroDefaultOff        50
+
+#define kMacroNone              -1
+
+struct TMMacro
+{
+    // from the settings
+    UInt8       button;
+    UInt8       output;
+    UInt16      count;              // 0 for as long as button is held
+    UInt32      delay;              // ms, which is ticks
+    UInt32      on;
+    UInt32      off;
+    
+    // while it runs
+    bool        running;
+    bool        pressed;            // output is down right now
+    UInt16      left;               // presses still to go
+    UInt64      due;                // tick of the next step
+    SInt16      next;               // in its wheel slot
+    SInt16      prev;
+};
+
+class TMMacroEngine
+{
+public:
+    TMMacro                     fMacros[kMaxMacros];
+    int                         fCount;
+    UInt16                      fTriggers;          // buttons that start something
+    UInt16                      fLastButtons;
+    
+    SInt16                      fWheel[kMacroWheelSlots];
+    UInt64                      fTick;              // the last tick that was run
+    int                         fScheduled;
+    
+    // per output button, how many running macros have it and how many of
+    // those are pressing it
+    UInt16                      fOwners[kNumOfButtons];
+    UInt16                      fPressers[kNumOfButtons];
+    
+    // the overlay on the raw button bytes
+    UInt8                       fOwnedFCS;
+    UInt8                       fOwnedWCS;
+    UInt8                       fPressedFCS;
+    UInt8                       fPressedWCS;
+    
+    // what it did, for the registry
+    UInt32                      fStarted;
+    UInt32                      fSteps;
+    UInt32                      fWakeups;
+    TMLatencyHistogram          fLateness;          // ns past due, per step
+
+public:
+    void init();
+    void loadProperties(OSDictionary *properties);
+    bool isEnabled() const { return fCount != 0; }
+    
+    // add one, false if there is no room. Times are in ms.
+    bool add(int button, int output, UInt32 delay, UInt32 on, UInt32 off, int count);
+    
+    // a frame changed, starts and stops macros on the buttons in it. True if
+    // any did, and the timer has to be set again.
+    bool update(UInt64 now, const UInt8 *control);
+    
+    // the timer went off, runs every step due by now. True if the overlay
+    // changed.
+    bool advance(UInt64 now);
+    
+    // when the next step is due in ns, false if nothing is running
+    bool nextStep(UInt64 *when) const;
+    
+    // control with what the macros are doing on top of it
+    void overlay(const UInt8 *control, UInt8 *data) const
+    {
+        for(int i = 0; i < kControlDataSize; i++)
+        {
+            data[i] = control[i];
+        }
+        data[kFCSButtonsByte] = (data[kFCSButtonsByte] & ~fOwnedFCS) | fPressedFCS;
+        data[kWCSButtonsByte] = (data[kWCSButtonsByte] & ~fOwnedWCS) | fPressedWCS;
+    }
+
+protected:
+    void start(int index, UInt64 tick);
+    void stop(int index);
+    void step(int index);
+    void setPressed(int index, bool pressed);
+    void schedule(int index, UInt64 tick);
+    void unschedule(int index);
+    void buildOverlay();
+};
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ File:		TMPoll.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMPoll.h"
+
+static int getNumber(OSDictionary *dict, const char *key, int defaultValue)
+{
+    OSNumber *number = dict ? OSDynamicCast(OSNumber, dict->getObject(key)) : NULL;
+    
+    return number ? (int)number->unsigned32BitValue() : defaultValue;
+}
+
+void TMPollScheduler::init()
+{
+    fNumDevices = 0;
+    fTotalWeight = 0;
+    fInterval = kDefaultPollInterval;
+    fProbe = false;
+    fCurrent = -1;
+    fPolls = 0;
+    fMissed = 0;
+    fSkipped = 0;
+}
+
+void TMPollScheduler::loadProperties(OSDictionary *properties)
+{
+    OSArray     *devices = properties ? OSDynamicCast(OSArray, properties->getObject("ADBDevices")) : NULL;
+    OSBoolean   *probe = properties ? OSDynamicCast(OSBoolean, properties->getObject("ADBProbe")) : NULL;
+    
+    init();
+    fProbe = probe && probe->getValue();
+    fInterval = getNumber(properties, "PollInterval", kDefaultPollInterval);
+    if(fInterval < 1000)
+    {
+        fInterval = 1000;
+    }
+    
+    // the first one listed is the stick this driver was matched to
+    for(unsigned int i = 0; devices && i < devices->getCount(); i++)
+    {
+        OSDictionary    *device = OSDynamicCast(OSDictionary, devices->getObject(i));
+        int             address = getNumber(device, "Address", 0);
+        
+        if(!device || address < kADBFirstAddress || address > kADBLastAddress || find(address) >= 0)
+        {
+            IOLog("%s: ADBDevices entry %u is no good, skipping it\n", NAME, i);
+            continue;
+        }
+        if(addDevice(address, getNumber(device, "HandlerID", kTMHandlerID), getNumber(device, "Weight", 1)) < 0)
+        {
+            IOLog("%s: Only %d ADB devices fit, skipping the rest\n", NAME, kMaxADBDevices);
+            break;
+        }
+    }
+    
+    if(fNumDevices == 0)
+    {
+        addDevice(kTMDefaultAddress, kTMHandlerID, 1);
+    }
+}
+
+int TMPollScheduler::addDevice(UInt8 address, UInt8 handlerID, int weight)
+{
+    TMADBDevice *device;
+    
+    if(fNumDevices >= kMaxADBDevices)
+    {
+        return -1;
+    }
+    if(weight < 1)
+    {
+        weight = 1;
+    }
+    
+    device = &fDevices[fNumDevices];
+    device->address = address;
+    device->handlerID = handlerID;
+    device->weight = weight;
+    device->credit = 0;
+    device->halves = 0;
+    device->polls = 0;
+    device->answers = 0;
+    
+    // the first one is the stick, which the iMate polls
+    if(fNumDevices > 0)
+    {
+        fTotalWeight += weight;
+    }
+    
+    return fNumDevices++;
+}
+
+int TMPollScheduler::find(UInt8 address) const
+{
+    for(int i = 0; i < fNumDevices; i++)
+    {
+        if(fDevices[i].address == address)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int TMPollScheduler::next()
+{
+    int best = 1;
+    
+    if(fCurrent >= 0 && fDevices[fCurrent].halves == 0)
+    {
+        fMissed++;
+    }
+    
+    // everyone earns their weight, the richest gets the poll and pays for it
+    // with everyone's. Over fTotalWeight polls each device gets its weight.
+    for(int i = 1; i < fNumDevices; i++)
+    {
+        fDevices[i].credit += fDevices[i].weight;
+        if(fDevices[i].credit > fDevices[best].credit)
+        {
+            best = i;
+        }
+    }
+    fDevices[best].credit -= fTotalWeight;
+    fDevices[best].halves = 0;
+    fDevices[best].polls++;
+    fPolls++;
+    
+    fCurrent = best;
+    return best;
+}
+
+int TMPollScheduler::route(UInt8 *data)
+{
+    UInt8   tag = data[kHalfFrameTagByte];
+    
+    // the stick, autopolled by the iMate
+    if(tag == kFirstHalfTag || tag == kSecondHalfTag)
+    {
+        return 0;
+    }
+    
+    // an answer to one of our polls, the reads take turns being the halves
+    for(int i = 1; i < fNumDevices; i++)
+    {
+        if(tag != ADBCommand(fDevices[i].address, kADBTalk, 0))
+        {
+            continue;
+        }
+        if(fDevices[i].halves == 0)
+        {
+            fDevices[i].answers++;
+        }
+        if((fDevices[i].halves++ & 1) == 0)
+        {
+            data[kHalfFrameTagByte] = kFirstHalfTag;
+        }
+        else
+        {
+            data[kHalfFrameTagByte] = kSecondHalfTag;
+        }
+        return i;
+    }
+    return -1;
+}
+
+UInt32 TMPollScheduler::share(int device) const
+{
+    return fPolls ? (UInt32)((UInt64)fDevices[device].polls * 1000 / fPolls) : 0;
+}
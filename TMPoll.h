@@ -0,0 +1,112 @@
+/*
+ File:		TMPoll.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Sharing one iMate between several ADB devices, say the stick and a set of
+ pedals. The init sequence already talks raw ADB: vendor request 0 sends
+ the command byte in wValue (0x7f is a Talk Register 3 to address 7, where
+ the stick lives). The driver probes each address with Talk Register 3 at
+ init, and each answer gives the device's handler ID, 95 for a Thrustmaster.
+
+ The iMate keeps autopolling the stick the whole time, so with more than
+ one device the driver polls the others itself, one Talk Register 0 at a
+ time, and never the stick. Which device gets the next poll is a smooth
+ weighted round robin: each gets Weight polls out of every total weight,
+ and they are spread out instead of bunched up. The counters show how the
+ polls were actually shared.
+
+ The iMate tags an answer to a command it was sent with the command byte,
+ in the same byte the stick's halves use for 0x18/0x98. That is how the
+ probe tells its answers apart from frames the iMate is autopolling, and
+ how route() hands each half to its device: 0x18/0x98 is the stick, and a
+ Talk Register 0 tag is the device at that address. This assumes the 8
+ bytes of register 0 come back in two reads with the same tag, in order,
+ so route() retags them 0x18 and 0x98 and the device's TMCore puts them
+ together like the stick's. That comes from how the iMate answers Talk
+ Register 3 at init and hasn't been seen on the hardware for register 0,
+ the mock (tmmock -A) answers it that way.
+ */
+
+#ifndef __TMPOLL__
+#define __TMPOLL__
+
+#include "TMCore.h"
+
+// this is the handler ID of the TM device
+#define kTMHandlerID            95
+
+// where the stick is unless ADBDevices says otherwise
+#define kTMDefaultAddress       7
+
+// ADB has 16 addresses, 0 is the host
+#define kADBFirstAddress        1
+#define kADBLastAddress         15
+#define kMaxADBDevices          4
+
+// ADB command bytes, address in the top nibble, register in the bottom 2 bits
+#define kADBTalk                0x0C
+#define kADBListen              0x08
+#define ADBCommand(address, command, reg)   ((UInt8)(((address) << 4) | (command) | (reg)))
+
+// the vendor request that sends an ADB command, see gInitSequence
+#define kADBCommandRequest      0x00
+
+// an answer to Talk Register 3, after the 4 byte header
+#define kADBRegister3Byte       (kHalfFrameSize - kHalfFrameDataSize)
+#define kADBHandlerIDByte       (kADBRegister3Byte + 1)
+
+// how long to wait for a Talk Register 3 answer, in ms
+#define kADBProbeTimeout        20
+
+// us between polls, the whole bus gets about this many, shared out
+#define kDefaultPollInterval    4000
+
+struct TMADBDevice
+{
+    UInt8                       address;
+    UInt8                       handlerID;
+    int                         weight;             // polls out of every fTotalWeight
+    int                         credit;             // for picking the next one, see next()
+    int                         halves;             // answered since it was last polled
+    UInt32                      polls;
+    UInt32                      answers;
+};
+
+class TMPollScheduler
+{
+public:
+    TMADBDevice                 fDevices[kMaxADBDevices];
+    int                         fNumDevices;
+    int                         fTotalWeight;       // of the polled ones, not the stick's
+    UInt32                      fInterval;          // us between polls
+    bool                        fProbe;             // look for devices at init
+
+    // the last device polled, -1 if none
+    int                         fCurrent;
+    UInt32                      fPolls;
+    UInt32                      fMissed;            // polls not answered before the next one
+    UInt32                      fSkipped;           // the last poll was still being sent
+
+public:
+    void init();
+    void loadProperties(OSDictionary *properties);
+
+    int addDevice(UInt8 address, UInt8 handlerID, int weight);
+    int find(UInt8 address) const;
+
+    // the driver only has to poll once there is more than the stick
+    bool isEnabled() const { return fNumDevices > 1; }
+
+    // which device to poll next, the index into fDevices, never the stick
+    // at 0. Only once isEnabled().
+    int next();
+
+    // which device a half frame belongs to, from its tag, -1 for nobody we
+    // know. An answer to a poll is retagged as one of the stick's halves.
+    int route(UInt8 *data);
+
+    // fDevices[device]'s share of the polls, in tenths of a percent
+    UInt32 share(int device) const;
+};
+
+#endif
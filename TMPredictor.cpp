@@ -0,0 +1,166 @@
+/*
+ File:		TMPredictor.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMPredictor.h"
+
+// where each axis is in the iMate data
+static const UInt8 gAxisBytes[kNumAxes] = {kXAxisByte, kYAxisByte, kRuddersByte, kThrottleByte};
+
+// the x, y and rudder are signed, flip the top bit so they are in order
+static inline int axisFlip(int axis)
+{
+    return (axis == kThrottleAxis) ? 0 : 0x80;
+}
+
+static int getNumber(OSDictionary *dict, const char *key, int defaultValue)
+{
+    OSNumber *number = dict ? OSDynamicCast(OSNumber, dict->getObject(key)) : NULL;
+    
+    return number ? (int)number->unsigned32BitValue() : defaultValue;
+}
+
+void TMPredictor::init()
+{
+    fMode = kPredictNone;
+    fAlpha = kPredictDefaultAlpha * 256 / 100;
+    fBeta = kPredictDefaultBeta * 256 / 100;
+    fInterval = kPredictDefaultInterval;
+    fLimit = 0;
+    
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        fPosition[i] = 0;
+        fVelocity[i] = 0;
+    }
+    for(int i = 0; i < kControlDataSize; i++)
+    {
+        fLastData[i] = 0;
+    }
+    fLastTime = 0;
+    fFrameInterval = 0;
+    fFrames = 0;
+}
+
+void TMPredictor::loadProperties(OSDictionary *properties)
+{
+    OSDictionary    *prediction = properties ? OSDynamicCast(OSDictionary, properties->getObject("Prediction")) : NULL;
+    OSString        *mode = prediction ? OSDynamicCast(OSString, prediction->getObject("Mode")) : NULL;
+    
+    init();
+    if(!mode)
+    {
+        return;
+    }
+    
+    if(strcmp(mode->getCStringNoCopy(), "Linear") == 0)
+    {
+        fMode = kPredictLinear;
+    }
+    else if(strcmp(mode->getCStringNoCopy(), "AlphaBeta") == 0)
+    {
+        fMode = kPredictAlphaBeta;
+    }
+    else if(strcmp(mode->getCStringNoCopy(), "None") != 0)
+    {
+        IOLog("%s: Unknown prediction mode %s, leaving it off\n", NAME, mode->getCStringNoCopy());
+    }
+    
+    fAlpha = getNumber(prediction, "Alpha", kPredictDefaultAlpha) * 256 / 100;
+    fBeta = getNumber(prediction, "Beta", kPredictDefaultBeta) * 256 / 100;
+    fInterval = getNumber(prediction, "Interval", kPredictDefaultInterval);
+    fLimit = getNumber(prediction, "Limit", 0) * 1000;
+    
+    if(fAlpha < 1 || fAlpha > 256)
+        fAlpha = 256;
+    if(fBeta < 0 || fBeta > 256)
+        fBeta = kPredictDefaultBeta * 256 / 100;
+    if(fInterval < 500)
+        fInterval = 500;
+}
+
+void TMPredictor::update(UInt64 now, const UInt8 *control, UInt8 *data)
+{
+    int dt = (fFrames > 0) ? (int)((now - fLastTime) / 1000) : 0;
+    
+    for(int i = 0; i < kControlDataSize; i++)
+    {
+        fLastData[i] = data[i] = control[i];
+    }
+    
+    // a long gap means the stick was idle, start over rather than work out
+    // a velocity over it
+    if(dt <= 0 || (fFrameInterval && (UInt32)dt > 8 * fFrameInterval))
+    {
+        for(int i = 0; i < kNumAxes; i++)
+        {
+            fPosition[i] = (control[gAxisBytes[i]] ^ axisFlip(i)) << 8;
+            fVelocity[i] = 0;
+        }
+        fLastTime = now;
+        fFrames = 1;
+        return;
+    }
+    
+    // keep a running idea of the frame rate, to know how far is too far
+    fFrameInterval = fFrameInterval ? fFrameInterval + (dt - (int)fFrameInterval) / 8 : dt;
+    
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        int measured = (control[gAxisBytes[i]] ^ axisFlip(i)) << 8;
+        
+        if(fMode == kPredictAlphaBeta)
+        {
+            // predict forward, then pull the guess toward what we measured
+            int predicted = fPosition[i] + (int)((SInt64)fVelocity[i] * dt / 1000);
+            int residual = measured - predicted;
+            
+            fPosition[i] = predicted + residual * fAlpha / 256;
+            fVelocity[i] += (int)((SInt64)residual * fBeta / 256 * 1000 / dt);
+            
+            // the filter is only for the guesses, the frame goes out as it is
+            if(fPosition[i] < 0)
+                fPosition[i] = 0;
+            if(fPosition[i] > 255 << 8)
+                fPosition[i] = 255 << 8;
+        }
+        else
+        {
+            fVelocity[i] = (int)((SInt64)(measured - fPosition[i]) * 1000 / dt);
+            fPosition[i] = measured;
+        }
+    }
+    
+    fLastTime = now;
+    fFrames++;
+}
+
+bool TMPredictor::predict(UInt64 now, UInt8 *data) const
+{
+    UInt32  limit = fLimit ? fLimit : kPredictLimitFrames * fFrameInterval;
+    SInt64  ahead = (SInt64)(now - fLastTime) / 1000;
+    
+    // need two frames to have a velocity, and don't go too far past the last one
+    if(fMode == kPredictNone || fFrames < 2 || ahead <= 0 || ahead > limit)
+    {
+        return false;
+    }
+    
+    for(int i = 0; i < kControlDataSize; i++)
+    {
+        data[i] = fLastData[i];
+    }
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        int position = fPosition[i] + (int)(fVelocity[i] * ahead / 1000);
+        
+        if(position < 0)
+            position = 0;
+        if(position > 255 << 8)
+            position = 255 << 8;
+        data[gAxisBytes[i]] = ((position + 128) >> 8) ^ axisFlip(i);
+    }
+    
+    return true;
+}
@@ -0,0 +1,62 @@
+/*
+ File:		TMPredictor.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Guesses where the axes are between frames. The ADB bus behind the iMate is
+ polled a lot slower than USB, so the axes show up late and in steps. This
+ keeps track of how fast each axis is moving and extrapolates from the last
+ real frame, so the kext can send reports in between. Everything is fixed
+ point so it can run in the kernel.
+ */
+
+#ifndef __TMPREDICTOR__
+#define __TMPREDICTOR__
+
+#include "TMCore.h"
+
+enum {
+    kPredictNone                = 0,
+    kPredictLinear,             // velocity from the last two frames
+    kPredictAlphaBeta           // alpha-beta filtered position and velocity
+};
+
+// defaults for the Prediction dictionary
+#define kPredictDefaultInterval     2000        // us between extrapolated reports
+#define kPredictDefaultAlpha        85          // percent
+#define kPredictDefaultBeta         40          // percent
+
+// never extrapolate further than this past the last frame, in frame intervals
+#define kPredictLimitFrames         2
+
+class TMPredictor
+{
+public:
+    int                         fMode;
+    int                         fAlpha;             // out of 256
+    int                         fBeta;              // out of 256
+    UInt32                      fInterval;          // us
+    UInt32                      fLimit;             // us, 0 to go by the frame rate
+
+    // per axis, positions are 1/256ths of a raw unit and velocities are
+    // 1/256ths of a raw unit per ms
+    int                         fPosition[kNumAxes];
+    int                         fVelocity[kNumAxes];
+    UInt8                       fLastData[kControlDataSize];
+    UInt64                      fLastTime;          // ns of the last real frame
+    UInt32                      fFrameInterval;     // us between real frames, smoothed
+    int                         fFrames;
+
+public:
+    void init();
+    void loadProperties(OSDictionary *properties);
+    bool isEnabled() const { return fMode != kPredictNone; }
+
+    // feed in each real frame, data is filled in with what to report, which
+    // is always the frame itself. Only predict() uses the filter.
+    void update(UInt64 now, const UInt8 *control, UInt8 *data);
+
+    // the axes extrapolated to now, false once that is too far past the last frame
+    bool predict(UInt64 now, UInt8 *data) const;
+};
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ File:		TMProfile.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMProfile.h"
+
+static void putLE(UInt8 *out, UInt64 value, int bytes)
+{
+    for(int i = 0; i < bytes; i++)
+    {
+        out[i] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+static UInt64 getLE(const UInt8 *in, int bytes)
+{
+    UInt64 value = 0;
+    
+    for(int i = 0; i < bytes; i++)
+    {
+        value |= (UInt64)in[i] << (8 * i);
+    }
+    return value;
+}
+
+void TMProfile::init(const TMCore *core, const char *name)
+{
+    int     i;
+    
+    fSettings = 0;
+    if(core->fHasRudders)
+        fSettings |= kProfileHasRudder;
+    if(core->fHasThrottle)
+        fSettings |= kProfileHasThrottle;
+    if(core->fRockerIsModifier)
+        fSettings |= kProfileRockerIsModifier;
+    if(core->fHatIsModified)
+        fSettings |= kProfileModifierEffectsHat;
+    if(core->fTwistRudder)
+        fSettings |= kProfileTwistRudder;
+    if(core->fHighResAxes)
+        fSettings |= kProfileHighResAxes;
+    
+    fButtons = core->fShiftedButtons;
+    fLayerButtons = core->fLayerButtons;
+    
+    for(i = 0; name && name[i] && i < kProfileNameSize - 1; i++)
+    {
+        fName[i] = name[i];
+    }
+    for(; i < kProfileNameSize; i++)
+    {
+        fName[i] = 0;
+    }
+    
+    for(i = 0; i < kNumAxes; i++)
+    {
+        fAxes[i] = core->fAxisCalibration[i];
+    }
+}
+
+UInt32 TMProfile::write(UInt8 *buffer, UInt32 capacity) const
+{
+    if(capacity < kProfileSize)
+    {
+        return 0;
+    }
+    
+    buffer[0] = 'T';
+    buffer[1] = 'M';
+    buffer[2] = 'P';
+    buffer[3] = 'F';
+    putLE(buffer + 4, kProfileVersion, 2);
+    putLE(buffer + 6, kProfileSize, 2);
+    buffer[12] = fSettings;
+    buffer[13] = 0;
+    putLE(buffer + 14, fButtons, 2);
+    for(int i = 0; i < kProfileNameSize; i++)
+    {
+        buffer[16 + i] = fName[i];
+    }
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        putAxis(buffer + kProfileAxesOffset + i * kProfileAxisSize, &fAxes[i]);
+    }
+    putLE(buffer + kProfileV1Size, fLayerButtons, 2);
+    
+    // last, it covers everything above
+    putLE(buffer + 8, checksum(buffer + 12, kProfileSize - 12), 4);
+    return kProfileSize;
+}
+
+int TMProfile::read(const UInt8 *buffer, UInt32 length)
+{
+    TMAxisCalibration   axes[kNumAxes];
+    UInt32              version, size;
+    UInt16              buttons, layers = 0;
+    int                 layerBits = 0;
+    
+    if(length < 12)
+    {
+        return kProfileTooShort;
+    }
+    if(buffer[0] != 'T' || buffer[1] != 'M' || buffer[2] != 'P' || buffer[3] != 'F')
+    {
+        return kProfileBadMagic;
+    }
+    version = getLE(buffer + 4, 2);
+    if(version < 1 || version > kProfileVersion)
+    {
+        return kProfileBadVersion;
+    }
+    size = getLE(buffer + 6, 2);
+    if(size != ((version == 1) ? kProfileV1Size : kProfileSize))
+    {
+        return kProfileBadLength;
+    }
+    if(length < size)
+    {
+        return kProfileTooShort;
+    }
+    if(getLE(buffer + 8, 4) != checksum(buffer + 12, size - 12))
+    {
+        return kProfileBadChecksum;
+    }
+    
+    // a good checksum only says it got here in one piece, not that it makes sense
+    buttons = getLE(buffer + 14, 2);
+    if(version >= 2)
+    {
+        layers = getLE(buffer + kProfileV1Size, 2);
+    }
+    for(int i = 0; i < kNumOfButtons; i++)
+    {
+        layerBits += (layers >> i) & 1;
+    }
+    if((buffer[12] & ~kProfileAllSettings) || buffer[13] != 0 || (buttons >> kNumOfButtons) ||
+       (layers >> kNumOfButtons) || layerBits > kMaxLayerButtons || buffer[16 + kProfileNameSize - 1] != 0)
+    {
+        return kProfileBadSettings;
+    }
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        const UInt8 *in = buffer + kProfileAxesOffset + i * kProfileAxisSize;
+        
+        getAxis(in, kProfileAxisSize, &axes[i]);
+        if(in[6] > 1 || in[7] != 0 || !isAxisValid(&axes[i]))
+        {
+            return kProfileBadAxis;
+        }
+    }
+    
+    fSettings = buffer[12];
+    fButtons = buttons;
+    fLayerButtons = layers;
+    for(int i = 0; i < kProfileNameSize; i++)
+    {
+        fName[i] = buffer[16 + i];
+    }
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        fAxes[i] = axes[i];
+    }
+    return kProfileOK;
+}
+
+const char *TMProfile::errorString(int error)
+{
+    switch(error)
+    {
+        case kProfileOK:            return "ok";
+        case kProfileTooShort:      return "too short";
+        case kProfileBadMagic:      return "not a profile";
+        case kProfileBadVersion:    return "unknown version";
+        case kProfileBadLength:     return "wrong length";
+        case kProfileBadChecksum:   return "bad checksum";
+        case kProfileBadSettings:   return "bad settings";
+        case kProfileBadAxis:       return "bad axis calibration";
+    }
+    return "unknown error";
+}
+
+// the usual CRC-32, a bit at a time. Profiles are small and only read when
+// the settings change, so a table isn't worth the 1k.
+UInt32 TMProfile::checksum(const UInt8 *data, UInt32 length)
+{
+    UInt32  crc = 0xffffffff;
+    
+    for(UInt32 i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        for(int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+void TMProfile::putAxis(UInt8 *out, const TMAxisCalibration *cal)
+{
+    out[0] = cal->min;
+    out[1] = cal->max;
+    out[2] = (cal->center == kNoCenter) ? 255 : cal->center;
+    out[3] = cal->deadzone;
+    out[4] = cal->expo;
+    out[5] = cal->sCurve;
+    out[6] = cal->invert;
+    out[7] = 0;
+    out[8] = cal->hysteresis;
+    out[9] = cal->smoothing;
+}
+
+// size is less than 10 for the older captures, the jitter filter is off in those
+void TMProfile::getAxis(const UInt8 *in, UInt32 size, TMAxisCalibration *cal)
+{
+    cal->min = in[0];
+    cal->max = in[1];
+    cal->center = (in[2] == 255) ? kNoCenter : in[2];
+    cal->deadzone = in[3];
+    cal->expo = in[4];
+    cal->sCurve = in[5];
+    cal->invert = in[6] != 0;
+    cal->hysteresis = (size > 8) ? in[8] : 0;
+    cal->smoothing = (size > 9) ? in[9] : 0;
+}
+
+bool TMProfile::isAxisValid(const TMAxisCalibration *cal)
+{
+    if(cal->min < 0 || cal->max > 255 || cal->min >= cal->max)
+        return false;
+    if(cal->center != kNoCenter && (cal->center <= cal->min || cal->center >= cal->max))
+        return false;
+    return cal->deadzone >= 0 && cal->expo >= 0 && cal->expo <= 100 && cal->sCurve >= 0 && cal->sCurve <= 100 &&
+           cal->hysteresis >= 0 && cal->hysteresis <= 255 && cal->smoothing >= 0 && cal->smoothing <= 100;
+}
@@ -0,0 +1,93 @@
+/*
+ File:		TMProfile.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Every setting that changes the report, packed into a small checksummed
+ blob. The driver takes one as the Profile property in place of the
+ separate keys and loads it straight into TMCore without going through a
+ dictionary, and tools/tmprofile makes them, dumps them and checks them.
+ Everything is little endian.
+
+ Profile (90 bytes, 88 in version 1)
+     0  'TMPF'
+     4  UInt16  version
+     6  UInt16  length of the whole profile
+     8  UInt32  CRC-32 of everything after this, up to length
+    12  UInt8   settings, see kProfileHas...
+    13  UInt8   reserved, 0
+    14  UInt16  Buttons, bit n set if button n is shifted by the rocker
+    16  char    name [32], NUL padded
+    48  axis calibration, 10 bytes for each of X, Y, rudder and throttle:
+        min, max, center (255 for none), deadzone, expo, s-curve, invert,
+        0, hysteresis, smoothing
+    88  UInt16  LayerButtons, bit n set if button n picks the layer. Not in
+                version 1, where there are none.
+
+ The settings byte and the axis entries are the same as in a capture's
+ header, see TMCapture.h.
+ */
+
+#ifndef __TMPROFILE__
+#define __TMPROFILE__
+
+#include "TMCore.h"
+
+#define kProfileVersion         2
+#define kProfileNameSize        32
+#define kProfileAxesOffset      48
+#define kProfileAxisSize        10
+#define kProfileV1Size          (kProfileAxesOffset + kNumAxes * kProfileAxisSize)
+#define kProfileSize            (kProfileV1Size + 2)
+
+enum {
+    kProfileHasRudder           = 1 << 0,
+    kProfileHasThrottle         = 1 << 1,
+    kProfileRockerIsModifier    = 1 << 2,
+    kProfileModifierEffectsHat  = 1 << 3,
+    kProfileTwistRudder         = 1 << 4,
+    kProfileHighResAxes         = 1 << 5,
+    kProfileAllSettings         = (1 << 6) - 1
+};
+
+// what read() thinks of a profile
+enum {
+    kProfileOK                  = 0,
+    kProfileTooShort,
+    kProfileBadMagic,
+    kProfileBadVersion,
+    kProfileBadLength,
+    kProfileBadChecksum,
+    kProfileBadSettings,
+    kProfileBadAxis
+};
+
+class TMProfile
+{
+public:
+    UInt8                       fSettings;
+    UInt16                      fButtons;
+    UInt16                      fLayerButtons;
+    char                        fName[kProfileNameSize];
+    TMAxisCalibration           fAxes[kNumAxes];
+
+public:
+    // the settings core is using now
+    void init(const TMCore *core, const char *name);
+    
+    // the whole profile into buffer, returns its length or 0 if it doesn't fit
+    UInt32 write(UInt8 *buffer, UInt32 capacity) const;
+    
+    // checks everything, returns kProfileOK or what was wrong. Nothing is
+    // loaded unless it is kProfileOK.
+    int read(const UInt8 *buffer, UInt32 length);
+    
+    static const char *errorString(int error);
+    static UInt32 checksum(const UInt8 *data, UInt32 length);
+    
+    // one axis entry, shared with the capture header
+    static void putAxis(UInt8 *out, const TMAxisCalibration *cal);
+    static void getAxis(const UInt8 *in, UInt32 size, TMAxisCalibration *cal);
+    static bool isAxisValid(const TMAxisCalibration *cal);
+};
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ File:		TMProfileSet.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include "TMProfileSet.h"
+
+// FCS button bits, in the order of the Buttons array like buildTranslationTables()
+static const UInt8 gFCSButtonMasks[kNumOfFCSButtons] =
+    {kFCSTriggerMask, kFCSThumbHighMask, kFCSThumbLowMask, kFCSPinkyMask};
+
+void TMProfileSet::init(TMCore *core)
+{
+    fCore = core;
+    fMaps[0] = core;
+    snprintf(fNames[0], kProfileNameSize, "Default");
+    fCount = 1;
+    fActive = 0;
+    fChordFCS = 0;
+    fChordWCS = 0;
+    fChordHeld = false;
+    fSwitches = 0;
+}
+
+void TMProfileSet::loadProperties(OSDictionary *properties)
+{
+    OSArray     *profiles = properties ? OSDynamicCast(OSArray, properties->getObject("Profiles")) : NULL;
+    OSArray     *chord = properties ? OSDynamicCast(OSArray, properties->getObject("ProfileChord")) : NULL;
+    
+    clear();
+    init(fCore);
+    
+    for(unsigned int i = 0; profiles && i < profiles->getCount(); i++)
+    {
+        OSData      *data = OSDynamicCast(OSData, profiles->getObject(i));
+        TMProfile   profile;
+        TMCore      *map;
+        int         error = data ? profile.read((const UInt8*)data->getBytesNoCopy(), data->getLength()) : kProfileBadMagic;
+        
+        if(error != kProfileOK)
+        {
+            IOLog("%s: Profiles entry %u is no good (%s), skipping it\n", NAME, i, TMProfile::errorString(error));
+            continue;
+        }
+        if(fCount >= kMaxProfiles)
+        {
+            IOLog("%s: Only %d profiles fit, skipping the rest\n", NAME, kMaxProfiles);
+            break;
+        }
+        
+        map = new TMCore;
+        if(!map)
+        {
+            break;
+        }
+        map->init();
+        map->loadProfile(&profile);
+        if(!fCore->sameLayout(map))
+        {
+            IOLog("%s: Profile %s needs a different report layout, skipping it\n", NAME, profile.fName);
+            delete map;
+            continue;
+        }
+        
+        fMaps[fCount] = map;
+        bcopy(profile.fName, fNames[fCount], kProfileNameSize);
+        if(!fNames[fCount][0])
+        {
+            snprintf(fNames[fCount], kProfileNameSize, "Profile %d", fCount);
+        }
+        fCount++;
+    }
+    
+    for(unsigned int i = 0; chord && i < chord->getCount(); i++)
+    {
+        OSNumber    *number = OSDynamicCast(OSNumber, chord->getObject(i));
+        int         button = number ? (int)number->unsigned32BitValue() : kNumOfButtons;
+        
+        if(button < kNumOfFCSButtons)
+            fChordFCS |= gFCSButtonMasks[button];
+        else if(button < kNumOfButtons)
+            fChordWCS |= 1 << (button - kNumOfFCSButtons);
+        else
+            IOLog("%s: ProfileChord entry %u isn't a button, skipping it\n", NAME, i);
+    }
+}
+
+void TMProfileSet::clear()
+{
+    // the core has to stop using them first
+    select(0);
+    for(int i = 1; i < fCount; i++)
+    {
+        delete fMaps[i];
+    }
+    fCount = 1;
+    
+    // a new one could turn up where an old one was
+    fCore->forgetReports();
+}
+
+int TMProfileSet::find(const OSObject *nameOrIndex) const
+{
+    const OSNumber  *number = OSDynamicCast(OSNumber, nameOrIndex);
+    const OSString  *name = OSDynamicCast(OSString, nameOrIndex);
+    
+    if(number)
+    {
+        return (number->unsigned32BitValue() < (UInt32)fCount) ? (int)number->unsigned32BitValue() : -1;
+    }
+    for(int i = 0; name && i < fCount; i++)
+    {
+        if(name->isEqualTo(fNames[i]))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool TMProfileSet::checkChord(const UInt8 *data)
+{
+    bool    held;
+    
+    if(!(fChordFCS | fChordWCS) || fCount < 2)
+    {
+        return false;
+    }
+    
+    // only on the way down, holding it doesn't keep going round
+    held = (data[kFCSButtonsByte] & fChordFCS) == fChordFCS && (data[kWCSButtonsByte] & fChordWCS) == fChordWCS;
+    if(!held || fChordHeld)
+    {
+        fChordHeld = held;
+        return false;
+    }
+    fChordHeld = true;
+    
+    select((fActive + 1) % fCount);
+    return true;
+}
+
+void TMProfileSet::select(int index)
+{
+    if(index == fActive)
+    {
+        return;
+    }
+    fActive = index;
+    fCore->fMap = fMaps[index];
+    fSwitches++;
+}
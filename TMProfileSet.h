@@ -0,0 +1,55 @@
+/*
+ File:		TMProfileSet.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Several mappings held at once so a different sim is one switch away
+ instead of a plist edit and a restart. The Profiles key lists profiles
+ (see TMProfile.h) on top of the driver's own settings, which are always
+ the first one. Each is built into a TMCore of its own when the driver
+ starts, and switching just points the core's fMap at another one between
+ two frames, so nothing is allocated or rebuilt then.
+
+ The HID layer only reads the report descriptor once, so a profile that
+ would change it is left out. ProfileChord is a list of buttons, numbered
+ like the Buttons key, that steps to the next profile when they are all
+ held down. Writing ActiveProfile, a name or an index, picks one.
+ */
+
+#ifndef __TMPROFILESET__
+#define __TMPROFILESET__
+
+#include "TMCore.h"
+#include "TMProfile.h"
+
+#define kMaxProfiles            8
+
+class TMProfileSet
+{
+public:
+    TMCore                      *fCore;
+    TMCore                      *fMaps[kMaxProfiles];    // 0 is fCore itself
+    char                        fNames[kMaxProfiles][kProfileNameSize];
+    int                         fCount;
+    int                         fActive;
+    
+    // the chord, as masks on the raw button bytes
+    UInt8                       fChordFCS;
+    UInt8                       fChordWCS;
+    bool                        fChordHeld;
+    UInt32                      fSwitches;
+
+public:
+    void init(TMCore *core);
+    void loadProperties(OSDictionary *properties);
+    void clear();
+    
+    int find(const OSObject *nameOrIndex) const;
+    
+    // a new frame was committed, true if the chord switched profiles
+    bool checkChord(const UInt8 *data);
+    
+    // only between frames, on the same thread as them
+    void select(int index);
+};
+
+#endif
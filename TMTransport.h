@@ -0,0 +1,58 @@
+/*
+ File:		TMTransport.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Everything TMLink needs from the USB side. In the kext this is the
+ IOUSBInterface and its interrupt pipe (TMUSBTransport in Thrustmaster.h),
+ off a Mac it is the scriptable stand-in in tools/TMMockTransport.h.
+ */
+
+#ifndef __TMTRANSPORT__
+#define __TMTRANSPORT__
+
+#include "TMCore.h"
+
+#ifdef KERNEL
+#include <IOKit/usb/USB.h>
+#endif
+
+// what adaptive init has learned about one iMate, as a percentage of each
+// step's delay. It is kept with the iMate so the next attach can start from it.
+struct TMInitTiming
+{
+    UInt32                      good;               // fastest that brought the iMate up
+    UInt32                      failed;             // slowest that didn't
+};
+
+class TMTransport
+{
+public:
+    virtual ~TMTransport() {}
+
+    // send a control request to the iMate. Without a completion it blocks
+    // until it is done, with one it returns straight away and the completion
+    // gets called once it is done. The request has to stay around until then.
+    virtual IOReturn deviceRequest(IOUSBDevRequest *request, IOUSBCompletion *completion = NULL) = 0;
+
+    // queue a read on the interrupt pipe, the completion gets called once it
+    // is done (or aborted)
+    virtual IOReturn read(IOMemoryDescriptor *buffer, IOUSBCompletion *completion) = 0;
+
+    // fail every read that is queued
+    virtual void abort() = 0;
+
+    // let go of the device, called once the last read has come back
+    virtual void close() = 0;
+
+    // remember that the iMate has been set up, for as long as it stays
+    // plugged in, so the next driver to attach can skip the init sequence
+    virtual bool wasInitialized() = 0;
+    virtual void setInitialized() = 0;
+
+    // and what adaptive init learned about it, timing is left alone if
+    // nothing has been learned yet
+    virtual void getInitTiming(TMInitTiming *timing) = 0;
+    virtual void setInitTiming(const TMInitTiming *timing) = 0;
+};
+
+#endif
@@ -11,39 +11,7 @@
 #include <IOKit/IOPlatformExpert.h>
 #include <IOKit/hidsystem/IOHidUsageTables.h>
 #include <IOKit/IOReturn.h>
-
-#define NAME "TM"
-
-// I don't know what these do, but I recorded this communication between
-// the iMate driver and the iMate device. And replaying them with a short pause
-// between them seems to get the iMate device to do what I want.
-#define kNumInitCmds    15
-static UInt8 gCmd1[] = {0x0f, 0xfe};
-static UInt8 gCmd2[] = {0x07, 0xfe};
-static IOUSBDevRequest gInitSequence[kNumInitCmds] =
-{
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0004, 0x00FF, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0002, 0x0000, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x0030, 0x0000, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x007f, 0x0000, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x00ff, 0x0000, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x007b, 0x0000, sizeof(gCmd1), gCmd1, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x00ff, 0x0000, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x007f, 0x0000, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x00fb, 0x0000, sizeof(gCmd2), gCmd2, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x007f, 0x0000, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0001, 0x8000, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0004, 0x00FF, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0004, 0x000a, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x01, 0x0003, 0x0001, 0, NULL, 0},
-    {USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface), 0x00, 0x007e, 0x0000, 0, NULL, 0}
-};
-
-// this is the handler ID of the TM device
-#define	kTMHandlerID	95
-
-// this is the size of the HID report
-#define kReportSize		10
+#include <IOKit/IOUserClient.h>
 
 // make sure our super is pointing to the right place...
 #undef super
@@ -79,492 +47,549 @@ IOReturn com_milvich_driver_Thrustmaster::getReport(IOMemoryDescriptor *report,
     // I have no idea what the report types or option bits are... so I am just
     // ignoring them..
 
-    // use the data from the last interrupt... they shouldn't have changed...
-    return getReport(report, fControlData, sizeof(fControlData));
+    // hand back the last report we sent. The reports are built on the
+    // dispatch loop, so it is copied out there too, between two of them.
+    if(fDispatchLoop)
+    {
+        return fDispatchLoop->runAction(copyReportAction, this, report);
+    }
+    return fCore.copyLastReport(report);
 }
 
-IOReturn com_milvich_driver_Thrustmaster::getReport(IOMemoryDescriptor *report, UInt8 *TMData, IOByteCount length)
+IOReturn com_milvich_driver_Thrustmaster::copyReportAction(OSObject *obj, void *arg0, void *arg1, void *arg2, void *arg3)
 {
-    UInt8           data[kReportSize];
-    int             rockerPosition;
-    unsigned int    buttons = 0;
-    UInt8           hat;
-
-    if(TMData[kWCSButtonsByte] & kWCSRockerUPMask)
-    {
-        rockerPosition = 0;
-    }
-    else if(TMData[kWCSButtonsByte] & kWCSRockerDownMask)
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
+    
+    if(dump)
     {
-        rockerPosition = 2;
+        return dump->fCore.copyLastReport((IOMemoryDescriptor*)arg0);
     }
-    else
+    return kIOReturnSuccess;
+}
+
+IOReturn com_milvich_driver_Thrustmaster::getReport(IOMemoryDescriptor *report, UInt8 *TMData, IOByteCount length)
+{
+    return fCore.getReport(report, TMData);
+}
+
+void com_milvich_driver_Thrustmaster::packet(UInt8 *data, IOByteCount length)
+{
+    UInt64  time = fLatency.start();
+    int     index;
+    
+    // translated straight into the buffer the HID layer gets
+    index = fCore.buildReport(data);
+    time = fLatency.mark(kLatencyTranslation, time);
+    handleReport(fReports[index]);
+    time = fLatency.mark(kLatencyReport, time);
+    
+    // and all the way from the USB completion
+    fLatency.record(kLatencyTotal, time - fFrameTimestamp);
+}
+
+IOReturn com_milvich_driver_Thrustmaster::newReportDescriptor(IOMemoryDescriptor **descriptor) const
+{
+    // the descriptor only depends on the settings, so it was built once in
+    // init(). Just hand out another reference to it, nobody writes to it.
+    if(fReportDescriptor == NULL)
     {
-        rockerPosition = 1;
+        return kIOReturnNoMemory;
     }
+    
+    fReportDescriptor->retain();
+    *descriptor = fReportDescriptor;
+    
+    return kIOReturnSuccess;
+}
 
-    // zero everything
-    for(int i = 0; i < kReportSize; i++)
+bool com_milvich_driver_Thrustmaster::serializeProperties(OSSerialize *s) const
+{
+    // refresh the latency numbers whenever someone looks at the registry
+    if(fLatency.fEnabled)
     {
-        data[i] = 0;
+        OSDictionary *latency = fLatency.copyDictionary();
+        
+        if(latency)
+        {
+            ((com_milvich_driver_Thrustmaster*)this)->setProperty("Latency", latency);
+            latency->release();
+        }
     }
-
-    // set up the buttons, reordering the bits so that they make more sense, trigger as button
-    // six is just lame...
     
-    // FCS Buttons
-    buttons = buttons | ((bool)(TMData[kFCSButtonsByte] & kFCSTriggerMask)) << fButtonShifts[0 + rockerPosition];
-    buttons = buttons | ((bool)(TMData[kFCSButtonsByte] & kFCSThumbHighMask)) << fButtonShifts[3 + rockerPosition];
-    buttons = buttons | ((bool)(TMData[kFCSButtonsByte] & kFCSThumbLowMask)) << fButtonShifts[6 + rockerPosition];
-    buttons = buttons | ((bool)(TMData[kFCSButtonsByte] & kFCSPinkyMask)) << fButtonShifts[9 + rockerPosition];
+    // how long it took to get the iMate going
+    OSDictionary *timing = OSDictionary::withCapacity(4);
+    if(timing)
+    {
+        OSNumber *number;
+        
+        number = OSNumber::withNumber(fLink.fInitTime / 1000000, 32);
+        timing->setObject("Time", number);
+        number->release();
+        number = OSNumber::withNumber(fLink.fInitScale, 32);
+        timing->setObject("DelayScale", number);
+        number->release();
+        number = OSNumber::withNumber(fLink.fTiming.good, 32);
+        timing->setObject("FastestGoodScale", number);
+        number->release();
+        timing->setObject("Skipped", fLink.fSkippedInit ? kOSBooleanTrue : kOSBooleanFalse);
+        ((com_milvich_driver_Thrustmaster*)this)->setProperty("InitTiming", timing);
+        timing->release();
+    }
     
-    // do the WCS
-    if(fHasThrottle)
+    // what holding the report rate down has cost
+    if(fGovernor.isEnabled())
     {
-        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 1)) << fButtonShifts[12 + rockerPosition];
-        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 2)) << fButtonShifts[15 + rockerPosition];
-        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 4)) << fButtonShifts[18 + rockerPosition];
-        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 8)) << fButtonShifts[21 + rockerPosition];
-        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 16)) << fButtonShifts[24 + rockerPosition];
-        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 32)) << fButtonShifts[27 + rockerPosition];
+        OSDictionary *governor = OSDictionary::withCapacity(7);
+        
+        if(governor)
+        {
+            OSNumber *number;
+            
+            number = OSNumber::withNumber(fGovernor.fRate, 32);
+            governor->setObject("Rate", number);
+            number->release();
+            number = OSNumber::withNumber(fGovernor.fPublished, 32);
+            governor->setObject("Published", number);
+            number->release();
+            number = OSNumber::withNumber(fGovernor.fButtonFlushes, 32);
+            governor->setObject("ButtonFlushes", number);
+            number->release();
+            number = OSNumber::withNumber(fGovernor.fCoalesced, 32);
+            governor->setObject("Coalesced", number);
+            number->release();
+            number = OSNumber::withNumber(fGovernor.fWakeups, 32);
+            governor->setObject("Wakeups", number);
+            number->release();
+            number = OSNumber::withNumber(fGovernor.fMaxDelay / 1000, 32);
+            governor->setObject("MaxDelay", number);
+            number->release();
+            number = OSNumber::withNumber(fGovernor.fDelayed ? fGovernor.fTotalDelay / fGovernor.fDelayed / 1000 : 0, 32);
+            governor->setObject("MeanDelay", number);
+            number->release();
+            ((com_milvich_driver_Thrustmaster*)this)->setProperty("ReportGovernor", governor);
+            governor->release();
+        }
     }
     
-    // swap bytes around
-    *((unsigned int*)data) = HostToUSBLong(buttons);
-
-    // the hat switch is a pain
-    // As near as I can tell 15 == null, 0 == up, 1 == up right, 2 == right, and so on...
-    if(TMData[kFCSButtonsByte] & kFCSHatUpMask && TMData[kFCSButtonsByte] & kFCSHatRightMask)
+    // how the polls were shared out between the ADB devices
+    if(fPoll.isEnabled())
     {
-        hat = 2;
+        OSDictionary    *polling = OSDictionary::withCapacity(5);
+        OSArray         *devices = OSArray::withCapacity(fPoll.fNumDevices);
+        
+        if(polling && devices)
+        {
+            OSNumber *number;
+            
+            for(int i = 0; i < fPoll.fNumDevices; i++)
+            {
+                OSDictionary *device = OSDictionary::withCapacity(6);
+                
+                if(!device)
+                {
+                    continue;
+                }
+                number = OSNumber::withNumber(fPoll.fDevices[i].address, 32);
+                device->setObject("Address", number);
+                number->release();
+                number = OSNumber::withNumber(fPoll.fDevices[i].handlerID, 32);
+                device->setObject("HandlerID", number);
+                number->release();
+                number = OSNumber::withNumber(fPoll.fDevices[i].weight, 32);
+                device->setObject("Weight", number);
+                number->release();
+                number = OSNumber::withNumber(fPoll.fDevices[i].polls, 32);
+                device->setObject("Polls", number);
+                number->release();
+                number = OSNumber::withNumber(fPoll.fDevices[i].answers, 32);
+                device->setObject("Answers", number);
+                number->release();
+                number = OSNumber::withNumber(fPoll.share(i), 32);
+                device->setObject("Share", number);
+                number->release();
+                devices->setObject(device);
+                device->release();
+            }
+            
+            number = OSNumber::withNumber(fPoll.fInterval, 32);
+            polling->setObject("Interval", number);
+            number->release();
+            number = OSNumber::withNumber(fPoll.fPolls, 32);
+            polling->setObject("Polls", number);
+            number->release();
+            number = OSNumber::withNumber(fPoll.fMissed, 32);
+            polling->setObject("Missed", number);
+            number->release();
+            number = OSNumber::withNumber(fPoll.fSkipped, 32);
+            polling->setObject("Skipped", number);
+            number->release();
+            polling->setObject("Devices", devices);
+            ((com_milvich_driver_Thrustmaster*)this)->setProperty("ADBPolling", polling);
+        }
+        if(polling)
+            polling->release();
+        if(devices)
+            devices->release();
     }
-    else if(TMData[kFCSButtonsByte] & kFCSHatRightMask && TMData[kFCSButtonsByte] & kFCSHatDownMask)
+    
+    // which profile is in use, and what the others are called
+    if(fProfiles.fCount > 1)
     {
-        hat = 4;
+        OSArray *names = OSArray::withCapacity(fProfiles.fCount);
+        
+        if(names)
+        {
+            for(int i = 0; i < fProfiles.fCount; i++)
+            {
+                OSString *name = OSString::withCString(fProfiles.fNames[i]);
+                
+                if(name)
+                {
+                    names->setObject(name);
+                    name->release();
+                }
+            }
+            ((com_milvich_driver_Thrustmaster*)this)->setProperty("ProfileNames", names);
+            names->release();
+        }
+        ((com_milvich_driver_Thrustmaster*)this)->setProperty("ActiveProfile", fProfiles.fNames[fProfiles.fActive]);
+        ((com_milvich_driver_Thrustmaster*)this)->setProperty("ProfileSwitches", fProfiles.fSwitches, 32);
     }
-    else if(TMData[kFCSButtonsByte] & kFCSHatDownMask && TMData[kFCSButtonsByte] & kFCSHatleftMask)
+    
+    // how the macros are keeping time
+    if(fMacros.isEnabled())
     {
-        hat = 6;
+        OSDictionary *macros = OSDictionary::withCapacity(7);
+        
+        if(macros)
+        {
+            OSNumber *number;
+            
+            number = OSNumber::withNumber(fMacros.fCount, 32);
+            macros->setObject("Count", number);
+            number->release();
+            number = OSNumber::withNumber(fMacros.fStarted, 32);
+            macros->setObject("Started", number);
+            number->release();
+            number = OSNumber::withNumber(fMacros.fSteps, 32);
+            macros->setObject("Steps", number);
+            number->release();
+            number = OSNumber::withNumber(fMacros.fWakeups, 32);
+            macros->setObject("Wakeups", number);
+            number->release();
+            number = OSNumber::withNumber(fMacros.fLateness.percentile(50) / 1000, 32);
+            macros->setObject("LatenessP50", number);
+            number->release();
+            number = OSNumber::withNumber(fMacros.fLateness.percentile(99) / 1000, 32);
+            macros->setObject("LatenessP99", number);
+            number->release();
+            number = OSNumber::withNumber(fMacros.fLateness.fMax / 1000, 32);
+            macros->setObject("LatenessMax", number);
+            number->release();
+            ((com_milvich_driver_Thrustmaster*)this)->setProperty("MacroTiming", macros);
+            macros->release();
+        }
     }
-    else if(TMData[kFCSButtonsByte] & kFCSHatleftMask && TMData[kFCSButtonsByte] & kFCSHatUpMask)
+    
+    // what backing off the reads saves, and what it costs
+    if(fIdle.isEnabled())
     {
-        hat = 8;
+        OSDictionary    *idle = OSDictionary::withCapacity(9);
+        UInt64          now = TMNanoseconds();
+        
+        if(idle)
+        {
+            OSNumber *number;
+            
+            number = OSNumber::withNumber(fIdle.fTimeout, 32);
+            idle->setObject("Timeout", number);
+            number->release();
+            number = OSNumber::withNumber(fIdle.fInterval, 32);
+            idle->setObject("Interval", number);
+            number->release();
+            idle->setObject("BackedOff", fIdle.fBackedOff ? kOSBooleanTrue : kOSBooleanFalse);
+            number = OSNumber::withNumber(fIdle.fBackOffs, 32);
+            idle->setObject("BackOffs", number);
+            number->release();
+            number = OSNumber::withNumber(fIdle.rate(kIdleFullRate, now), 32);
+            idle->setObject("FullRateWakeups", number);
+            number->release();
+            number = OSNumber::withNumber(fIdle.rate(kIdleBackedOff, now), 32);
+            idle->setObject("BackedOffWakeups", number);
+            number->release();
+            number = OSNumber::withNumber(fIdle.fFirstInput.percentile(50) / 1000, 32);
+            idle->setObject("FirstInputP50", number);
+            number->release();
+            number = OSNumber::withNumber(fIdle.fFirstInput.percentile(99) / 1000, 32);
+            idle->setObject("FirstInputP99", number);
+            number->release();
+            number = OSNumber::withNumber(fIdle.fFirstInput.fMax / 1000, 32);
+            idle->setObject("FirstInputMax", number);
+            number->release();
+            ((com_milvich_driver_Thrustmaster*)this)->setProperty("IdlePolling", idle);
+            idle->release();
+        }
     }
-    else if(TMData[kFCSButtonsByte] & kFCSHatUpMask)
+    
+    // how many frames the jitter filter kept from going out
+    ((com_milvich_driver_Thrustmaster*)this)->setProperty("SuppressedReports", fCore.fSuppressedFrames, 32);
+    
+    // and hand out what we have captured so far
+    if(fCaptureBuffer)
     {
-        hat = 1;
+        OSData *capture = OSData::withBytes(fCaptureBuffer, fCapture.fLength);
+        
+        if(capture)
+        {
+            ((com_milvich_driver_Thrustmaster*)this)->setProperty("FrameCapture", capture);
+            capture->release();
+        }
     }
-    else if(TMData[kFCSButtonsByte] & kFCSHatRightMask)
+    
+    return super::serializeProperties(s);
+}
+
+// the settings that can be changed while we are running, see setProperties()
+static const char *gLiveSettings[] =
+{
+    "HasRudder", "HasThrottle", "RockerIsModifier", "Buttons", "ModifierEffectsHat",
+    "TwistRudder", "Axes", "HighResolutionAxes", "LayerButtons", "Profile", NULL
+};
+
+IOReturn com_milvich_driver_Thrustmaster::setProperties(OSObject *properties)
+{
+    OSDictionary    *changes = OSDynamicCast(OSDictionary, properties);
+    bool            live = false;
+    IOReturn        status;
+    
+    if(!changes)
     {
-        hat = 3;
+        return kIOReturnBadArgument;
     }
-    else if(TMData[kFCSButtonsByte] & kFCSHatDownMask)
+    if(IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
     {
-        hat = 5;
+        return kIOReturnNotPrivileged;
     }
-    else if(TMData[kFCSButtonsByte] & kFCSHatleftMask)
+    if(!fDispatchLoop)
     {
-        hat = 7;
+        return kIOReturnNotReady;
     }
-    else
+    
+    // the settings that rebuild the tables go first, they are for the first
+    // profile so they make it the active one again
+    for(int i = 0; gLiveSettings[i]; i++)
     {
-        hat = 0;	// should be null
+        live = live || changes->getObject(gLiveSettings[i]) != NULL;
     }
-
-    // move the data around based on the rockers position
-    if(fHatIsModified)
+    if(live)
     {
-        if(rockerPosition == 0)
+        status = changeSettings(changes);
+        if(status != kIOReturnSuccess)
         {
-            data[kFCSHatReportByte] = 0xf0 | hat;
-            data[kFCSHatReportByte + 1] = 0xff;
+            return status;
         }
-        if(rockerPosition == 1)
+    }
+    
+    // switching profiles is just a pointer between two packets
+    if(changes->getObject("ActiveProfile"))
+    {
+        int index = fProfiles.find(changes->getObject("ActiveProfile"));
+        
+        if(index < 0)
         {
-            data[kFCSHatReportByte] = (hat << 4) | 0x0f;
-            data[kFCSHatReportByte + 1] = 0xff;
+            return kIOReturnBadArgument;
         }
-        else if(rockerPosition == 2)
+        fDispatchLoop->runAction(selectProfileAction, this, (void*)(uintptr_t)index);
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn com_milvich_driver_Thrustmaster::changeSettings(OSDictionary *changes)
+{
+    OSDictionary    *settings;
+    OSData          *profileData;
+    TMProfile       profile;
+    TMCore          *core;
+    bool            separate = false;
+    IOReturn        status = kIOReturnSuccess;
+    
+    // a bad profile is an error here rather than quietly falling back
+    if(changes->getObject("Profile"))
+    {
+        profileData = OSDynamicCast(OSData, changes->getObject("Profile"));
+        if(!profileData || profile.read((const UInt8*)profileData->getBytesNoCopy(), profileData->getLength()) != kProfileOK)
         {
-            data[kFCSHatReportByte] = 0xff;
-            data[kFCSHatReportByte + 1] = hat;
+            return kIOReturnBadArgument;
         }
     }
-    else
+    
+    // only the settings we know how to change, on top of what we have now
+    settings = OSDictionary::withCapacity(8);
+    if(!settings)
     {
-        data[kFCSHatReportByte] = hat;
+        return kIOReturnNoMemory;
     }
-
-    if(!fRockerIsModifier)
+    for(int i = 0; gLiveSettings[i]; i++)
     {
-        // and the rocker swtich
-        if(TMData[kWCSButtonsByte] & kWCSRockerUPMask)
+        OSObject *value = changes->getObject(gLiveSettings[i]);
+        
+        if(value)
         {
-            hat = 1;
+            separate = separate || strcmp(gLiveSettings[i], "Profile") != 0;
         }
-        else if(TMData[kWCSButtonsByte] & kWCSRockerDownMask)
+        else
         {
-            hat = 5;
+            value = getProperty(gLiveSettings[i]);
         }
-        else
+        if(value)
         {
-            hat = 0;
+            settings->setObject(gLiveSettings[i], value);
         }
-        
-        data[kWCSHatReportByte] = data[kWCSHatReportByte] | hat << 4;
     }
+    
+    // the Profile wins over the separate settings, so changing one of those
+    // means dropping the profile that was loaded before
+    if(separate && !changes->getObject("Profile"))
+    {
+        settings->removeObject("Profile");
+    }
+    
+    // build the new tables off to the side, then see if the HID layer has
+    // to hear about it
+    core = new TMCore;
+    if(!core)
+    {
+        settings->release();
+        return kIOReturnNoMemory;
+    }
+    core->init();
+    core->loadProperties(settings);
+    
+    if(fCore.sameLayout(core))
+    {
+        // just different tables, swap them in between two packets
+        status = fDispatchLoop->runAction(adoptSettingsAction, this, core);
+        publishSettings(settings);
+    }
+    else
+    {
+        // the HID layer only reads the descriptor when we start, so a new
+        // layout can't be swapped in without taking the stick away from
+        // whoever is using it. That is left to a restart of the driver.
+        IOLog("%s: The new settings change the report layout, restart the driver to use them\n", NAME);
+        status = kIOReturnUnsupported;
+    }
+    
+    delete core;
+    settings->release();
+    return status;
+}
 
-    // then do the axis
-    // the x & y axis range from -128 to 127. I convert that to 0 - 255 because a few programs
-    // don't seem to like negative values... and they would think the range is 0-127...
-    // everyone seems happy with a range from 0-255, so thats what I report
-    data[kXAxisReportByte] = (TMData[kXAxisByte] + 128);	// x axis
-    data[kYAxisReportByte] = (TMData[kYAxisByte] + 128);	// y axis
-    data[kThrottleReportByte] = (255 - TMData[kThrottleByte]);	// throttle (slider)
-    data[kRuddersReportByte] = (TMData[kRuddersByte] + 128); 	// rudder (z)... I think
+void com_milvich_driver_Thrustmaster::handleAdoptSettings(TMCore *core)
+{
+    // the other profiles keep their own tables, and the new ones are only
+    // used while the first profile is, so switch back to it
+    fProfiles.select(0);
+    fCore.adoptSettings(core);
     
-/*
-    IOLog("%s: Input Data: %02x%02x %02x%02x %02x%02x %02x%02x\n", NAME, TMData[0], TMData[1], TMData[2], TMData[3], TMData[4], TMData[5], TMData[6], TMData[7]);
-    IOLog("%s: Output Data: %02x%02x %02x%02x %02x%02x %02x%02x\n", NAME, data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7]);
-*/
+    // show what the stick is doing now with the new settings
+    if(fCore.fFrames > 0)
+    {
+        packet(fSentData, sizeof(fSentData));
+    }
+}
 
-    // copy the data into the memory descriptor
-    report->writeBytes(0, data, kReportSize);
+IOReturn com_milvich_driver_Thrustmaster::adoptSettingsAction(OSObject *obj, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
+    
+    if(dump)
+    {
+        dump->handleAdoptSettings((TMCore*)arg0);
+    }
     return kIOReturnSuccess;
 }
 
-void com_milvich_driver_Thrustmaster::packet(UInt8 *data, IOByteCount length)
+void com_milvich_driver_Thrustmaster::handleSelectProfile(int index)
 {
-    getReport(fReport, data, length);
-    handleReport(fReport);
+    fProfiles.select(index);
+    
+    // show what the stick is doing now with the other mapping
+    if(fCore.fFrames > 0)
+    {
+        packet(fSentData, sizeof(fSentData));
+    }
 }
 
-IOReturn com_milvich_driver_Thrustmaster::newReportDescriptor(IOMemoryDescriptor **descriptor) const
+IOReturn com_milvich_driver_Thrustmaster::selectProfileAction(OSObject *obj, void *arg0, void *arg1, void *arg2, void *arg3)
 {
-    UInt8	data[255];
-    int		x = 0;
-    void	*realData;
-
-    IOLog("TM - Creating evil report descriptor\n");
-
-    /*
-     we need to build this very evil data structure that lets the hid device
-     know what we look like (ie what buttons and what axis we have).
-
-     Each entry in the data has an one byte op code which looks like this
-     ----------------------------------------
-     | Tag              |  Type  |   Size   |
-     ----------------------------------------
-      7    6    5    4    3    2    1    0
-
-     The size is either 0, 1, 2 or 4 bytes.
-     The type is either main, global, or local
-     The tag specfies what in main global or local we are setting or executing.
-
-     The main items are the ones that cause things to be executed, I am only
-     going to use the inupt command, which takes data that has been set in local
-     or global settings to create a field in the report. After the input
-     command the local data is cleared, but the global data remains and will
-     be used for the next input command unless it is changed.
-
-     Local contains settings specific to a control, such as what it is. =)
-
-     Global contains more general data, such as min and max values. This way
-     if you create 10 different contols that have the same min and max values
-     and you only have to set it once.
-
-     following the op code is a data value, or paramater for the operation
-
-     In the end this is what the report will look like
-    ----------------------------------------------------
-     0 | 1b2 | 0b2 | 2b1 | 1b1 | 0b1 | 2b0 | 1b0 | 0b0 |
-     ----------------------------------------------------
-     1 | 0b5 | 2b4 | 1b4 | 0b4 | 2b3 | 1b3 | 0b3 | 2b2 |
-     ----------------------------------------------------
-     2 | 2b7 | 1b7 | 0b7 | 2b6 | 1b6 | 0b6 | 2b5 | 1b5 |
-     ----------------------------------------------------
-     3 |  u  |  u  | 2b9 | 1b9 | 0b9 | 2b8 | 1b8 | 0b8 |
-     ----------------------------------------------------
-     4 |   FCS Hat Switch 1    |   FCS Hat Switch 0    |
-     ----------------------------------------------------
-     5 |     WCS Hat Switch    |   FCS Hat Switch 2    |
-     ----------------------------------------------------
-     6 |                      X Axis                   |
-     ----------------------------------------------------
-     7 |                      Y Axis                   |
-     ----------------------------------------------------
-     8 |                 Z (Rudder) Axis               |
-     ----------------------------------------------------
-     9 |             Slider (Throttle) Axis            |
-     ----------------------------------------------------
-     
-     */
-    
-    
-    // first we need to tell the hid thing what sort of device we are
-    // in our case we are a joystick from the generic desktop catagory
-
-    // set the catagory to the generic desktop
-    // usage page (generic desktop)
-    data[x++] = kHIDTagUsagePage | kHIDTypeGlobal | kOneByte;
-    data[x++] = kHIDPage_GenericDesktop;
-    // usaage (joystick)
-    data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
-    data[x++] = kHIDUsage_GD_Joystick;
-
-    // a collection is a grouping of inputs.
-
-    // so start the joystick collection
-    // collection (application)
-    data[x++] = kHIDTagCollection | kHIDTypeMain | kOneByte;
-    data[x++] = 0x01;	// application
-    
-    // setup buttons
-    
-    // switch to the button page
-    data[x++] = kHIDTagUsagePage | kHIDTypeGlobal | kOneByte;
-    data[x++] = kHIDPage_Button;
-    // since it is a button our minimum value is 0
-    data[x++] = kHIDTagLogicalMinimum | kHIDTypeGlobal | kOneByte;
-    data[x++] = 0;
-    data[x++] = kHIDTagPhysicalMinimum | kHIDTypeGlobal | kOneByte;
-    data[x++] = 0;
-    // button has a max value of 1
-    data[x++] = kHIDTagLogicalMaximum | kHIDTypeGlobal | kOneByte;
-    data[x++] = 1;
-    data[x++] = kHIDTagPhysicalMaximum | kHIDTypeGlobal | kOneByte;
-    data[x++] = 1;
-    // we need one bit for each button
-    data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
-    data[x++] = 1;
-    // now tell it the minimum button 1 in our case
-    data[x++] = kHIDTagUsageMinimum | kHIDTypeLocal | kOneByte;
-    data[x++] = 1;
-    // then tell it the maximum button number... which is what we counted when we started
-    data[x++] = kHIDTagUsageMaximum | kHIDTypeLocal | kOneByte;
-    data[x++] = fNumButtons;
-    // we need how ever many fields for the buttons we have
-    data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
-    data[x++] = fNumButtons;
-    // now we need to create the input field...
-    data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
-    data[x++] = 2;	// flag the data as being variable
-    
-    if(fNumButtons < 32)
-    {
-        // skip over however many buttons where left over, plus the extra
-        // 2 buttons to round it to the nearest byte
-        data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
-        data[x++] = 32 - fNumButtons;
-        // and one count
-        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
-        data[x++] = 1;
-        // create an empty input thing
-        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
-        data[x++] = 1;	// is constant
-    }
-
-    // setup the hat switch
-    for(int i = 0; i < ((fHatIsModified) ? kNumModifiers : 1); i++)
-    {
-        // switch the generic desktop
-        data[x++] = kHIDTagUsagePage | kHIDTypeGlobal | kOneByte;
-        data[x++] = kHIDPage_GenericDesktop;
-        // say that we are a hat switch
-        data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
-        data[x++] = kHIDUsage_GD_Hatswitch;
-        // both logical starts at 1, and physical starts at 0
-        data[x++] = kHIDTagLogicalMinimum | kHIDTypeGlobal | kOneByte;
-        data[x++] = 1;
-        data[x++] = kHIDTagPhysicalMinimum | kHIDTypeGlobal | kOneByte;
-        data[x++] = 0;
-        // we report only 8 different values, but in reality, we move 315 degrees
-        data[x++] = kHIDTagLogicalMaximum | kHIDTypeGlobal | kOneByte;
-        data[x++] = 8;
-        data[x++] = kHIDTagPhysicalMaximum | kHIDTypeGlobal | kTwoBytes;
-        data[x++] = 0x3B;
-        data[x++] = 0x01;
-        // set the report size 4...
-        data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
-        data[x++] = 4;
-        // set the report count to 1
-        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
-        data[x++] = 1;
-        // create the hat switch
-        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
-        data[x++] = 66;	// variable, and has a null state
-    }
-
-    if(!fHatIsModified)
-    {
-        // skip over the extra two entires for the hat switch
-        
-        // set to 8 bits
-        data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
-        data[x++] = 8;
-        // and one count
-        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
-        data[x++] = 1;
-        // create an empty input thing
-        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
-        data[x++] = 1;	// is constant
-    }
-
-
-    if(!fRockerIsModifier && fHasThrottle)
-    {
-        // we also treat the rocker as a hat switch, if it isn't acting as a modifier
-        // switch the generic desktop
-        data[x++] = kHIDTagUsagePage | kHIDTypeGlobal | kOneByte;
-        data[x++] = kHIDPage_GenericDesktop;
-        // say that we are a hat switch
-        data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
-        data[x++] = kHIDUsage_GD_Hatswitch;
-        // both logical starts at 1, and physical starts at 0
-        data[x++] = kHIDTagLogicalMinimum | kHIDTypeGlobal | kOneByte;
-        data[x++] = 1;
-        data[x++] = kHIDTagPhysicalMinimum | kHIDTypeGlobal | kOneByte;
-        data[x++] = 0;
-        // we report only 8 different values, but in reality, we do 2
-        data[x++] = kHIDTagLogicalMaximum | kHIDTypeGlobal | kOneByte;
-        data[x++] = 8;
-        data[x++] = kHIDTagPhysicalMaximum | kHIDTypeGlobal | kTwoBytes;
-        data[x++] = 0x3B;
-        data[x++] = 0x01;
-        // set the report size 8...
-        data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
-        data[x++] = 4;
-        // set the report count to 1
-        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
-        data[x++] = 1;
-        // create the hat switch
-        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
-        data[x++] = 66;	// variable, and has a null state
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
+    
+    if(dump)
+    {
+        dump->handleSelectProfile((int)(uintptr_t)arg0);
     }
-    else
+    return kIOReturnSuccess;
+}
+
+void com_milvich_driver_Thrustmaster::publishSettings(OSDictionary *settings)
+{
+    for(int i = 0; gLiveSettings[i]; i++)
     {
-        // rocker was used as modifer or we have no throttle... don't let it show up
+        OSObject *value = settings->getObject(gLiveSettings[i]);
         
-        // set 4 bits
-        data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
-        data[x++] = 4;
-        // and one count
-        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
-        data[x++] = 1;
-        // create an empty input thing
-        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
-        data[x++] = 1;	// is constant
-    }
-    
-    // do axis
-    // set report size to 8
-    data[x++] = kHIDTagReportSize | kHIDTypeGlobal | kOneByte;
-    data[x++] = 8;
-    // set min to 0
-    data[x++] = kHIDTagLogicalMinimum | kHIDTypeGlobal | kOneByte;
-    data[x++] = 0;
-    data[x++] = kHIDTagPhysicalMinimum | kHIDTypeGlobal | kOneByte;
-    data[x++] = 0;
-    // button has a max value of 255
-    data[x++] = kHIDTagLogicalMaximum | kHIDTypeGlobal | kTwoBytes;
-    data[x++] = 255;
-    data[x++] = 0;
-    data[x++] = kHIDTagPhysicalMaximum | kHIDTypeGlobal | kTwoBytes;
-    data[x++] = 255;
-    data[x++] = 0;
-
-    // say that we are coming from the generic desktop catagory
-    data[x++] = kHIDTagUsagePage | kHIDTypeGlobal | kOneByte;
-    data[x++] = kHIDPage_GenericDesktop;
-    // say that we are using x, and y
-    data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
-    data[x++] = kHIDUsage_GD_X;
-    data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
-    data[x++] = kHIDUsage_GD_Y;
-    // we need two spots
-    data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
-    data[x++] = 2;
-    // create the input
-    data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
-    data[x++] = 2;	// flag as being variable
-
-    if(fHasRudders)
-    {
-        // we need the z axis
-        data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
-        
-        if(fTwistRudder)
-        {
-            data[x++] = kHIDUsage_GD_Rz;
-        }
-        else
+        if(value)
         {
-            data[x++] = kHIDUsage_GD_Z;
+            setProperty(gLiveSettings[i], value);
         }
-        // we need one spots
-        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
-        data[x++] = 1;
-        // create the input
-        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
-        data[x++] = 2;	// flag as being variable
     }
-    else
+    
+    // replaced by the separate settings, see setProperties()
+    if(!settings->getObject("Profile"))
     {
-        // even though we didn't have one, I still want to leave space to make it easier
-        // when actually creating the report
-        // and one count
-        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
-        data[x++] = 1;
-        // create an empty input thing
-        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
-        data[x++] = 1;	// is constant
+        removeProperty("Profile");
     }
+}
 
-    if(fHasThrottle)
+bool com_milvich_driver_Thrustmaster::createReportBuffers()
+{
+    // create the buffers for the reports, the settings decide how big they
+    // are, and have the core build the reports right in them
+    for(int i = 0; i < kReportBuffers; i++)
     {
-        // we need the slider
-        data[x++] = kHIDTagUsage | kHIDTypeLocal | kOneByte;
-        data[x++] = kHIDUsage_GD_Slider;
-        // we need two spots
-        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
-        data[x++] = 1;
-        // create the input
-        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
-        data[x++] = 2;	// flag as being variable
+        fReports[i] = IOBufferMemoryDescriptor::withCapacity(fCore.fReportSize, kIODirectionOutIn, true);
+        if(!fReports[i])
+        {
+            IOLog("%s: Failed to create the MemoryDescriptor for our report\n", NAME);
+            return false;
+        }
     }
-    else
+    fCore.setReportBuffers((UInt8*)fReports[0]->getBytesNoCopy(), (UInt8*)fReports[1]->getBytesNoCopy());
+    
+    // and wrap up the report descriptor that goes with them
+    fReportDescriptor = IOBufferMemoryDescriptor::withBytes(fCore.fReportDescriptor, fCore.fReportDescriptorLength, kIODirectionOutIn);
+    if(!fReportDescriptor)
     {
-        // even though we didn't have one, I still want to leave space to make it easier
-        // when actually creating the report
-        // and one count
-        data[x++] = kHIDTagReportCount | kHIDTypeGlobal | kOneByte;
-        data[x++] = 1;
-        // create an empty input thing
-        data[x++] = kHIDTagInput | kHIDTypeMain | kOneByte;
-        data[x++] = 1;	// is constant
+        IOLog("%s: Failed to create the MemoryDescriptor for our report descriptor\n", NAME);
+        return false;
     }
+    
+    return true;
+}
 
-    // and end the joystick collection
-    data[x++] = kHIDTagEndCollection | kHIDTypeMain | kZeroBytes;
-
-    // now lets create the memory for this descriptor
-    *descriptor = IOBufferMemoryDescriptor::withCapacity(x, kIODirectionOutIn, true);
-
-    // make sure we did get memory
-    if(*descriptor == NULL)
+void com_milvich_driver_Thrustmaster::releaseReportBuffers()
+{
+    // the core goes back to its own until there are new ones
+    fCore.setReportBuffers(NULL, NULL);
+    for(int i = 0; i < kReportBuffers; i++)
     {
-        return kIOReturnNoMemory;
+        if(fReports[i])
+        {
+            fReports[i]->release();
+            fReports[i] = NULL;
+        }
     }
-
-    // now lets grab the data in that memory buffer
-    realData = ((IOBufferMemoryDescriptor*)(*descriptor))->getBytesNoCopy();
-
-    // and copy our thing into it's buffer
-    bcopy(data, realData, x);
-    
-    IOLog("TM - Done creating evil report descriptor\n");
-    
-    return kIOReturnSuccess;
 }
 
 //==============================================================================
@@ -581,128 +606,106 @@ bool com_milvich_driver_Thrustmaster::init(OSDictionary *properties)
     
     fIface = NULL;
     fPipe = NULL;
-    fBuffer = NULL;
-    fOutstandingIOOps = 0;
-    fNeedToClose = false;
-    fFinishedInit = false;
-    
-    for(unsigned int i = 0; i < sizeof(fControlData); i++)
-    {
-        fControlData[i] = 0;
-    }
+    fPairTimer = NULL;
+    fPredictTimer = NULL;
+    fGovernorTimer = NULL;
+    fMacroTimer = NULL;
+    fIdleTimer = NULL;
+    fPollTimer = NULL;
+    fCountersTimer = NULL;
+    fBus = NULL;
+    for(int i = 0; i < kMaxADBDevices; i++)
+    {
+        fDevices[i] = NULL;
+    }
+    fDispatchLoop = NULL;
+    fDispatchSource = NULL;
     
-    OSBoolean		*result;
-    int                 count;
+    fCore.init();
+    fProfiles.init(&fCore);
+    fFrameRing.init();
+    fFrameTimestamp = 0;
+    fCounters.init(TMNanoseconds());
     
-    // create the buffer for the reports
-    fReport = IOBufferMemoryDescriptor::withCapacity(kReportSize, kIODirectionOutIn, true);
-    if(!fReport)
-    {
-        IOLog("%s: Failed to create the MemoryDescriptor for our report\n", NAME);
-        return false;
-    }
+    // pick up the settings from our personality, and any other profiles to
+    // switch to
+    fCore.loadProperties(properties);
+    fProfiles.loadProperties(properties);
     
-    // I need to know this info to create the device descriptor, but I can't
-    // dynamicly look this up until I finish initing the iMate, but that blocks...
-    // So we be stupid and just read from a config file.
-    fHasRudders = false;
-    fHasThrottle = true;
-    result = OSDynamicCast(OSBoolean, getProperty("HasRudder"));
-    if(result)
+    for(int i = 0; i < kReportBuffers; i++)
     {
-        fHasRudders = result->getValue();
+        fReports[i] = NULL;
     }
-    result = OSDynamicCast(OSBoolean, getProperty("HasThrottle"));
-    if(result)
+    fReportDescriptor = NULL;
+    if(!createReportBuffers())
     {
-        fHasThrottle = result->getValue();
+        return false;
     }
     
-    // check to see if the rocker switch should act as a modifier
-    if(fHasThrottle)
-    {
-        result = OSDynamicCast(OSBoolean, getProperty("RockerIsModifier"));
-        if(!result)
-        {
-            IOLog("%s: Failed to find an entry for RockerIsModifier, assuming false.\n", NAME);
-            fRockerIsModifier = false;
-        }
-        else
-        {
-            fRockerIsModifier = result->getValue();
-        }
-    }
-    else
+    // how long to wait for the other half of a frame before reporting what
+    // we have, in ms. 0 means always wait for both halves.
+    fPairTimeout = 0;
+    OSNumber *timeout = OSDynamicCast(OSNumber, getProperty("HalfFramePairingTimeout"));
+    if(timeout)
     {
-        fRockerIsModifier = false;
+        fPairTimeout = timeout->unsigned32BitValue();
     }
     
-    // setup buttons
-    if(fHasThrottle)
-    {
-        count = kNumOfButtons;
-    }
-    else
-    {
-        count = kNumOfFCSButtons;
-    }
-    OSArray *buttonArray = OSDynamicCast(OSArray, getProperty("Buttons"));
-    if(fRockerIsModifier && buttonArray)
-    {
-        for(int i = 0; i < count; i++)
+    // how many interrupt reads to keep queued, so the pipe stays armed while
+    // we are busy with the last one
+    int numReads = kDefaultReadsInFlight;
+    OSNumber *reads = OSDynamicCast(OSNumber, getProperty("ReadsInFlight"));
+    if(reads)
+    {
+        numReads = reads->unsigned32BitValue();
+    }
+    fTransport.fIface = NULL;
+    fTransport.fPipe = NULL;
+    fTransport.fClient = this;
+    fLink.init(&fTransport, this, frameReceived, numReads);
+    fLink.loadInitSequence(properties);
+    
+    // guessing at the axes between frames is off unless asked for
+    fPredictor.loadProperties(properties);
+    bzero(fSentData, sizeof(fSentData));
+    
+    // and so is holding down the report rate
+    fGovernor.loadProperties(properties);
+    
+    // and the macros
+    fMacros.loadProperties(properties);
+    bzero(fMacroBase, sizeof(fMacroBase));
+    
+    // just the stick unless ADBDevices lists more, or ADBProbe finds them
+    fPoll.loadProperties(properties);
+    
+    // and reading flat out even when nobody is touching it
+    fIdle.loadProperties(properties);
+    
+    // timing each stage is off unless asked for
+    OSBoolean *tracking = OSDynamicCast(OSBoolean, getProperty("LatencyTracking"));
+    fLatency.init(tracking && tracking->getValue());
+    
+    // record the raw halves for replaying later, CaptureSize is in bytes and
+    // the capture stops once it is full
+    fCaptureBuffer = NULL;
+    fCaptureSize = 0;
+    OSNumber *captureSize = OSDynamicCast(OSNumber, getProperty("CaptureSize"));
+    if(captureSize && captureSize->unsigned32BitValue() > kCaptureHeaderSize)
+    {
+        fCaptureSize = captureSize->unsigned32BitValue();
+        fCaptureBuffer = (UInt8*)IOMalloc(fCaptureSize);
+        if(!fCaptureBuffer)
         {
-            result = OSDynamicCast(OSBoolean, buttonArray->getObject(i));
-            if(result && result->getValue())
-            {
-                for(int j = 0; j < kNumModifiers; j++)
-                {
-                    fButtonShifts[i * kNumModifiers + j] = fNumButtons;
-                    fNumButtons++;
-                }
-            }
-            else
-            {
-                for(int j = 0; j < kNumModifiers; j++)
-                {
-                    fButtonShifts[i * kNumModifiers + j] = fNumButtons;
-                }
-                fNumButtons++;
-            }
+            IOLog("%s: Failed to allocate %u bytes for the frame capture\n", NAME, (unsigned)fCaptureSize);
+            fCaptureSize = 0;
         }
-    }
-    else
-    {
-        // the buttons and hatswitchs are not shifted, so set all 3 shift values
-        // to the same thing
-        fNumButtons = 0;
-        for(int i = 0; i < count; i++)
+        else
         {
-            for(int j = 0; j < kNumModifiers; j++)
-            {
-                fButtonShifts[i * kNumModifiers + j] = fNumButtons;
-            }
-            fNumButtons++;
+            fCapture.init(fCaptureBuffer, fCaptureSize, &fCore);
         }
-        // same thing with the hat switch
-    }
-    
-    result = OSDynamicCast(OSBoolean, getProperty("ModifierEffectsHat"));
-    fHatIsModified = result && result->getValue();
-    if(fHatIsModified && fRockerIsModifier)
-    {
-        fHatSwitchShifts[0] = 0;
-        fHatSwitchShifts[1] = 1;
-        fHatSwitchShifts[2] = 2;
-    }
-    else
-    {
-        fHatSwitchShifts[0] = fHatSwitchShifts[1] = fHatSwitchShifts[2] = 0;
-        fHatIsModified = false;
     }
     
-    result = OSDynamicCast(OSBoolean, getProperty("TwistRudder"));
-    fTwistRudder = result && result->getValue();
-    
     return true;
 }
 
@@ -729,6 +732,20 @@ bool com_milvich_driver_Thrustmaster::handleStart( IOService * provider )
         return false;
     }
     
+    // another device on the same iMate, the instance that owns it sends us
+    // our halves on its dispatch loop
+    fBus = OSDynamicCast(com_milvich_driver_Thrustmaster, provider);
+    if(fBus)
+    {
+        fDispatchLoop = fBus->fDispatchLoop;
+        fDispatchLoop->retain();
+        return startTimers();
+    }
+    
+    // the stick's halves, the rest go to their own instances, see
+    // dispatchFrames()
+    fDevices[0] = this;
+    
     // get the interface
     fIface = OSDynamicCast(IOUSBInterface, provider);
     if(!fIface)
@@ -767,6 +784,8 @@ bool com_milvich_driver_Thrustmaster::handleStart( IOService * provider )
     // lets retain things
     fIface->retain();
     fPipe->retain();
+    fTransport.fIface = fIface;
+    fTransport.fPipe = fPipe;
     
     // we want to setup a command gate to sync some actions
     fGate = IOCommandGate::commandGate(this);
@@ -777,8 +796,49 @@ bool com_milvich_driver_Thrustmaster::handleStart( IOService * provider )
         return false;
     }
     
+    // frames are translated and reported on a work loop of our own, so a
+    // slow HID client can't hold up the USB completion
+    fDispatchLoop = IOWorkLoop::workLoop();
+    fDispatchSource = IOInterruptEventSource::interruptEventSource(this, dispatchAction);
+    if(!fDispatchLoop || !fDispatchSource || fDispatchLoop->addEventSource(fDispatchSource) != kIOReturnSuccess)
+    {
+        IOLog("%s: Failed to set up the dispatch work loop\n", NAME);
+        fIface->close(this);
+        return false;
+    }
+    
+    if(!startTimers())
+    {
+        fIface->close(this);
+        return false;
+    }
+    
+    // and one to poll the ADB devices, if there turn out to be more than one
+    if(fPoll.fProbe || fPoll.isEnabled())
+    {
+        fPollTimer = IOTimerEventSource::timerEventSource(this, pollTimerFired);
+        if(!fPollTimer || fDispatchLoop->addEventSource(fPollTimer) != kIOReturnSuccess)
+        {
+            IOLog("%s: Failed to add the poll timer to the work loop\n", NAME);
+            fIface->close(this);
+            return false;
+        }
+    }
+    
+    // and one to back off the reads while the stick is left alone
+    if(fIdle.isEnabled())
+    {
+        fIdleTimer = IOTimerEventSource::timerEventSource(this, idleTimerFired);
+        if(!fIdleTimer || fDispatchLoop->addEventSource(fIdleTimer) != kIOReturnSuccess)
+        {
+            IOLog("%s: Failed to add the idle timer to the work loop\n", NAME);
+            fIface->close(this);
+            return false;
+        }
+    }
+    
     // kick off the read chain
-    if(startReadLoop() != kIOReturnSuccess)
+    if(fLink.startReadLoop() != kIOReturnSuccess)
     {
         fIface->close(this);
         return false;
@@ -790,28 +850,79 @@ bool com_milvich_driver_Thrustmaster::handleStart( IOService * provider )
     return true;
 }
 
-void com_milvich_driver_Thrustmaster::handleInit()
+bool com_milvich_driver_Thrustmaster::startTimers()
 {
-    IOReturn status;
-    
-    // loop through each init command and issue them. Stop if the need to close
-    // flag is set. (Due to threads, it might not be updated in time... hopefully
-    // DeviceRequest is smart enough to detect a problem and stop us.)
-    for(int i = 0; i < kNumInitCmds  && !fNeedToClose; i++)
+    // a timer to give up on the other half of a frame
+    if(fPairTimeout)
     {
-        IOSleep(50);
-        status = fIface->DeviceRequest(&gInitSequence[i], NULL);
-        if(status != kIOReturnSuccess)
+        fPairTimer = IOTimerEventSource::timerEventSource(this, pairTimerFired);
+        if(!fPairTimer || fDispatchLoop->addEventSource(fPairTimer) != kIOReturnSuccess)
         {
-            IOLog("%s: Init sequence failed on command %d. Value = %d, Error = %08x\n", NAME, i, gInitSequence[i].wValue, status);
-            break;
+            IOLog("%s: Failed to add the pairing timer to the work loop\n", NAME);
+            return false;
+        }
+    }
+    
+    // and one to send the extrapolated reports
+    if(fPredictor.isEnabled())
+    {
+        fPredictTimer = IOTimerEventSource::timerEventSource(this, predictTimerFired);
+        if(!fPredictTimer || fDispatchLoop->addEventSource(fPredictTimer) != kIOReturnSuccess)
+        {
+            IOLog("%s: Failed to add the prediction timer to the work loop\n", NAME);
+            return false;
+        }
+    }
+    
+    // and one to send the reports the governor held back
+    if(fGovernor.isEnabled())
+    {
+        fGovernorTimer = IOTimerEventSource::timerEventSource(this, governorTimerFired);
+        if(!fGovernorTimer || fDispatchLoop->addEventSource(fGovernorTimer) != kIOReturnSuccess)
+        {
+            IOLog("%s: Failed to add the report rate timer to the work loop\n", NAME);
+            return false;
         }
     }
     
+    // and one for every macro step, however many are running
+    if(fMacros.isEnabled())
+    {
+        fMacroTimer = IOTimerEventSource::timerEventSource(this, macroTimerFired);
+        if(!fMacroTimer || fDispatchLoop->addEventSource(fMacroTimer) != kIOReturnSuccess)
+        {
+            IOLog("%s: Failed to add the macro timer to the work loop\n", NAME);
+            return false;
+        }
+    }
+    
+    // and one to add up the counters, they are always on
+    fCountersTimer = IOTimerEventSource::timerEventSource(this, countersTimerFired);
+    if(!fCountersTimer || fDispatchLoop->addEventSource(fCountersTimer) != kIOReturnSuccess)
+    {
+        IOLog("%s: Failed to add the counters timer to the work loop\n", NAME);
+        return false;
+    }
+    fCountersTimer->setTimeoutMS(kCountersInterval);
+    
+    return true;
+}
+
+void com_milvich_driver_Thrustmaster::handleInit()
+{
+    UInt8   found[kMaxADBDevices];
+    int     numFound = 0;
+    
+    // look for anything else on the ADB bus once the iMate is going
+    if(fLink.runInitSequence() == kIOReturnSuccess && fPoll.fProbe)
+    {
+        numFound = fLink.probeDevices(&fPoll, found, kMaxADBDevices - fPoll.fNumDevices);
+    }
+    
     //IOLog("%s: Finished init\n", NAME);
     
     // this is so we can hopefully safely close the provider if there was an error...
-    fGate->runAction(initFinished);
+    fGate->runAction(initFinished, found, (void*)(uintptr_t)numFound);
 }
 
 void com_milvich_driver_Thrustmaster::initThread(void *arg)
@@ -824,17 +935,163 @@ void com_milvich_driver_Thrustmaster::initThread(void *arg)
     }
 }
 
-void com_milvich_driver_Thrustmaster::handleInitFinshed()
+void com_milvich_driver_Thrustmaster::handleInitFinshed(const UInt8 *found, int numFound)
 {
-    // see if we need to close. This can happen if the user disconnected the iMate
-    // before we finished the init sequence.
-    if(fNeedToClose)
+    fLink.finishInit();
+    
+    // the probe ran while the reads were going, what it found joins the
+    // polling on the dispatch loop, between two frames
+    if(numFound > 0 && !fLink.fNeedToClose)
     {
-        fIface->close(this);
+        fDispatchLoop->runAction(addDevicesAction, this, (void*)found, (void*)(uintptr_t)numFound);
     }
-    else
+    
+    // give every other device an instance of its own and start polling
+    if(fPoll.isEnabled() && fPollTimer && !fLink.fNeedToClose)
+    {
+        startDevices();
+        fPollTimer->setTimeoutUS(fPoll.fInterval);
+    }
+    
+    // the answers for the other devices come in on the same reads, so this
+    // is just for the stick on its own
+    if(!fPoll.isEnabled() && fIdleTimer && !fLink.fNeedToClose)
+    {
+        fIdleTimer->setTimeoutMS(fIdle.fTimeout);
+    }
+}
+
+void com_milvich_driver_Thrustmaster::startDevices()
+{
+    OSArray *entries = OSDynamicCast(OSArray, getProperty("ADBDevices"));
+    
+    for(int i = 1; i < fPoll.fNumDevices; i++)
+    {
+        com_milvich_driver_Thrustmaster *device;
+        OSDictionary                    *properties = dictionaryWithProperties();
+        
+        if(!properties)
+        {
+            break;
+        }
+        
+        // the same settings as us, plus whatever its ADBDevices entry has,
+        // so pedals can say HasRudder and so on
+        properties->removeObject("ADBDevices");
+        properties->removeObject("ADBProbe");
+        for(unsigned int j = 0; entries && j < entries->getCount(); j++)
+        {
+            OSDictionary    *entry = OSDynamicCast(OSDictionary, entries->getObject(j));
+            OSNumber        *address = entry ? OSDynamicCast(OSNumber, entry->getObject("Address")) : NULL;
+            
+            if(address && address->unsigned32BitValue() == fPoll.fDevices[i].address)
+            {
+                properties->merge(entry);
+            }
+        }
+        
+        device = new com_milvich_driver_Thrustmaster;
+        if(device && device->init(properties) && device->attach(this))
+        {
+            if(device->start(this))
+            {
+                fDevices[i] = device;
+                device = NULL;
+            }
+            else
+            {
+                device->detach(this);
+            }
+        }
+        if(device)
+        {
+            IOLog("%s: Couldn't start the device at ADB address %d\n", NAME, fPoll.fDevices[i].address);
+            device->release();
+        }
+        properties->release();
+    }
+}
+
+void com_milvich_driver_Thrustmaster::handleAddDevices(const UInt8 *found, int numFound)
+{
+    for(int i = 0; i < numFound; i++)
     {
-        fFinishedInit = true;
+        fPoll.addDevice(found[i], kTMHandlerID, 1);
+    }
+}
+
+IOReturn com_milvich_driver_Thrustmaster::addDevicesAction(OSObject *obj, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
+    
+    if(dump)
+    {
+        dump->handleAddDevices((const UInt8*)arg0, (int)(uintptr_t)arg1);
+    }
+    return kIOReturnSuccess;
+}
+
+void com_milvich_driver_Thrustmaster::removeDevice(com_milvich_driver_Thrustmaster *device)
+{
+    // on the dispatch loop, so nothing is being handed to it right now
+    for(int i = 1; i < kMaxADBDevices; i++)
+    {
+        if(fDevices[i] == device)
+        {
+            fDevices[i] = NULL;
+            device->release();
+        }
+    }
+}
+
+IOReturn com_milvich_driver_Thrustmaster::removeDeviceAction(OSObject *obj, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
+    
+    if(dump)
+    {
+        dump->removeDevice((com_milvich_driver_Thrustmaster*)arg0);
+    }
+    return kIOReturnSuccess;
+}
+
+void com_milvich_driver_Thrustmaster::handlePoll()
+{
+    int device;
+    
+    if(fLink.fNeedToClose)
+    {
+        return;
+    }
+    
+    // the last poll is still on its way, this one waits for the next tick
+    if(fLink.fCommandBusy)
+    {
+        fPoll.fSkipped++;
+        fPollTimer->setTimeoutUS(fPoll.fInterval);
+        return;
+    }
+    
+    // whatever came back for the last poll has to be handed out before
+    // next() counts it as missed
+    dispatchFrames();
+    
+    // sent without waiting, the dispatch loop can't sit on the bus
+    device = fPoll.next();
+    if(fLink.postADBCommand(ADBCommand(fPoll.fDevices[device].address, kADBTalk, 0)) != kIOReturnSuccess)
+    {
+        IOLog("%s: Couldn't poll ADB address %d\n", NAME, fPoll.fDevices[device].address);
+    }
+    fPollTimer->setTimeoutUS(fPoll.fInterval);
+}
+
+void com_milvich_driver_Thrustmaster::pollTimerFired(OSObject *obj, IOTimerEventSource *sender)
+{
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
+    
+    if(dump)
+    {
+        dump->handlePoll();
     }
 }
 
@@ -844,127 +1101,342 @@ IOReturn com_milvich_driver_Thrustmaster::initFinished(OSObject *obj, void *arg0
     
     if(obj)
     {
-        dump->handleInitFinshed();
+        dump->handleInitFinshed((const UInt8*)arg0, (int)(uintptr_t)arg1);
     }
     return kIOReturnSuccess;
 }
 
 
-IOReturn com_milvich_driver_Thrustmaster::startReadLoop()
+void com_milvich_driver_Thrustmaster::frameReceived(void *target, const UInt8 *data, UInt32 length, UInt64 timestamp)
 {
-    IOReturn err;
+    com_milvich_driver_Thrustmaster *dump = (com_milvich_driver_Thrustmaster*)target;
     
-    // setup the completion
-    fReadCompletion.target = this;
-    fReadCompletion.action = readCallback;
-    fReadCompletion.parameter = NULL;
+    // called from the read completion, hand the raw frame to the dispatch loop
+    dump->fFrameRing.push(data, length, timestamp);
+    dump->fDispatchSource->interruptOccurred(NULL, NULL, 0);
+}
+
+void com_milvich_driver_Thrustmaster::handleHalfFrame(UInt8 *data, IOByteCount length)
+{
+    bool    wasPairing = fCore.isPairing();
+    UInt32  frames = fCore.fFrames;
+    UInt64  time = fLatency.start();
+    bool    changed;
+    
+    changed = fCore.handleHalfFrame(data, length);
+    fLatency.mark(kLatencyAssembly, time);
     
-    // we need a buffer
-    if(!fBuffer)
+    if(fCore.fFrames != frames)
     {
-        fBuffer = IOBufferMemoryDescriptor::withCapacity(8, kIODirectionIn);
-        if(!fBuffer)
-        {
-            IOLog("%s: Failed to create the buffer\n", NAME);
-            return kIOReturnNoMemory;
-        }
+        frameCompleted(changed, fFrameTimestamp);
     }
     
-    // now lets kick off the chain of reads
-    incrementOutstandingIO();
-    err = fPipe->Read(fBuffer, &fReadCompletion);
-    if(err != kIOReturnSuccess)
+    if(fPairTimer)
     {
-        IOLog("%s: Failed to issue the first read request. Error = %08x\n", NAME, err);
-        decrementOutstandingIO();
+        if(!wasPairing && fCore.isPairing())
+        {
+            fPairTimer->setTimeoutMS(fPairTimeout);
+        }
+        else if(wasPairing && !fCore.isPairing())
+        {
+            fPairTimer->cancelTimeout();
+        }
     }
-    
-    return err;
 }
 
-void com_milvich_driver_Thrustmaster::handleRead(IOReturn status)
+void com_milvich_driver_Thrustmaster::dispatchFrames()
 {
-    bool readAgain = false;
+    TMRawFrame                      frame;
+    com_milvich_driver_Thrustmaster *device;
     
-    switch(status)
+    // runs on the dispatch loop, so this can't race the pairing timer
+    while(fFrameRing.pop(&frame))
     {
-        case kIOReturnSuccess:
+        fIdle.wakeup();
+        
+        // when we are polling, the tag says whose it is. One nobody owns goes
+        // to the stick, which counts it as a bad half.
+        device = this;
+        if(fPoll.isEnabled() && frame.length == kHalfFrameSize)
         {
-            int index = 0;
-            unsigned char *data = (unsigned char*)fBuffer->getBytesNoCopy();
+            int index = fPoll.route(frame.data);
             
-            // the full 8 bytes of data is returned in two 4 byte chucks, pick
-            // the right offset into the 8 byte control data
-            if(data[2] == 0x98)
+            if(index >= 0)
             {
-                index = 4;
+                device = fDevices[index];
             }
-            
-            // check to see if there was a change
-            bool changed = false;
-            for(int i = 0; i < 4; i++)
-            {
-                if(fControlData[index + i] != data[4 + i])
-                {
-                    fControlData[index + i] = data[4 + i];
-                    changed = true;
-                }
-            }
-            
-            if(changed)
-            {
-                packet(fControlData, sizeof(fControlData));
-            }
-            
-            readAgain = true;
-            break;
         }
-        default:
-            // assume some problem and stop reading
-            IOLog("%s: handleRead - status = %08x\n", NAME, status);
-            readAgain = false;
+        if(!device)
+        {
+            continue;
+        }
+        
+        device->fFrameTimestamp = frame.timestamp;
+        device->fLatency.mark(kLatencyQueue, frame.timestamp);
+        if(device->fCaptureBuffer)
+        {
+            device->fCapture.add(frame.timestamp, frame.data, frame.length);
+        }
+        device->handleHalfFrame(frame.data, frame.length);
+    }
+}
+
+void com_milvich_driver_Thrustmaster::dispatchAction(OSObject *obj, IOInterruptEventSource *sender, int count)
+{
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
+    
+    if(dump)
+    {
+        dump->dispatchFrames();
+    }
+}
+
+void com_milvich_driver_Thrustmaster::frameCompleted(bool changed, UInt64 timestamp)
+{
+    UInt8   data[kControlDataSize];
+    
+    // the chord's own frame already goes out with the profile it switched to,
+    // and the same with a macro's first press
+    if(changed)
+    {
+        fProfiles.checkChord(fCore.fControlData);
+        if(fMacros.isEnabled() && fMacros.update(timestamp, fCore.fControlData))
+        {
+            setMacroTimer(TMNanoseconds());
+        }
+        
+        // back to full rate
+        if(fIdleTimer && fIdle.changed(timestamp, fLink.fBlindSince))
+        {
+            fLink.fHoldReads = false;
+            fLink.resumeReads();
+            fIdleTimer->setTimeoutMS(fIdle.fTimeout);
+        }
     }
     
-    // reschedule the read if we are still reading...
-    if(!fNeedToClose && readAgain)
+    // only complete frames that changed something get reported
+    if(!fPredictor.isEnabled())
     {
-        incrementOutstandingIO();
-        if(fPipe->Read(fBuffer, &fReadCompletion) != kIOReturnSuccess)
+        if(changed)
         {
-            IOLog("%s: Failed to reschedule a read operation\n", NAME);
-            decrementOutstandingIO();
+            sendControlData(fCore.fControlData);
         }
+        return;
     }
     
-    // update our IO op count
-    decrementOutstandingIO();
+    // every frame, changed or not, tells the predictor how the axes are moving.
+    // This also corrects whatever we guessed since the last one.
+    fPredictor.update(timestamp, fCore.fControlData, data);
+    sendControlData(data);
+    fPredictTimer->setTimeoutUS(fPredictor.fInterval);
 }
 
-void com_milvich_driver_Thrustmaster::readCallback(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining)
+void com_milvich_driver_Thrustmaster::sendControlData(const UInt8 *data)
 {
-    com_milvich_driver_Thrustmaster *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, (OSObject*)target);
+    UInt8   overlaid[kControlDataSize];
+    UInt64  now;
+    
+    // whatever the macros are pressing goes on top
+    if(fMacros.isEnabled())
+    {
+        bcopy(data, fMacroBase, sizeof(fMacroBase));
+        fMacros.overlay(fMacroBase, overlaid);
+        data = overlaid;
+    }
+    
+    if(bcmp(data, fGovernor.latest(fSentData), sizeof(fSentData)) == 0)
+    {
+        return;
+    }
+    
+    // with a report rate the governor may hold on to it until the next tick
+    now = fGovernor.isEnabled() ? TMNanoseconds() : 0;
+    switch(fGovernor.offer(now, data, fSentData))
+    {
+        case kGovernorSend:
+            bcopy(data, fSentData, sizeof(fSentData));
+            packet(fSentData, sizeof(fSentData));
+            break;
+        
+        case kGovernorHold:
+            fGovernorTimer->setTimeoutUS((UInt32)((fGovernor.fNextTick - now + 999) / 1000));
+            break;
+    }
+}
+
+void com_milvich_driver_Thrustmaster::handleGovernorTick()
+{
+    UInt8   data[kControlDataSize];
+    
+    if(fGovernor.tick(TMNanoseconds(), fSentData, data))
+    {
+        bcopy(data, fSentData, sizeof(fSentData));
+        packet(fSentData, sizeof(fSentData));
+    }
+}
+
+void com_milvich_driver_Thrustmaster::governorTimerFired(OSObject *obj, IOTimerEventSource *sender)
+{
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
     
     if(dump)
     {
-        dump->handleRead(status);
+        dump->handleGovernorTick();
     }
 }
 
-void com_milvich_driver_Thrustmaster::incrementOutstandingIO()
+void com_milvich_driver_Thrustmaster::handleCountersTick()
 {
-    fOutstandingIOOps++;
+    OSDictionary    *counters;
+    
+    // on the dispatch loop, so the rates are always over about the same time
+    // and the registry only ever sees a finished set
+    fCounters.update(&fLink, &fCore, TMNanoseconds());
+    counters = fCounters.copyDictionary(&fLink);
+    if(counters)
+    {
+        OSNumber *number = OSNumber::withNumber(fFrameRing.fOverruns, 32);
+        
+        counters->setObject("FrameRingOverruns", number);
+        number->release();
+        setProperty("Counters", counters);
+        counters->release();
+    }
+    fCountersTimer->setTimeoutMS(kCountersInterval);
 }
 
-void com_milvich_driver_Thrustmaster::decrementOutstandingIO()
+void com_milvich_driver_Thrustmaster::countersTimerFired(OSObject *obj, IOTimerEventSource *sender)
 {
-    fOutstandingIOOps--;
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
     
-    // if we don't have any outstaind IO requests, and if we need to close, then
-    // close. Except if we are still waiting for the init thread to finish. In that
-    // case the finished init handler will take care of closing the provider.
-    if(fOutstandingIOOps == 0 && fNeedToClose && !fFinishedInit)
+    if(dump)
     {
-        fIface->close(this);
+        dump->handleCountersTick();
+    }
+}
+
+void com_milvich_driver_Thrustmaster::setMacroTimer(UInt64 now)
+{
+    UInt64  when;
+    
+    if(!fMacros.nextStep(&when))
+    {
+        fMacroTimer->cancelTimeout();
+    }
+    else
+    {
+        fMacroTimer->setTimeoutUS((UInt32)((when > now) ? (when - now + 999) / 1000 : 0));
+    }
+}
+
+void com_milvich_driver_Thrustmaster::handleMacroTick()
+{
+    UInt64  now = TMNanoseconds();
+    
+    if(fMacros.advance(now))
+    {
+        sendControlData(fMacroBase);
+    }
+    setMacroTimer(now);
+}
+
+void com_milvich_driver_Thrustmaster::macroTimerFired(OSObject *obj, IOTimerEventSource *sender)
+{
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
+    
+    if(dump)
+    {
+        dump->handleMacroTick();
+    }
+}
+
+void com_milvich_driver_Thrustmaster::handleIdleTick()
+{
+    UInt64  now, next;
+    
+    if(fLink.fNeedToClose)
+    {
+        return;
+    }
+    
+    // a changed frame still in the ring has to bring us back first, and
+    // against the reads that brought it in
+    dispatchFrames();
+    fIdle.wakeup();
+    now = TMNanoseconds();
+    
+    if(fIdle.tick(now, &next))
+    {
+        fLink.fEmptySince = 0;
+        fLink.fBlindSince = 0;
+        fLink.fHoldReads = true;
+    }
+    
+    // whatever came back since the last tick goes back on the pipe
+    if(fIdle.fBackedOff)
+    {
+        fLink.resumeReads();
+    }
+    fIdleTimer->setTimeoutUS((UInt32)((next > now) ? (next - now + 999) / 1000 : 0));
+}
+
+void com_milvich_driver_Thrustmaster::idleTimerFired(OSObject *obj, IOTimerEventSource *sender)
+{
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
+    
+    if(dump)
+    {
+        dump->handleIdleTick();
+    }
+}
+
+void com_milvich_driver_Thrustmaster::handlePredict()
+{
+    UInt8   data[kControlDataSize];
+    
+    // keep extrapolating until we are too far past the last frame, then fall
+    // back to what the stick last really said
+    if(fPredictor.predict(TMNanoseconds(), data))
+    {
+        sendControlData(data);
+        fPredictTimer->setTimeoutUS(fPredictor.fInterval);
+    }
+    else
+    {
+        sendControlData(fPredictor.fLastData);
+    }
+}
+
+void com_milvich_driver_Thrustmaster::predictTimerFired(OSObject *obj, IOTimerEventSource *sender)
+{
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
+    
+    if(dump)
+    {
+        dump->handlePredict();
+    }
+}
+
+void com_milvich_driver_Thrustmaster::handlePairTimeout()
+{
+    UInt32  frames = fCore.fFrames;
+    bool    changed;
+    
+    // the other half never showed up, report what we have
+    changed = fCore.flushHalfFrame();
+    if(fCore.fFrames != frames)
+    {
+        frameCompleted(changed, TMNanoseconds());
+    }
+}
+
+void com_milvich_driver_Thrustmaster::pairTimerFired(OSObject *obj, IOTimerEventSource *sender)
+{
+    com_milvich_driver_Thrustmaster  *dump = OSDynamicCast(com_milvich_driver_Thrustmaster, obj);
+    
+    if(dump)
+    {
+        dump->handlePairTimeout();
     }
 }
 
@@ -972,17 +1444,108 @@ void com_milvich_driver_Thrustmaster::handleStop(IOService *provider)
 {
     //IOLog("%s: handleStop\n", NAME);
     
+    // another device on the iMate, make sure we aren't handed anything more
+    if(fBus && fDispatchLoop)
+    {
+        fDispatchLoop->runAction(removeDeviceAction, fBus, this);
+    }
+    
+    // stop polling, whatever answers comes in gets dropped below
+    if(fPollTimer)
+    {
+        fPollTimer->cancelTimeout();
+        fDispatchLoop->removeEventSource(fPollTimer);
+        fPollTimer->release();
+        fPollTimer = NULL;
+    }
+    if(fIdleTimer)
+    {
+        fIdleTimer->cancelTimeout();
+        fDispatchLoop->removeEventSource(fIdleTimer);
+        fIdleTimer->release();
+        fIdleTimer = NULL;
+    }
+    for(int i = 1; i < kMaxADBDevices; i++)
+    {
+        if(fDevices[i])
+        {
+            fDevices[i]->release();
+            fDevices[i] = NULL;
+        }
+    }
+    
+    // stop the dispatch side first, it uses the report buffer
+    if(fPairTimer)
+    {
+        fPairTimer->cancelTimeout();
+        fDispatchLoop->removeEventSource(fPairTimer);
+        fPairTimer->release();
+        fPairTimer = NULL;
+    }
+    
+    if(fPredictTimer)
+    {
+        fPredictTimer->cancelTimeout();
+        fDispatchLoop->removeEventSource(fPredictTimer);
+        fPredictTimer->release();
+        fPredictTimer = NULL;
+    }
+    
+    if(fGovernorTimer)
+    {
+        fGovernorTimer->cancelTimeout();
+        fDispatchLoop->removeEventSource(fGovernorTimer);
+        fGovernorTimer->release();
+        fGovernorTimer = NULL;
+    }
+    
+    if(fMacroTimer)
+    {
+        fMacroTimer->cancelTimeout();
+        fDispatchLoop->removeEventSource(fMacroTimer);
+        fMacroTimer->release();
+        fMacroTimer = NULL;
+    }
+    
+    if(fCountersTimer)
+    {
+        fCountersTimer->cancelTimeout();
+        fDispatchLoop->removeEventSource(fCountersTimer);
+        fCountersTimer->release();
+        fCountersTimer = NULL;
+    }
+    
+    // and the dispatch loop, anything still in the ring is dropped
+    if(fDispatchSource)
+    {
+        fDispatchSource->disable();
+        fDispatchLoop->removeEventSource(fDispatchSource);
+        fDispatchSource->release();
+        fDispatchSource = NULL;
+    }
+    
+    if(fDispatchLoop)
+    {
+        fDispatchLoop->release();
+        fDispatchLoop = NULL;
+    }
+    
     // clear out any memory that we allocated
-    if(fBuffer != NULL)
+    fLink.free();
+    fProfiles.clear();
+    
+    releaseReportBuffers();
+    
+    if(fReportDescriptor != NULL)
     {
-        fBuffer->release();
-        fBuffer = NULL;
+        fReportDescriptor->release();
+        fReportDescriptor = NULL;
     }
     
-    if(fReport != NULL)
+    if(fCaptureBuffer != NULL)
     {
-        fReport->release();
-        fReport = NULL;
+        IOFree(fCaptureBuffer, fCaptureSize);
+        fCaptureBuffer = NULL;
     }
     
     if(fPipe != NULL)
@@ -996,6 +1559,8 @@ void com_milvich_driver_Thrustmaster::handleStop(IOService *provider)
         fIface->release();
         fIface = NULL;
     }
+    fTransport.fIface = NULL;
+    fTransport.fPipe = NULL;
     
     // remove our gate from the work loop
     if(fGate)
@@ -1013,10 +1578,7 @@ bool com_milvich_driver_Thrustmaster::willTerminate(IOService *provider, IOOptio
     //IOLog("%s: willTerminate\n", NAME);
     
     // stop any IO operation that might be scheduled
-    if(fPipe)
-    {
-        fPipe->Abort();
-    }
+    fLink.abort();
     
     return super::willTerminate(provider, options);
 }
@@ -1025,16 +1587,71 @@ bool com_milvich_driver_Thrustmaster::didTerminate(IOService *provider, IOOption
 {
     //IOLog("%s: didTerminate\n", NAME);
     
-    fNeedToClose = true;
+    // close our provider, or leave it to the last read to come back
+    fLink.terminate();
     
-    // we are done, so close the reference to our provider... assuming we don't
-    // have an IO operation currently going on... if we do then delay the close
-    // until the IO operation completes.
-    if(fIface && fOutstandingIOOps == 0 && fFinishedInit)
+    return super::didTerminate(provider, options, defer);
+}
+
+
+//==============================================================================
+// TMUSBTransport
+//==============================================================================
+IOReturn TMUSBTransport::deviceRequest(IOUSBDevRequest *request, IOUSBCompletion *completion)
+{
+    return fIface->DeviceRequest(request, completion);
+}
+
+IOReturn TMUSBTransport::read(IOMemoryDescriptor *buffer, IOUSBCompletion *completion)
+{
+    return fPipe->Read(buffer, completion);
+}
+
+void TMUSBTransport::abort()
+{
+    if(fPipe)
     {
-        fIface->close(this);
+        fPipe->Abort();
+    }
+}
+
+void TMUSBTransport::close()
+{
+    if(fIface)
+    {
+        fIface->close(fClient);
+    }
+}
+
+// the mark goes on the interface, so it goes away when the iMate is unplugged
+// but is still there if the driver is reloaded
+bool TMUSBTransport::wasInitialized()
+{
+    return fIface && fIface->getProperty("TMInitialized") == kOSBooleanTrue;
+}
+
+void TMUSBTransport::setInitialized()
+{
+    if(fIface)
+    {
+        fIface->setProperty("TMInitialized", kOSBooleanTrue);
     }
+}
+
+void TMUSBTransport::getInitTiming(TMInitTiming *timing)
+{
+    OSData *data = fIface ? OSDynamicCast(OSData, fIface->getProperty("TMInitTiming")) : NULL;
     
-    return super::didTerminate(provider, options, defer);
+    if(data && data->getLength() == sizeof(*timing))
+    {
+        bcopy(data->getBytesNoCopy(), timing, sizeof(*timing));
+    }
 }
 
+void TMUSBTransport::setInitTiming(const TMInitTiming *timing)
+{
+    if(fIface)
+    {
+        fIface->setProperty("TMInitTiming", (void*)timing, sizeof(*timing));
+    }
+}
@@ -7,34 +7,111 @@
 #include <IOKit/hid/IOHIDDevice.h>
 #include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/IOLib.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOInterruptEventSource.h>
 #include "Constants.h"
+#include "TMCore.h"
+#include "TMFrameRing.h"
+#include "TMLatency.h"
+#include "TMCapture.h"
+#include "TMLink.h"
+#include "TMPredictor.h"
+#include "TMGovernor.h"
+#include "TMProfile.h"
+#include "TMProfileSet.h"
+#include "TMMacro.h"
+#include "TMIdle.h"
+#include "TMCounters.h"
+
+// TMLink's way to the iMate, the interface and its interrupt pipe
+class TMUSBTransport : public TMTransport
+{
+public:
+    IOUSBInterface  *fIface;
+    IOUSBPipe       *fPipe;
+    IOService       *fClient;
+
+public:
+    virtual IOReturn deviceRequest(IOUSBDevRequest *request, IOUSBCompletion *completion = NULL);
+    virtual IOReturn read(IOMemoryDescriptor *buffer, IOUSBCompletion *completion);
+    virtual void abort();
+    virtual void close();
+    virtual bool wasInitialized();
+    virtual void setInitialized();
+    virtual void getInitTiming(TMInitTiming *timing);
+    virtual void setInitTiming(const TMInitTiming *timing);
+};
 
 class com_milvich_driver_Thrustmaster : public IOHIDDevice
 {
     OSDeclareDefaultStructors(com_milvich_driver_Thrustmaster);
 
 public:
-    IOBufferMemoryDescriptor    *fReport;
-    bool                        fHasRudders;
-    bool                        fHasThrottle;
+    IOBufferMemoryDescriptor    *fReports[kReportBuffers];    // built into in turn, see TMCore
+    IOBufferMemoryDescriptor    *fReportDescriptor;
     bool                        fEndThread;
-    bool                        fRockerIsModifier;
-    char                        fButtonShifts[kNumOfButtons * kNumModifiers];
-    char                        fHatSwitchShifts[kNumModifiers];
-    int                         fNumButtons;
-    bool                        fHatIsModified;
-    bool                        fTwistRudder;
+    TMCore                      fCore;
     
     IOUSBInterface  *fIface;
     IOUSBPipe       *fPipe;
-    int             fOutstandingIOOps;
-    IOUSBCompletion fReadCompletion;
     IOUSBCompletion fInitCompletion;
-    IOBufferMemoryDescriptor *fBuffer;
-    bool            fNeedToClose;
-    bool            fFinishedInit;
-    unsigned char   fControlData[8];
+    
+    // the init sequence, the read ring and closing, see TMLink.h
+    TMUSBTransport  fTransport;
+    TMLink          fLink;
     IOCommandGate   *fGate;
+    IOTimerEventSource *fPairTimer;
+    UInt32          fPairTimeout;
+    
+    // raw frames go from the USB completion to our own work loop through this
+    TMFrameRing     fFrameRing;
+    IOWorkLoop      *fDispatchLoop;
+    IOInterruptEventSource *fDispatchSource;
+    
+    // how long each stage takes, and when the frame being worked on came in
+    TMLatencyStats  fLatency;
+    UInt64          fFrameTimestamp;
+    
+    // extrapolated reports between frames, and what was last sent
+    TMPredictor     fPredictor;
+    IOTimerEventSource *fPredictTimer;
+    UInt8           fSentData[kControlDataSize];
+    
+    // at most ReportRate reports a second, see TMGovernor.h
+    TMGovernor      fGovernor;
+    IOTimerEventSource *fGovernorTimer;
+    
+    // more ADB devices on the same iMate, see TMPoll.h. The instance matched
+    // to the interface does the polling and hands each device's halves to
+    // its own instance in fDevices, fDevices[0] is itself. The others have
+    // it as their provider and fBus.
+    TMPollScheduler fPoll;
+    IOTimerEventSource *fPollTimer;
+    com_milvich_driver_Thrustmaster *fDevices[kMaxADBDevices];
+    com_milvich_driver_Thrustmaster *fBus;
+    
+    // other mappings to switch to, see TMProfileSet.h
+    TMProfileSet    fProfiles;
+    
+    // buttons pressed on a schedule, see TMMacro.h. fMacroBase is the last
+    // thing sent without them on top.
+    TMMacroEngine   fMacros;
+    IOTimerEventSource *fMacroTimer;
+    UInt8           fMacroBase[kControlDataSize];
+    
+    // fewer reads while the stick is left alone, see TMIdle.h
+    TMIdlePolicy    fIdle;
+    IOTimerEventSource *fIdleTimer;
+    
+    // what the driver has done, for the registry, see TMCounters.h
+    TMCounters      fCounters;
+    IOTimerEventSource *fCountersTimer;
+    
+    // raw halves recorded for replay, see TMCapture.h
+    TMCaptureWriter fCapture;
+    UInt8           *fCaptureBuffer;
+    UInt32          fCaptureSize;
 
 public:
         
@@ -45,11 +122,29 @@ public:
     virtual OSNumber* newPrimaryUsagePageNumber() const;
 
     virtual IOReturn getReport(IOMemoryDescriptor *report, IOHIDReportType reportType, IOOptionBits options);
+    static IOReturn copyReportAction(OSObject *obj, void *arg0, void *arg1, void *arg2, void *arg3);
     virtual IOReturn getReport(IOMemoryDescriptor *report, UInt8 *data, IOByteCount length);
     virtual void packet(UInt8 *data, IOByteCount length);
 
     virtual IOReturn newReportDescriptor(IOMemoryDescriptor ** descriptor ) const;
     
+    virtual bool serializeProperties(OSSerialize *s) const;
+
+    // new settings while we're running. Only ones that keep the report layout
+    // are taken, the tables are swapped between two packets and nothing is
+    // lost. One that changes the layout gets kIOReturnUnsupported and waits
+    // for the driver to be restarted. The settings are the first profile's,
+    // so taking them switches back to that one.
+    virtual IOReturn setProperties(OSObject *properties);
+    virtual IOReturn changeSettings(OSDictionary *changes);
+    virtual void publishSettings(OSDictionary *settings);
+    virtual bool createReportBuffers();
+    virtual void releaseReportBuffers();
+    virtual void handleAdoptSettings(TMCore *core);
+    static IOReturn adoptSettingsAction(OSObject *obj, void *arg0, void *arg1, void *arg2, void *arg3);
+    virtual void handleSelectProfile(int index);
+    static IOReturn selectProfileAction(OSObject *obj, void *arg0, void *arg1, void *arg2, void *arg3);
+    
     
     // USB functions...
     virtual bool init(OSDictionary *properties);
@@ -61,12 +156,34 @@ public:
     
     virtual void handleInit();
     static void initThread(void *arg);
-    virtual void handleInitFinshed();
+    virtual void handleInitFinshed(const UInt8 *found, int numFound);
     static IOReturn initFinished(OSObject *obj, void *arg0, void *arg1, void *arg2, void *arg3);
     
-    virtual IOReturn startReadLoop();
-    virtual void handleRead(IOReturn status);
-    static void readCallback(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining);
-    virtual void incrementOutstandingIO();
-    virtual void decrementOutstandingIO();
+    static void frameReceived(void *target, const UInt8 *data, UInt32 length, UInt64 timestamp);
+    virtual void handleHalfFrame(UInt8 *data, IOByteCount length);
+    virtual bool startTimers();
+    virtual void startDevices();
+    virtual void handleAddDevices(const UInt8 *found, int numFound);
+    static IOReturn addDevicesAction(OSObject *obj, void *arg0, void *arg1, void *arg2, void *arg3);
+    virtual void removeDevice(com_milvich_driver_Thrustmaster *device);
+    static IOReturn removeDeviceAction(OSObject *obj, void *arg0, void *arg1, void *arg2, void *arg3);
+    virtual void handlePoll();
+    static void pollTimerFired(OSObject *obj, IOTimerEventSource *sender);
+    virtual void dispatchFrames();
+    static void dispatchAction(OSObject *obj, IOInterruptEventSource *sender, int count);
+    virtual void frameCompleted(bool changed, UInt64 timestamp);
+    virtual void sendControlData(const UInt8 *data);
+    virtual void handlePredict();
+    static void predictTimerFired(OSObject *obj, IOTimerEventSource *sender);
+    virtual void handleGovernorTick();
+    static void governorTimerFired(OSObject *obj, IOTimerEventSource *sender);
+    virtual void handleCountersTick();
+    static void countersTimerFired(OSObject *obj, IOTimerEventSource *sender);
+    virtual void setMacroTimer(UInt64 now);
+    virtual void handleMacroTick();
+    static void macroTimerFired(OSObject *obj, IOTimerEventSource *sender);
+    virtual void handleIdleTick();
+    static void idleTimerFired(OSObject *obj, IOTimerEventSource *sender);
+    virtual void handlePairTimeout();
+    static void pairTimerFired(OSObject *obj, IOTimerEventSource *sender);
 };
\ No newline at end of file
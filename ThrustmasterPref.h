@@ -40,6 +40,7 @@
 - (void)saveInfoDict;
 
 - (void)restartDriver;
+- (BOOL)applySettingsToDriver;
 
 - (BOOL)isThrustmasterInstalled;
 - (BOOL)isThrustmasterLoaded;
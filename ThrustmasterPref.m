@@ -8,6 +8,7 @@
 
 #import "ThrustmasterPref.h"
 #include <stdio.h>
+#include <IOKit/IOKitLib.h>
 
 NSString	*kThrustmasterPath = @"/System/Library/Extensions/Thrustmaster.kext";
 NSString	*kThrustmasterName = @"Thrustmaster";
@@ -21,6 +22,7 @@ NSString        *kTempPath = @"/tmp/newTMInfo.plist";
 NSString        *kButtonsKey = @"Buttons";
 NSString        *kHatKey = @"ModifierEffectsHat";
 NSString        *kTwistKey = @"TwistRudder";
+char* kThrustmasterClass = "com_milvich_driver_Thrustmaster";
 
 char* kKextload = "/sbin/kextload";
 char* kKextunload = "/sbin/kextunload";
@@ -148,6 +150,51 @@ char* kRmPath = "/bin/rm";
     [self setModified:NO];
 }
 
+- (BOOL)applySettingsToDriver
+{
+    io_iterator_t   iterator;
+    io_service_t    service, parent;
+    kern_return_t   result;
+    BOOL            applied = NO, failed = NO;
+    
+    result = IOServiceGetMatchingServices(kIOMasterPortDefault, IOServiceMatching(kThrustmasterClass), &iterator);
+    if(result != KERN_SUCCESS)
+    {
+        return NO;
+    }
+    
+    while((service = IOIteratorNext(iterator)))
+    {
+        // a second device on the same iMate has settings of its own
+        if(IORegistryEntryGetParentEntry(service, kIOServicePlane, &parent) == KERN_SUCCESS)
+        {
+            BOOL isDevice = IOObjectConformsTo(parent, kThrustmasterClass);
+            
+            IOObjectRelease(parent);
+            if(isDevice)
+            {
+                IOObjectRelease(service);
+                continue;
+            }
+        }
+        
+        result = IORegistryEntrySetCFProperties(service, (CFDictionaryRef)fInfoEntry);
+        if(result == KERN_SUCCESS)
+        {
+            applied = YES;
+        }
+        else
+        {
+            NSLog(@"Failed to set the driver's properties: %08x", result);
+            failed = YES;
+        }
+        IOObjectRelease(service);
+    }
+    IOObjectRelease(iterator);
+    
+    return applied && !failed;
+}
+
 - (void)restartDriver
 {
     AuthorizationItem   items[4];
@@ -299,10 +346,10 @@ char* kRmPath = "/bin/rm";
 
 - (IBAction)restartAction:(id)sender
 {
-    // first save... if needed
+    // first save... if needed, the restart picks them up
     if(fModified)
     {
-        [self saveAction:nil];
+        [self saveInfoDict];
     }
     NSBeginAlertSheet(@"Are you sure you want to restart the driver?", @"OK", @"Cancel", nil, [oReloadButton window], self, @selector(restartSheetDidEnd:returnCode:contextInfo:), nil, nil, @"Please make sure to quit all applications that could be using your Thrustmaster stick. If you fail to do so, you will most likely crash your computer.");
 }
@@ -310,6 +357,18 @@ char* kRmPath = "/bin/rm";
 - (IBAction)saveAction:(id)sender
 {
     [self saveInfoDict];
+    if(fModified)
+    {
+        return;
+    }
+    
+    // the driver takes the new settings without a restart, unless they change
+    // the buttons or axes the stick has, those need the driver restarted
+    if(![self applySettingsToDriver] && [self isThrustmasterLoaded])
+    {
+        NSLog(@"The driver didn't take the new settings, they will be used once it is restarted");
+        NSBeginAlertSheet(@"Restart the driver to use the new settings?", @"OK", @"Cancel", nil, [oReloadButton window], self, @selector(restartSheetDidEnd:returnCode:contextInfo:), nil, nil, @"The new settings change the buttons or axes the stick has, so they are only used once the driver is restarted. Please make sure to quit all applications that could be using your Thrustmaster stick first. If you fail to do so, you will most likely crash your computer.");
+    }
 }
 
 - (void)restartSheetDidEnd:(NSWindow *)sheet returnCode:(int)returnCode contextInfo:(void *)contextInfo
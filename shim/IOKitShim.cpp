@@ -0,0 +1,182 @@
+/*
+ File:		IOKitShim.cpp
+ */
+
+#include "IOKitShim.h"
+#include <stdarg.h>
+#include <time.h>
+
+void IOLog(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void IOSleep(unsigned milliseconds)
+{
+    struct timespec ts;
+
+    ts.tv_sec = milliseconds / 1000;
+    ts.tv_nsec = (milliseconds % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+void clock_get_uptime(UInt64 *result)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *result = (UInt64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static OSBoolean gTrue(true);
+static OSBoolean gFalse(false);
+OSBoolean * const kOSBooleanTrue = &gTrue;
+OSBoolean * const kOSBooleanFalse = &gFalse;
+
+OSBoolean* OSBoolean::withBoolean(bool value)
+{
+    OSBoolean *result = value ? kOSBooleanTrue : kOSBooleanFalse;
+
+    result->retain();
+    return result;
+}
+
+OSNumber* OSNumber::withNumber(UInt64 value, unsigned numberOfBits)
+{
+    if(numberOfBits < 64)
+    {
+        value &= (1ULL << numberOfBits) - 1;
+    }
+    return new OSNumber(value);
+}
+
+OSString* OSString::withCString(const char *string)
+{
+    return new OSString(string);
+}
+
+OSData* OSData::withBytes(const void *bytes, unsigned length)
+{
+    return new OSData(bytes, length);
+}
+
+OSArray::~OSArray()
+{
+    for(unsigned i = 0; i < fObjects.size(); i++)
+    {
+        fObjects[i]->release();
+    }
+}
+
+OSArray* OSArray::withCapacity(unsigned capacity)
+{
+    OSArray *array = new OSArray;
+
+    array->fObjects.reserve(capacity);
+    return array;
+}
+
+bool OSArray::setObject(OSObject *object)
+{
+    if(!object)
+    {
+        return false;
+    }
+    object->retain();
+    fObjects.push_back(object);
+    return true;
+}
+
+OSDictionary::~OSDictionary()
+{
+    std::map<std::string, OSObject *>::iterator it;
+
+    for(it = fObjects.begin(); it != fObjects.end(); ++it)
+    {
+        it->second->release();
+    }
+}
+
+OSDictionary* OSDictionary::withCapacity(unsigned capacity)
+{
+    return new OSDictionary;
+}
+
+OSObject* OSDictionary::getObject(const char *key) const
+{
+    std::map<std::string, OSObject *>::const_iterator it = fObjects.find(key);
+
+    return (it == fObjects.end()) ? NULL : it->second;
+}
+
+bool OSDictionary::setObject(const char *key, OSObject *object)
+{
+    if(!object)
+    {
+        return false;
+    }
+    object->retain();
+    removeObject(key);
+    fObjects[key] = object;
+    return true;
+}
+
+void OSDictionary::removeObject(const char *key)
+{
+    std::map<std::string, OSObject *>::iterator it = fObjects.find(key);
+
+    if(it != fObjects.end())
+    {
+        it->second->release();
+        fObjects.erase(it);
+    }
+}
+
+IOBufferMemoryDescriptor* IOBufferMemoryDescriptor::withCapacity(IOByteCount capacity, IODirection direction, bool contiguous)
+{
+    IOBufferMemoryDescriptor *buffer = new IOBufferMemoryDescriptor;
+
+    buffer->fBytes.resize(capacity ? capacity : 1);
+    buffer->fLength = capacity;
+    return buffer;
+}
+
+IOBufferMemoryDescriptor* IOBufferMemoryDescriptor::withBytes(const void *bytes, IOByteCount length, IODirection direction, bool contiguous)
+{
+    IOBufferMemoryDescriptor *buffer = withCapacity(length, direction, contiguous);
+
+    memcpy(buffer->getBytesNoCopy(), bytes, length);
+    return buffer;
+}
+
+IOByteCount IOBufferMemoryDescriptor::writeBytes(IOByteCount offset, const void *bytes, IOByteCount length)
+{
+    if(offset >= fLength)
+    {
+        return 0;
+    }
+    if(length > fLength - offset)
+    {
+        length = fLength - offset;
+    }
+    memcpy(&fBytes[offset], bytes, length);
+    return length;
+}
+
+IOByteCount IOBufferMemoryDescriptor::readBytes(IOByteCount offset, void *bytes, IOByteCount length)
+{
+    if(offset >= fLength)
+    {
+        return 0;
+    }
+    if(length > fLength - offset)
+    {
+        length = fLength - offset;
+    }
+    memcpy(bytes, &fBytes[offset], length);
+    return length;
+}
@@ -0,0 +1,282 @@
+/*
+ File:		IOKitShim.h
+
+ Just enough of IOKit and libkern to build TMCore on a machine that isn't a
+ Mac. None of this goes into the kext, it only exists so the report
+ translation can be built, profiled and poked at on Linux.
+ */
+
+#ifndef __IOKITSHIM__
+#define __IOKITSHIM__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <string>
+
+typedef uint8_t     UInt8;
+typedef uint16_t    UInt16;
+typedef uint32_t    UInt32;
+typedef uint64_t    UInt64;
+typedef int8_t      SInt8;
+typedef int16_t     SInt16;
+typedef int32_t     SInt32;
+typedef int64_t     SInt64;
+typedef int         IOReturn;
+typedef size_t      IOByteCount;
+typedef UInt32      IOOptionBits;
+
+// the error codes we actually use, same values as IOReturn.h
+#define iokit_common_err(x)     ((IOReturn)(0xe0000000 | (x)))
+#define kIOReturnSuccess        0
+#define kIOReturnError          iokit_common_err(0x2bc)
+#define kIOReturnNoMemory       iokit_common_err(0x2bd)
+#define kIOReturnNoResources    iokit_common_err(0x2be)
+#define kIOReturnBadArgument    iokit_common_err(0x2c2)
+#define kIOReturnBusy           iokit_common_err(0x2d5)
+#define kIOReturnNoDevice       iokit_common_err(0x2c0)
+#define kIOReturnTimeout        iokit_common_err(0x2d6)
+#define kIOReturnUnderrun       iokit_common_err(0x2e7)
+#define kIOReturnOverrun        iokit_common_err(0x2e8)
+#define kIOReturnAborted        iokit_common_err(0x2eb)
+#define kIOReturnNotResponding  iokit_common_err(0x2ed)
+#define kIOUSBPipeStalled       ((IOReturn)(0xe0004000 | 0x4f))
+
+// the HID usages that end up in the report descriptor
+enum {
+    kHIDPage_GenericDesktop     = 0x01,
+    kHIDPage_Button             = 0x09
+};
+
+enum {
+    kHIDUsage_GD_Joystick       = 0x04,
+    kHIDUsage_GD_X              = 0x30,
+    kHIDUsage_GD_Y              = 0x31,
+    kHIDUsage_GD_Z              = 0x32,
+    kHIDUsage_GD_Rz             = 0x35,
+    kHIDUsage_GD_Slider         = 0x36,
+    kHIDUsage_GD_Hatswitch      = 0x39
+};
+
+enum IODirection {
+    kIODirectionNone            = 0,
+    kIODirectionIn              = 1,
+    kIODirectionOut             = 2,
+    kIODirectionOutIn           = 3
+};
+
+// IOKit/usb/USB.h, the parts TMLink needs
+enum {
+    kUSBOut                     = 0,
+    kUSBIn                      = 1
+};
+
+enum {
+    kUSBStandard                = 0,
+    kUSBClass                   = 1,
+    kUSBVendor                  = 2
+};
+
+enum {
+    kUSBDevice                  = 0,
+    kUSBInterface               = 1,
+    kUSBEndpoint                = 2
+};
+
+#define USBmakebmRequestType(direction, type, recipient) \
+    ((((direction) & 1) << 7) | (((type) & 3) << 5) | ((recipient) & 0x1f))
+
+struct IOUSBDevRequest
+{
+    UInt8       bmRequestType;
+    UInt8       bRequest;
+    UInt16      wValue;
+    UInt16      wIndex;
+    UInt16      wLength;
+    void        *pData;
+    UInt32      wLenDone;
+};
+
+typedef void (*IOUSBCompletionAction)(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining);
+
+struct IOUSBCompletion
+{
+    void                    *target;
+    IOUSBCompletionAction   action;
+    void                    *parameter;
+};
+
+void IOLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void IOSleep(unsigned milliseconds);
+
+// libkern/OSAtomic.h
+static inline void OSMemoryBarrier() { __sync_synchronize(); }
+static inline bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32 *address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+static inline SInt32 OSIncrementAtomic(volatile SInt32 *address) { return __sync_fetch_and_add(address, 1); }
+static inline SInt32 OSDecrementAtomic(volatile SInt32 *address) { return __sync_fetch_and_sub(address, 1); }
+static inline SInt32 OSAddAtomic(SInt32 amount, volatile SInt32 *address) { return __sync_fetch_and_add(address, amount); }
+
+// libkern/OSByteOrder.h
+static inline UInt64 OSReadLittleInt64(const volatile void *base, uintptr_t offset)
+{
+    UInt64 value;
+
+    memcpy(&value, (const UInt8 *)base + offset, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+static inline void OSWriteLittleInt32(volatile void *base, uintptr_t offset, UInt32 value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    memcpy((UInt8 *)base + offset, &value, sizeof(value));
+}
+static inline void OSWriteLittleInt64(volatile void *base, uintptr_t offset, UInt64 value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    memcpy((UInt8 *)base + offset, &value, sizeof(value));
+}
+
+// kern/clock.h, on the host absolute time is just nanoseconds
+void clock_get_uptime(UInt64 *result);
+static inline void absolutetime_to_nanoseconds(UInt64 abstime, UInt64 *result) { *result = abstime; }
+static inline void nanoseconds_to_absolutetime(UInt64 nanoseconds, UInt64 *result) { *result = nanoseconds; }
+
+#define OSDynamicCast(type, inst)   (dynamic_cast<type *>((OSObject *)(inst)))
+
+//==============================================================================
+// libkern containers
+//==============================================================================
+class OSObject
+{
+protected:
+    int     fRetainCount;
+
+public:
+    OSObject() : fRetainCount(1) {}
+    virtual ~OSObject() {}
+
+    void retain() { fRetainCount++; }
+    void release() { if(--fRetainCount == 0) delete this; }
+};
+
+class OSBoolean : public OSObject
+{
+    bool    fValue;
+
+public:
+    OSBoolean(bool value) : fValue(value) {}
+    static OSBoolean* withBoolean(bool value);
+
+    bool getValue() const { return fValue; }
+    bool isTrue() const { return fValue; }
+};
+
+extern OSBoolean * const kOSBooleanTrue;
+extern OSBoolean * const kOSBooleanFalse;
+
+class OSNumber : public OSObject
+{
+    UInt64  fValue;
+
+public:
+    OSNumber(UInt64 value) : fValue(value) {}
+    static OSNumber* withNumber(UInt64 value, unsigned numberOfBits);
+
+    UInt32 unsigned32BitValue() const { return (UInt32)fValue; }
+    UInt64 unsigned64BitValue() const { return fValue; }
+    void setValue(UInt64 value) { fValue = value; }
+};
+
+class OSString : public OSObject
+{
+    std::string fString;
+
+public:
+    OSString(const char *string) : fString(string) {}
+    static OSString* withCString(const char *string);
+
+    const char* getCStringNoCopy() const { return fString.c_str(); }
+    unsigned getLength() const { return fString.size(); }
+    bool isEqualTo(const char *string) const { return fString == string; }
+};
+
+class OSData : public OSObject
+{
+    std::vector<UInt8>  fBytes;
+
+public:
+    OSData(const void *bytes, unsigned length) : fBytes((const UInt8 *)bytes, (const UInt8 *)bytes + length) {}
+    static OSData* withBytes(const void *bytes, unsigned length);
+
+    const void* getBytesNoCopy() const { return fBytes.empty() ? NULL : &fBytes[0]; }
+    unsigned getLength() const { return fBytes.size(); }
+};
+
+class OSArray : public OSObject
+{
+    std::vector<OSObject *> fObjects;
+
+public:
+    virtual ~OSArray();
+    static OSArray* withCapacity(unsigned capacity);
+
+    unsigned getCount() const { return fObjects.size(); }
+    OSObject* getObject(unsigned index) const { return index < fObjects.size() ? fObjects[index] : NULL; }
+    bool setObject(OSObject *object);
+};
+
+class OSDictionary : public OSObject
+{
+    std::map<std::string, OSObject *>   fObjects;
+
+public:
+    virtual ~OSDictionary();
+    static OSDictionary* withCapacity(unsigned capacity);
+
+    unsigned getCount() const { return fObjects.size(); }
+    OSObject* getObject(const char *key) const;
+    bool setObject(const char *key, OSObject *object);
+    void removeObject(const char *key);
+};
+
+//==============================================================================
+// memory descriptors
+//==============================================================================
+class IOMemoryDescriptor : public OSObject
+{
+public:
+    virtual IOByteCount getLength() const = 0;
+    virtual IOByteCount writeBytes(IOByteCount offset, const void *bytes, IOByteCount length) = 0;
+    virtual IOByteCount readBytes(IOByteCount offset, void *bytes, IOByteCount length) = 0;
+};
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor
+{
+    std::vector<UInt8>  fBytes;
+    IOByteCount         fLength;
+
+public:
+    static IOBufferMemoryDescriptor* withCapacity(IOByteCount capacity, IODirection direction, bool contiguous = false);
+    static IOBufferMemoryDescriptor* withBytes(const void *bytes, IOByteCount length, IODirection direction, bool contiguous = false);
+
+    void* getBytesNoCopy() { return &fBytes[0]; }
+    void setLength(IOByteCount length) { fLength = length; }
+
+    virtual IOByteCount getLength() const { return fLength; }
+    virtual IOByteCount writeBytes(IOByteCount offset, const void *bytes, IOByteCount length);
+    virtual IOByteCount readBytes(IOByteCount offset, void *bytes, IOByteCount length);
+};
+
+#endif
@@ -0,0 +1,496 @@
+/*
+ File:		TMMockTransport.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "TMMockTransport.h"
+#include "TMCapture.h"
+#include "TMLink.h"
+#include "TMPoll.h"
+
+// how long to wait for the driver to queue a read before giving up on it
+#define kStarvedTimeout     1000
+
+// what every init request should look like, vendor requests out to the interface
+#define kInitRequestType    USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBInterface)
+
+TMMockTransport::TMMockTransport()
+{
+    fLoops = 1;
+    fRealTime = false;
+    fFailRequest = -1;
+    fRequestDelay = 0;
+    fReadyAfter = kNumInitCmds;
+    fMinGap = 0;
+    fRemoved = NULL;
+    fTarget = NULL;
+    reset(true);
+}
+
+void TMMockTransport::reset(bool unplugged)
+{
+    wait();
+    
+    fGone = false;
+    fStopping = false;
+    fPending.clear();
+    fReplies.clear();
+    fRequests = fBadRequests = fADBCommands = 0;
+    fReads = fCompletions = fAborted = 0;
+    fCloses = fPendingAtClose = fReadsAfterClose = fCompletionsAfterClose = 0;
+    fStarved = 0;
+    fLateness.reset();
+    
+    if(unplugged)
+    {
+        fInSequence = 0;
+        fLastRequest = 0;
+        fInitialized = false;
+        fHasInitTiming = false;
+        fReady = 0;
+    }
+}
+
+TMMockTransport::~TMMockTransport()
+{
+    stop();
+}
+
+bool TMMockTransport::loadScript(const char *path)
+{
+    FILE    *file = fopen(path, "r");
+    char    line[256];
+    int     number = 0;
+    
+    if(!file)
+    {
+        return false;
+    }
+    
+    while(fgets(line, sizeof(line), file))
+    {
+        TMMockEvent event;
+        char        *word, *rest;
+        
+        number++;
+        if((rest = strchr(line, '#')))
+        {
+            *rest = 0;
+        }
+        if(!(word = strtok(line, " \t\r\n")))
+        {
+            continue;
+        }
+        
+        memset(&event, 0, sizeof(event));
+        if(strcmp(word, "data") == 0)
+        {
+            event.type = TMMockEvent::kData;
+            while(event.length < kHalfFrameSize && (rest = strtok(NULL, " \t\r\n")))
+            {
+                event.data[event.length++] = strtoul(rest, NULL, 16);
+            }
+        }
+        else if(strcmp(word, "error") == 0 && (rest = strtok(NULL, " \t\r\n")))
+        {
+            event.type = TMMockEvent::kError;
+            event.status = (IOReturn)strtoul(rest, NULL, 16);
+        }
+        else if(strcmp(word, "stall") == 0)
+        {
+            event.type = TMMockEvent::kError;
+            event.status = kIOUSBPipeStalled;
+        }
+        else if(strcmp(word, "wait") == 0 && (rest = strtok(NULL, " \t\r\n")))
+        {
+            event.type = TMMockEvent::kWait;
+            event.delay = strtoull(rest, NULL, 10) * 1000;
+        }
+        else if(strcmp(word, "remove") == 0)
+        {
+            event.type = TMMockEvent::kRemove;
+        }
+        else
+        {
+            fprintf(stderr, "%s:%d: don't know what to do with \"%s\"\n", path, number, word);
+            fclose(file);
+            return false;
+        }
+        fScript.push_back(event);
+    }
+    fclose(file);
+    
+    return true;
+}
+
+bool TMMockTransport::loadCapture(const char *path)
+{
+    FILE                *file = fopen(path, "rb");
+    std::vector<UInt8>  bytes;
+    TMCaptureReader     reader;
+    TMCaptureRecord     record;
+    UInt64              last;
+    int                 c;
+    
+    if(!file)
+    {
+        return false;
+    }
+    while((c = fgetc(file)) != EOF)
+    {
+        bytes.push_back(c);
+    }
+    fclose(file);
+    
+    if(bytes.empty() || !reader.init(&bytes[0], bytes.size()))
+    {
+        return false;
+    }
+    
+    last = reader.fTimestamp;
+    while(reader.next(&record))
+    {
+        TMMockEvent event;
+        
+        memset(&event, 0, sizeof(event));
+        event.type = TMMockEvent::kData;
+        event.delay = record.timestamp - last;
+        event.length = record.length;
+        memcpy(event.data, record.data, sizeof(event.data));
+        fScript.push_back(event);
+        last = record.timestamp;
+    }
+    
+    return true;
+}
+
+void TMMockTransport::start()
+{
+    fThread = std::thread(&TMMockTransport::run, this);
+}
+
+void TMMockTransport::wait()
+{
+    if(fThread.joinable())
+    {
+        fThread.join();
+    }
+}
+
+void TMMockTransport::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(fLock);
+        fStopping = true;
+    }
+    fWake.notify_all();
+    if(fThread.joinable())
+    {
+        fThread.join();
+    }
+}
+
+IOReturn TMMockTransport::deviceRequest(IOUSBDevRequest *request, IOUSBCompletion *completion)
+{
+    int         index;
+    bool        ready = false;
+    UInt64      now = TMNanoseconds();
+    IOReturn    status = kIOReturnSuccess;
+    
+    {
+        std::lock_guard<std::mutex> lock(fLock);
+        
+        if(fGone)
+        {
+            return kIOReturnNoDevice;
+        }
+        index = fRequests++;
+        if(request->bmRequestType != kInitRequestType || request->bRequest > 1 ||
+           (request->wLength && !request->pData))
+        {
+            fBadRequests++;
+        }
+        
+        // too soon after the last one and it gets lost, and the iMate
+        // needs the whole sequence again
+        if(fLastRequest && now - fLastRequest < fMinGap * 1000ULL)
+        {
+            fInSequence = 0;
+        }
+        else
+        {
+            fInSequence++;
+        }
+        fLastRequest = now;
+        ready = !fReady && fInSequence >= fReadyAfter;
+        
+        // a device on the bus answering a Talk Register 3 or 0, tagged with
+        // the command
+        if(fReady && request->bRequest == kADBCommandRequest)
+        {
+            UInt8       command = request->wValue;
+            TMMockEvent reply;
+            
+            fADBCommands++;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = TMMockEvent::kData;
+            reply.length = kHalfFrameSize;
+            reply.data[kHalfFrameTagByte] = command;
+            for(size_t i = 0; i < fADBDevices.size(); i++)
+            {
+                if(command == ADBCommand(fADBDevices[i].address, kADBTalk, 3))
+                {
+                    reply.data[kADBRegister3Byte] = 0x60 | fADBDevices[i].address;
+                    reply.data[kADBHandlerIDByte] = fADBDevices[i].handlerID;
+                    fReplies.push_back(reply);
+                }
+                else if(command == ADBCommand(fADBDevices[i].address, kADBTalk, 0))
+                {
+                    for(int half = 0; half < 2; half++)
+                    {
+                        memcpy(&reply.data[kHalfFrameSize - kHalfFrameDataSize],
+                               &fADBDevices[i].register0[half * kHalfFrameDataSize], kHalfFrameDataSize);
+                        fReplies.push_back(reply);
+                    }
+                }
+            }
+        }
+    }
+    
+    if(fRequestDelay)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(fRequestDelay));
+    }
+    
+    if(index == fFailRequest)
+    {
+        status = kIOReturnNotResponding;
+    }
+    
+    // that got the iMate talking
+    else if(ready)
+    {
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            fReady = TMNanoseconds();
+        }
+        fWake.notify_all();
+    }
+    
+    // sent without waiting, how it went goes to the completion
+    if(completion)
+    {
+        completion->action(completion->target, completion->parameter, status, 0);
+        return kIOReturnSuccess;
+    }
+    return status;
+}
+
+IOReturn TMMockTransport::read(IOMemoryDescriptor *buffer, IOUSBCompletion *completion)
+{
+    Read    pending;
+    
+    {
+        std::lock_guard<std::mutex> lock(fLock);
+        
+        if(fCloses)
+        {
+            fReadsAfterClose++;
+        }
+        if(fGone)
+        {
+            return kIOReturnNoDevice;
+        }
+        pending.buffer = buffer;
+        pending.completion = *completion;
+        fPending.push_back(pending);
+        fReads++;
+    }
+    fWake.notify_all();
+    
+    return kIOReturnSuccess;
+}
+
+void TMMockTransport::abort()
+{
+    std::deque<Read>    aborted;
+    
+    {
+        std::lock_guard<std::mutex> lock(fLock);
+        aborted.swap(fPending);
+        fAborted += aborted.size();
+    }
+    
+    // like the real pipe, every queued read comes back
+    for(size_t i = 0; i < aborted.size(); i++)
+    {
+        IOUSBCompletion &completion = aborted[i].completion;
+        
+        completion.action(completion.target, completion.parameter, kIOReturnAborted, aborted[i].buffer->getLength());
+    }
+}
+
+bool TMMockTransport::wasInitialized()
+{
+    std::lock_guard<std::mutex> lock(fLock);
+    return fInitialized;
+}
+
+void TMMockTransport::setInitialized()
+{
+    std::lock_guard<std::mutex> lock(fLock);
+    fInitialized = true;
+}
+
+void TMMockTransport::getInitTiming(TMInitTiming *timing)
+{
+    std::lock_guard<std::mutex> lock(fLock);
+    if(fHasInitTiming)
+    {
+        *timing = fInitTiming;
+    }
+}
+
+void TMMockTransport::setInitTiming(const TMInitTiming *timing)
+{
+    std::lock_guard<std::mutex> lock(fLock);
+    fInitTiming = *timing;
+    fHasInitTiming = true;
+}
+
+void TMMockTransport::close()
+{
+    std::lock_guard<std::mutex> lock(fLock);
+    
+    fCloses++;
+    fPendingAtClose += fPending.size();
+}
+
+bool TMMockTransport::complete(IOReturn status, const UInt8 *data, UInt32 length)
+{
+    Read        read;
+    TMMockEvent reply;
+    bool        answering;
+    
+    do
+    {
+        {
+            std::unique_lock<std::mutex> lock(fLock);
+            
+            // wait for the iMate to be set up and the driver to queue something
+            if(!fWake.wait_for(lock, std::chrono::milliseconds(kStarvedTimeout),
+                               [this] { return (fReady && !fPending.empty()) || fStopping; }))
+            {
+                fStarved++;
+                return false;
+            }
+            if(fStopping)
+            {
+                return false;
+            }
+            read = fPending.front();
+            fPending.pop_front();
+            fCompletions++;
+            if(fCloses)
+            {
+                fCompletionsAfterClose++;
+            }
+            
+            // answers to ADB commands go first
+            answering = !fReplies.empty();
+            if(answering)
+            {
+                reply = fReplies.front();
+                fReplies.pop_front();
+            }
+        }
+        
+        if(answering)
+        {
+            read.buffer->writeBytes(0, reply.data, reply.length);
+            read.completion.action(read.completion.target, read.completion.parameter, kIOReturnSuccess,
+                                   read.buffer->getLength() - reply.length);
+        }
+    } while(answering);
+    
+    if(status == kIOReturnSuccess)
+    {
+        read.buffer->writeBytes(0, data, length);
+    }
+    read.completion.action(read.completion.target, read.completion.parameter, status,
+                           read.buffer->getLength() - (status == kIOReturnSuccess ? length : 0));
+    return true;
+}
+
+void TMMockTransport::run()
+{
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    bool                                  sent = false;
+    
+    for(int loop = 0; loop < fLoops; loop++)
+    {
+        for(size_t i = 0; i < fScript.size(); i++)
+        {
+            const TMMockEvent &event = fScript[i];
+            
+            // captures keep their own timing in real time mode, waits always do
+            if(event.delay && fRealTime)
+            {
+                next += std::chrono::nanoseconds(event.delay);
+                std::this_thread::sleep_until(next);
+            }
+            else if(event.delay && event.type == TMMockEvent::kWait)
+            {
+                next = std::chrono::steady_clock::now() + std::chrono::nanoseconds(event.delay);
+                std::this_thread::sleep_until(next);
+            }
+            
+            switch(event.type)
+            {
+                case TMMockEvent::kData:
+                    if(!complete(kIOReturnSuccess, event.data, event.length))
+                        goto done;
+                    
+                    // how long it waited for the driver to queue a read. The
+                    // first one waits for init, so the timing starts over there
+                    // instead of everything that piled up going out at once.
+                    if(fRealTime && !sent)
+                    {
+                        next = std::chrono::steady_clock::now();
+                    }
+                    else if(fRealTime)
+                    {
+                        fLateness.add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                          std::chrono::steady_clock::now() - next).count());
+                    }
+                    sent = true;
+                    break;
+                case TMMockEvent::kError:
+                    if(!complete(event.status, NULL, 0))
+                        goto done;
+                    break;
+                case TMMockEvent::kWait:
+                    break;
+                case TMMockEvent::kRemove:
+                    goto done;
+            }
+        }
+    }
+    
+done:
+    // the device is gone, either because the script said so or because it
+    // ran out. Anything still queued waits for an abort, like the real thing.
+    {
+        std::lock_guard<std::mutex> lock(fLock);
+        fGone = true;
+    }
+    if(fRemoved)
+    {
+        fRemoved(fTarget);
+    }
+}
@@ -0,0 +1,136 @@
+/*
+ File:		TMMockTransport.h
+ Creater:	Michael Milvich, michael@milvich.com
+
+ A pretend iMate for running TMLink off a Mac. It takes the init sequence,
+ serves the interrupt pipe from a script or a frame capture on a thread of
+ its own once the init sequence is done, and can fail requests, stall the pipe or vanish part way through.
+
+ The iMate only takes a request if it comes at least fMinGap after the last
+ one, and only starts sending once it has taken fReadyAfter in a row.
+
+ Once it is sending, the devices in fADBDevices answer a Talk Register 3
+ with their handler ID, and a Talk Register 0 with their register 0 in two
+ reads, see TMPoll.h. The answer goes out ahead of the next thing in the
+ script. A request with a completion is finished before deviceRequest()
+ returns.
+
+ Script lines, # starts a comment:
+
+     data <up to 8 hex bytes>   complete the oldest queued read with this
+     error <hex IOReturn>       complete the oldest queued read with an error
+     stall                      same as error e000404f
+     wait <us>                  pause before the next line
+     remove                     pull the plug
+ */
+
+#ifndef __TMMOCKTRANSPORT__
+#define __TMMOCKTRANSPORT__
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "TMTransport.h"
+#include "TMLatency.h"
+
+struct TMMockEvent
+{
+    enum { kData, kError, kWait, kRemove } type;
+    UInt64      delay;          // ns before this event, only used for kWait and captures
+    IOReturn    status;
+    UInt32      length;
+    UInt8       data[kHalfFrameSize];
+};
+
+struct TMMockADBDevice
+{
+    UInt8       address;
+    UInt8       handlerID;
+    UInt8       register0[kControlDataSize];
+};
+
+class TMMockTransport : public TMTransport
+{
+public:
+    struct Read
+    {
+        IOMemoryDescriptor  *buffer;
+        IOUSBCompletion     completion;
+    };
+
+    // what to play, and how
+    std::vector<TMMockEvent>    fScript;
+    int                         fLoops;
+    bool                        fRealTime;
+    int                         fFailRequest;       // fail this init request, -1 for none
+    UInt32                      fRequestDelay;      // us each init request takes
+    UInt32                      fReadyAfter;        // requests before data starts flowing
+    UInt32                      fMinGap;            // us it needs between requests to take them
+    std::vector<TMMockADBDevice> fADBDevices;       // besides the stick
+
+    // called on the mock's thread when it hits a remove, or runs out of script
+    void                        (*fRemoved)(void *target);
+    void                        *fTarget;
+
+    std::mutex                  fLock;
+    std::condition_variable     fWake;
+    std::deque<Read>            fPending;
+    std::deque<TMMockEvent>     fReplies;           // answers to ADB commands
+    std::thread                 fThread;
+    bool                        fGone;
+    bool                        fStopping;
+
+    // the state of the iMate itself, kept across reset(false)
+    UInt32                      fInSequence;        // requests in a row it took
+    UInt64                      fLastRequest;
+    bool                        fInitialized;
+    TMInitTiming                fInitTiming;
+    bool                        fHasInitTiming;
+
+    // what happened
+    UInt32                      fRequests;
+    UInt32                      fBadRequests;
+    UInt32                      fADBCommands;       // sent once it was going
+    UInt32                      fReads;
+    UInt32                      fCompletions;
+    UInt32                      fAborted;
+    UInt32                      fCloses;
+    UInt32                      fPendingAtClose;
+    UInt32                      fReadsAfterClose;
+    UInt32                      fCompletionsAfterClose;
+    UInt32                      fStarved;
+    UInt64                      fReady;             // TMNanoseconds() when data could start
+    TMLatencyHistogram          fLateness;          // ns each half went out past its time, with fRealTime
+
+public:
+    TMMockTransport();
+    ~TMMockTransport();
+
+    bool loadScript(const char *path);
+    bool loadCapture(const char *path);
+
+    void start();
+    void wait();
+    void stop();
+
+    // get ready for the next driver to attach, unplugged or just reloaded
+    void reset(bool unplugged);
+
+    virtual IOReturn deviceRequest(IOUSBDevRequest *request, IOUSBCompletion *completion = NULL);
+    virtual IOReturn read(IOMemoryDescriptor *buffer, IOUSBCompletion *completion);
+    virtual void abort();
+    virtual void close();
+    virtual bool wasInitialized();
+    virtual void setInitialized();
+    virtual void getInitTiming(TMInitTiming *timing);
+    virtual void setInitTiming(const TMInitTiming *timing);
+
+private:
+    void run();
+    bool complete(IOReturn status, const UInt8 *data, UInt32 length);
+};
+
+#endif
@@ -0,0 +1,665 @@
+/*
+ File:		tmbench.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Times the per frame paths of TMCore under every combination of the
+ HasThrottle, HasRudder, RockerIsModifier, ModifierEffectsHat and
+ TwistRudder settings, each with no Buttons, the FCS buttons and every
+ button shifted:
+
+     halves      handleHalfFrame, putting the halves together and finding
+                 out if anything changed (handleRead in the kext)
+     report      buildReport, the translation into the HID report
+     descriptor  buildReportDescriptor, what newReportDescriptor hands out
+     read        TMLink::handleRead, the USB completion: counting the read,
+                 handing the half to handleHalfFrame and queuing the read
+                 again on a pipe that takes it straight away
+
+ They run over a made up stream, the stick wandering around with the odd
+ button press and stretches where nothing moves, and over any captures
+ given with -c. Each is the best of a few runs, and prints ns, instructions
+ and branch misses per call, and mallocs per call. The instruction and
+ branch miss counts need perf events, they are left out where those aren't
+ allowed.
+
+ With -b the made up stream is checked against a baseline written by -w,
+ and it exits with 1 if any configuration takes more than -i percent (5 by
+ default) more instructions or allocates at all more, or if a stage is
+ slower than the baseline by more than -t percent (25) and -f ns a call
+ (2). The instruction counts are the dependable check, where there are no
+ perf events only the time is left, so a stage that looks slower is timed
+ again up to kRetries more times, kRetryPause apart, and only counts if its
+ best time still is. "make bench" runs it against tools/tmbench.baseline.
+
+ usage: tmbench [-n halves] [-c capture]... [-b baseline] [-w baseline]
+                [-t percent] [-i percent] [-f ns] [-q]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <vector>
+
+#include "TMCore.h"
+#include "TMCapture.h"
+#include "TMLink.h"
+
+#define kRuns               10
+#define kRetries            10
+#define kRetryPause         200     // ms, so the retries aren't all in the same busy spell
+#define kNumSettings        5
+#define kNumButtonSets      3
+
+enum {
+    kStageHalves            = 0,
+    kStageReport,
+    kStageDescriptor,
+    kStageRead,
+    kNumStages
+};
+
+static const char   *gStageNames[kNumStages] = {"halves", "report", "descriptor", "read"};
+static const char   *gSettingNames[kNumSettings] =
+    {"HasThrottle", "HasRudder", "RockerIsModifier", "ModifierEffectsHat", "TwistRudder"};
+static const char   *gButtonSetNames[kNumButtonSets] = {"none", "fcs", "all"};
+static const int    gButtonSetSizes[kNumButtonSets] = {0, kNumOfFCSButtons, kNumOfButtons};
+
+// every malloc in the process goes through here, so the allocations made by
+// a call can be counted
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+
+static UInt64 gAllocations = 0;
+
+extern "C" void *malloc(size_t size)
+{
+    gAllocations++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    gAllocations++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size)
+{
+    gAllocations++;
+    return __libc_realloc(pointer, size);
+}
+
+// a pipe that takes every read and never completes one, the read stage
+// completes them itself
+class BenchTransport : public TMTransport
+{
+public:
+    virtual IOReturn deviceRequest(IOUSBDevRequest *request, IOUSBCompletion *completion) { return kIOReturnSuccess; }
+    virtual IOReturn read(IOMemoryDescriptor *buffer, IOUSBCompletion *completion) { return kIOReturnSuccess; }
+    virtual void abort() {}
+    virtual void close() {}
+    virtual bool wasInitialized() { return true; }
+    virtual void setInitialized() {}
+    virtual void getInitTiming(TMInitTiming *timing) {}
+    virtual void setInitTiming(const TMInitTiming *timing) {}
+};
+
+static BenchTransport   gTransport;
+static TMLink           gLink;
+
+struct Stream
+{
+    const char              *name;
+    std::vector<UInt8>      halves;             // kHalfFrameSize each
+    std::vector<UInt8>      frames;             // kControlDataSize each, as committed
+};
+
+struct Result
+{
+    double      ns;
+    double      instructions;                   // < 0 without perf events
+    double      branchMisses;
+    double      allocations;
+};
+
+struct Counters
+{
+    int         instructions;
+    int         branchMisses;
+};
+
+static int openCounter(UInt64 config)
+{
+    struct perf_event_attr  attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static UInt64 readCounter(int fd)
+{
+    UInt64  value = 0;
+    
+    if(fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+    {
+        return 0;
+    }
+    return value;
+}
+
+static void setCounters(const Counters *counters, bool on)
+{
+    int request = on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE;
+    
+    if(counters->instructions >= 0)
+    {
+        if(on)
+            ioctl(counters->instructions, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->instructions, request, 0);
+    }
+    if(counters->branchMisses >= 0)
+    {
+        if(on)
+            ioctl(counters->branchMisses, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->branchMisses, request, 0);
+    }
+}
+
+// a cheap repeatable random number
+static UInt32 nextRandom(UInt32 *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+static void addHalf(Stream *stream, const UInt8 *control, int half)
+{
+    UInt8   data[kHalfFrameSize];
+    
+    memset(data, 0, sizeof(data));
+    data[kHalfFrameTagByte] = half ? kSecondHalfTag : kFirstHalfTag;
+    memcpy(data + kHalfFrameSize - kHalfFrameDataSize, control + half * kHalfFrameDataSize, kHalfFrameDataSize);
+    stream->halves.insert(stream->halves.end(), data, data + kHalfFrameSize);
+}
+
+static void makeStream(Stream *stream, int halves)
+{
+    UInt8   control[kControlDataSize];
+    UInt32  seed = 1;
+    int     resting = 0;
+    
+    // the stick wanders around, now and then a button or the hat moves, and
+    // every so often it sits still for a while
+    stream->name = "synthetic";
+    memset(control, 0, sizeof(control));
+    control[kXAxisByte] = 0x80;
+    control[kYAxisByte] = 0x80;
+    for(int i = 0; i < halves / 2; i++)
+    {
+        if(resting > 0)
+        {
+            resting--;
+        }
+        else if(nextRandom(&seed) % 50 == 0)
+        {
+            resting = nextRandom(&seed) % 30;
+        }
+        else
+        {
+            control[kXAxisByte] += (int)(nextRandom(&seed) % 7) - 3;
+            control[kYAxisByte] += (int)(nextRandom(&seed) % 7) - 3;
+            control[kThrottleByte] += (int)(nextRandom(&seed) % 3) - 1;
+            control[kRuddersByte] += (int)(nextRandom(&seed) % 3) - 1;
+            if(nextRandom(&seed) % 20 == 0)
+                control[kWCSButtonsByte] ^= 1 << (nextRandom(&seed) % 8);
+            if(nextRandom(&seed) % 20 == 0)
+                control[kFCSButtonsByte] ^= 1 << (nextRandom(&seed) % 8);
+        }
+        addHalf(stream, control, 0);
+        addHalf(stream, control, 1);
+    }
+}
+
+static bool readStream(Stream *stream, const char *path)
+{
+    std::vector<UInt8>  capture;
+    TMCaptureReader     reader;
+    TMCaptureRecord     record;
+    FILE                *file = fopen(path, "rb");
+    int                 c;
+    
+    if(!file)
+    {
+        return false;
+    }
+    while((c = fgetc(file)) != EOF)
+    {
+        capture.push_back(c);
+    }
+    fclose(file);
+    if(capture.empty() || !reader.init(&capture[0], capture.size()))
+    {
+        return false;
+    }
+    
+    // just the halves, each configuration gets its own settings
+    stream->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    while(reader.next(&record))
+    {
+        if(record.length == kHalfFrameSize)
+        {
+            stream->halves.insert(stream->halves.end(), record.data, record.data + kHalfFrameSize);
+        }
+    }
+    return !stream->halves.empty();
+}
+
+// the frames the halves add up to, for the report stage
+static void collectFrames(Stream *stream)
+{
+    TMCore  *core = new TMCore;
+    
+    core->init();
+    for(size_t i = 0; i < stream->halves.size(); i += kHalfFrameSize)
+    {
+        UInt32 frames = core->fFrames;
+        
+        core->handleHalfFrame(&stream->halves[i], kHalfFrameSize);
+        if(core->fFrames != frames)
+        {
+            stream->frames.insert(stream->frames.end(), core->fControlData, core->fControlData + kControlDataSize);
+        }
+    }
+    delete core;
+}
+
+static TMCore *makeCore(int settings, int buttonSet)
+{
+    TMCore          *core = new TMCore;
+    OSDictionary    *properties = OSDictionary::withCapacity(kNumSettings + 1);
+    OSArray         *buttons = OSArray::withCapacity(kNumOfButtons);
+    
+    for(int i = 0; i < kNumSettings; i++)
+    {
+        properties->setObject(gSettingNames[i], (settings & (1 << i)) ? kOSBooleanTrue : kOSBooleanFalse);
+    }
+    for(int i = 0; i < gButtonSetSizes[buttonSet]; i++)
+    {
+        buttons->setObject(kOSBooleanTrue);
+    }
+    properties->setObject("Buttons", buttons);
+    
+    core->init();
+    core->loadProperties(properties);
+    buttons->release();
+    properties->release();
+    return core;
+}
+
+// straight to the core, the kext goes through the frame ring
+static void frameReceived(void *target, const UInt8 *data, UInt32 length, UInt64 timestamp)
+{
+    ((TMCore*)target)->handleHalfFrame(data, length);
+}
+
+static UInt32 runStage(int stage, TMCore *core, const Stream *stream)
+{
+    UInt8   descriptor[kMaxReportDescriptorSize];
+    UInt32  calls = 0;
+    
+    switch(stage)
+    {
+        case kStageHalves:
+            for(size_t i = 0; i < stream->halves.size(); i += kHalfFrameSize, calls++)
+            {
+                core->handleHalfFrame(&stream->halves[i], kHalfFrameSize);
+            }
+            break;
+        
+        case kStageReport:
+            for(size_t i = 0; i < stream->frames.size(); i += kControlDataSize, calls++)
+            {
+                core->buildReport(&stream->frames[i]);
+            }
+            break;
+        
+        case kStageDescriptor:
+            for(size_t i = 0; i < stream->frames.size(); i += kControlDataSize, calls++)
+            {
+                core->buildReportDescriptor(descriptor);
+            }
+            break;
+        
+        case kStageRead:
+            gLink.fTarget = core;
+            for(size_t i = 0; i < stream->halves.size(); i += kHalfFrameSize, calls++)
+            {
+                int slot = calls % gLink.fNumReads;
+                
+                gLink.fReadBuffers[slot]->writeBytes(0, &stream->halves[i], kHalfFrameSize);
+                gLink.handleRead(kIOReturnSuccess, 0, slot);
+            }
+            break;
+    }
+    return calls;
+}
+
+// the counters and allocations are the same every time
+static void count(int stage, TMCore *core, const Stream *stream, const Counters *counters, Result *result)
+{
+    UInt64  allocations = gAllocations;
+    UInt32  calls;
+    
+    setCounters(counters, true);
+    calls = runStage(stage, core, stream);
+    setCounters(counters, false);
+    allocations = gAllocations - allocations;
+    if(!calls)
+    {
+        calls = 1;
+    }
+    
+    result->ns = 1e12;
+    result->instructions = (counters->instructions >= 0) ? (double)readCounter(counters->instructions) / calls : -1;
+    result->branchMisses = (counters->branchMisses >= 0) ? (double)readCounter(counters->branchMisses) / calls : -1;
+    result->allocations = (double)allocations / calls;
+}
+
+// the clock isn't, so this keeps the best of every time it is called
+static void time(int stage, TMCore *core, const Stream *stream, Result *result)
+{
+    UInt64  start = TMNanoseconds();
+    UInt32  calls = runStage(stage, core, stream);
+    double  ns = (double)(TMNanoseconds() - start) / (calls ? calls : 1);
+    
+    if(ns < result->ns)
+    {
+        result->ns = ns;
+    }
+}
+
+// whether a stage is slower than the baseline by more than both the
+// tolerance and the noise floor, the times are per call summed over entries
+static bool slower(double newTime, double baseTime, int entries, int tolerance, double floor)
+{
+    return entries && newTime > baseTime * (100 + tolerance) / 100 && (newTime - baseTime) / entries > floor;
+}
+
+static void printResult(const char *stream, int settings, int buttonSet, int stage, const Result *result)
+{
+    printf("%-10s %-12s %02x %-4s %10.2f", gStageNames[stage], stream, settings, gButtonSetNames[buttonSet], result->ns);
+    if(result->instructions >= 0)
+        printf(" %10.1f %8.3f", result->instructions, result->branchMisses);
+    else
+        printf(" %10s %8s", "-", "-");
+    printf(" %7.3f\n", result->allocations);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<Stream>     streams;
+    const char              *baselinePath = NULL, *writePath = NULL;
+    int                     halves = 20000, timeTolerance = 25, instructionTolerance = 5;
+    double                  noiseFloor = 2;
+    bool                    quiet = false;
+    Result                  synthetic[1 << kNumSettings][kNumButtonSets][kNumStages];
+    TMCore                  *cores[1 << kNumSettings][kNumButtonSets];
+    Counters                counters;
+    int                     regressions = 0;
+    
+    streams.push_back(Stream());
+    for(int i = 1; i < argc; i++)
+    {
+        if(i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            halves = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "-c") == 0)
+        {
+            streams.push_back(Stream());
+            if(!readStream(&streams.back(), argv[++i]))
+            {
+                fprintf(stderr, "%s: %s isn't a version %d capture\n", argv[0], argv[i], kCaptureVersion);
+                return 1;
+            }
+        }
+        else if(i + 1 < argc && strcmp(argv[i], "-b") == 0)
+            baselinePath = argv[++i];
+        else if(i + 1 < argc && strcmp(argv[i], "-w") == 0)
+            writePath = argv[++i];
+        else if(i + 1 < argc && strcmp(argv[i], "-t") == 0)
+            timeTolerance = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "-i") == 0)
+            instructionTolerance = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "-f") == 0)
+            noiseFloor = atof(argv[++i]);
+        else if(strcmp(argv[i], "-q") == 0)
+            quiet = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [-n halves] [-c capture]... [-b baseline] [-w baseline] [-t percent] [-i percent] [-f ns] [-q]\n", argv[0]);
+            return 2;
+        }
+    }
+    makeStream(&streams[0], halves);
+    for(size_t i = 0; i < streams.size(); i++)
+    {
+        collectFrames(&streams[i]);
+    }
+    
+    counters.instructions = openCounter(PERF_COUNT_HW_INSTRUCTIONS);
+    counters.branchMisses = openCounter(PERF_COUNT_HW_BRANCH_MISSES);
+    if(counters.instructions < 0 || counters.branchMisses < 0)
+    {
+        fprintf(stderr, "%s: no perf events here, only timing\n", argv[0]);
+    }
+    
+    for(int settings = 0; settings < (1 << kNumSettings); settings++)
+    {
+        for(int buttonSet = 0; buttonSet < kNumButtonSets; buttonSet++)
+        {
+            cores[settings][buttonSet] = makeCore(settings, buttonSet);
+        }
+    }
+    gLink.init(&gTransport, NULL, frameReceived, kDefaultReadsInFlight);
+    if(gLink.startReadLoop() != kIOReturnSuccess)
+    {
+        fprintf(stderr, "%s: couldn't start the read loop\n", argv[0]);
+        return 1;
+    }
+    
+    if(!quiet)
+    {
+        printf("%-10s %-12s %-7s %10s %10s %8s %7s\n", "stage", "stream", "config", "ns", "instr", "br-miss", "mallocs");
+    }
+    for(size_t s = 0; s < streams.size(); s++)
+    {
+        Result  results[1 << kNumSettings][kNumButtonSets][kNumStages];
+        
+        // each run goes through every configuration before the next one
+        // starts, so a busy moment on the machine doesn't land on just a few
+        for(int run = 0; run <= kRuns; run++)
+        {
+            for(int settings = 0; settings < (1 << kNumSettings); settings++)
+            {
+                for(int buttonSet = 0; buttonSet < kNumButtonSets; buttonSet++)
+                {
+                    for(int stage = 0; stage < kNumStages; stage++)
+                    {
+                        Result *result = &results[settings][buttonSet][stage];
+                        TMCore *core = cores[settings][buttonSet];
+                        
+                        if(run == 0)
+                            count(stage, core, &streams[s], &counters, result);
+                        else
+                            time(stage, core, &streams[s], result);
+                    }
+                }
+            }
+        }
+        
+        for(int settings = 0; settings < (1 << kNumSettings); settings++)
+        {
+            for(int buttonSet = 0; buttonSet < kNumButtonSets; buttonSet++)
+            {
+                for(int stage = 0; stage < kNumStages; stage++)
+                {
+                    if(s == 0)
+                    {
+                        synthetic[settings][buttonSet][stage] = results[settings][buttonSet][stage];
+                    }
+                    if(!quiet)
+                    {
+                        printResult(streams[s].name, settings, buttonSet, stage, &results[settings][buttonSet][stage]);
+                    }
+                }
+            }
+        }
+    }
+    
+    // one line per configuration and stage, the settings are the bits of
+    // gSettingNames in order
+    if(writePath)
+    {
+        FILE *file = fopen(writePath, "w");
+        
+        if(!file)
+        {
+            fprintf(stderr, "%s: can't write %s\n", argv[0], writePath);
+            return 1;
+        }
+        fprintf(file, "# tmbench baseline, %d halves: stage settings buttons ns instructions branch-misses mallocs\n", halves);
+        for(int settings = 0; settings < (1 << kNumSettings); settings++)
+        {
+            for(int buttonSet = 0; buttonSet < kNumButtonSets; buttonSet++)
+            {
+                for(int stage = 0; stage < kNumStages; stage++)
+                {
+                    const Result *result = &synthetic[settings][buttonSet][stage];
+                    
+                    fprintf(file, "%s %02x %s %.2f %.1f %.3f %.3f\n", gStageNames[stage], settings,
+                            gButtonSetNames[buttonSet], result->ns, result->instructions, result->branchMisses,
+                            result->allocations);
+                }
+            }
+        }
+        fclose(file);
+    }
+    
+    if(baselinePath)
+    {
+        FILE    *file = fopen(baselinePath, "r");
+        char    line[256], stageName[32], buttonSetName[32];
+        Result  base;
+        double  baseTime[kNumStages], newTime[kNumStages];
+        int     entries[kNumStages];
+        bool    listed[1 << kNumSettings][kNumButtonSets][kNumStages];
+        int     settings, checked = 0;
+        
+        if(!file)
+        {
+            fprintf(stderr, "%s: can't read %s\n", argv[0], baselinePath);
+            return 1;
+        }
+        for(int i = 0; i < kNumStages; i++)
+        {
+            baseTime[i] = 0;
+            entries[i] = 0;
+        }
+        memset(listed, 0, sizeof(listed));
+        while(fgets(line, sizeof(line), file))
+        {
+            int stage = -1, buttonSet = -1;
+            
+            if(line[0] == '#' || sscanf(line, "%31s %x %31s %lf %lf %lf %lf", stageName, &settings, buttonSetName,
+                                        &base.ns, &base.instructions, &base.branchMisses, &base.allocations) != 7)
+            {
+                continue;
+            }
+            for(int i = 0; i < kNumStages; i++)
+                if(strcmp(stageName, gStageNames[i]) == 0)
+                    stage = i;
+            for(int i = 0; i < kNumButtonSets; i++)
+                if(strcmp(buttonSetName, gButtonSetNames[i]) == 0)
+                    buttonSet = i;
+            if(stage < 0 || buttonSet < 0 || settings < 0 || settings >= (1 << kNumSettings))
+            {
+                continue;
+            }
+            
+            // the counts hold for each configuration, the time only for a
+            // whole stage, one configuration is too short to time reliably
+            const Result    *result = &synthetic[settings][buttonSet][stage];
+            const char      *what = NULL;
+            
+            baseTime[stage] += base.ns;
+            entries[stage]++;
+            listed[settings][buttonSet][stage] = true;
+            if(result->allocations > base.allocations)
+                what = "mallocs";
+            else if(base.instructions >= 0 && result->instructions >= 0 &&
+                    result->instructions > base.instructions * (100 + instructionTolerance) / 100)
+                what = "instructions";
+            if(what)
+            {
+                printf("regression in %s %02x %s, %s: %.1f instr %.3f mallocs, was %.1f instr %.3f mallocs\n",
+                       stageName, settings, buttonSetName, what, result->instructions, result->allocations,
+                       base.instructions, base.allocations);
+                regressions++;
+            }
+            checked++;
+        }
+        fclose(file);
+        
+        // the time only for a whole stage, one configuration is too short to
+        // time reliably. Something else running can make a stage look slow
+        // for a while, it has to stay slow through the retries.
+        for(int stage = 0; stage < kNumStages; stage++)
+        {
+            for(int retry = 0; ; retry++)
+            {
+                newTime[stage] = 0;
+                for(settings = 0; settings < (1 << kNumSettings); settings++)
+                    for(int buttonSet = 0; buttonSet < kNumButtonSets; buttonSet++)
+                        if(listed[settings][buttonSet][stage])
+                            newTime[stage] += synthetic[settings][buttonSet][stage].ns;
+                if(!slower(newTime[stage], baseTime[stage], entries[stage], timeTolerance, noiseFloor))
+                {
+                    break;
+                }
+                if(retry == kRetries)
+                {
+                    printf("regression in %s, time: %.2f ns a call, was %.2f\n", gStageNames[stage],
+                           newTime[stage] / entries[stage], baseTime[stage] / entries[stage]);
+                    regressions++;
+                    break;
+                }
+                usleep(kRetryPause * 1000);
+                for(int run = 0; run < kRuns; run++)
+                    for(settings = 0; settings < (1 << kNumSettings); settings++)
+                        for(int buttonSet = 0; buttonSet < kNumButtonSets; buttonSet++)
+                            time(stage, cores[settings][buttonSet], &streams[0], &synthetic[settings][buttonSet][stage]);
+            }
+        }
+        printf("%d regressions in %d entries checked against %s\n", regressions, checked, baselinePath);
+    }
+    
+    for(int settings = 0; settings < (1 << kNumSettings); settings++)
+    {
+        for(int buttonSet = 0; buttonSet < kNumButtonSets; buttonSet++)
+        {
+            delete cores[settings][buttonSet];
+        }
+    }
+    gLink.free();
+    return regressions ? 1 : 0;
+}
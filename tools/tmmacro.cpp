@@ -0,0 +1,249 @@
+/*
+ File:		tmmacro.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Runs TMMacroEngine against the real clock the way the kext does: one
+ thread standing in for the dispatch loop, frames every 10 ms pressing and
+ releasing the buttons, and a single timer for the next step of whatever
+ macros are running. Half way through it stalls for longer than a turn of
+ the wheel, like a dispatch loop held up by something else. Prints how
+ late the timer woke up for each step and how late the steps ran, how many
+ steps each wakeup ran, and what a frame costs when no button that starts a
+ macro changed.
+
+ How late the timer wakes up is up to the host, so that is only printed.
+ What the engine answers for is how much later than the wakeup it was
+ woken for a step ran, which is 0 unless the timer was set for the wrong
+ time. Exits with 1 if the 99th percentile of that is over the bound, if a
+ wakeup left a step that was due behind, or if anything is still running
+ or pressed once every button is let go and the last pulse trains have had
+ time to finish.
+
+ usage: tmmacro [-n macros] [-t seconds] [-b bound us] [-s seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#include "TMCore.h"
+#include "TMMacro.h"
+
+#define kFrameInterval      10000000ULL     // ns, about what the iMate manages
+#define kStall              (2 * kMacroWheelSlots * kMacroTickNS)
+
+// FCS button bits, in the order of the Buttons array
+static const UInt8  gFCSButtonMasks[kNumOfFCSButtons] =
+    {kFCSTriggerMask, kFCSThumbHighMask, kFCSThumbLowMask, kFCSPinkyMask};
+
+static void setButtons(UInt8 *control, UInt16 buttons)
+{
+    control[kFCSButtonsByte] = 0;
+    control[kWCSButtonsByte] = (buttons >> kNumOfFCSButtons) & 0x3f;
+    for(int i = 0; i < kNumOfFCSButtons; i++)
+    {
+        if(buttons & (1 << i))
+        {
+            control[kFCSButtonsByte] |= gFCSButtonMasks[i];
+        }
+    }
+}
+
+static void sleepUntil(UInt64 when)
+{
+    struct timespec ts;
+    
+    ts.tv_sec = when / 1000000000ULL;
+    ts.tv_nsec = when % 1000000000ULL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+    {
+    }
+}
+
+static UInt64 percentile(std::vector<UInt64> &samples, int percent)
+{
+    if(samples.empty())
+    {
+        return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[(samples.size() - 1) * percent / 100];
+}
+
+int main(int argc, char **argv)
+{
+    int                 count = 200, seconds = 5, bound = 2000;
+    unsigned            seed = 1;
+    TMMacroEngine       *engine = new TMMacroEngine;
+    std::vector<UInt64> wakeLateness, stepLateness;
+    UInt64              due[kMaxMacros];
+    UInt8               control[kControlDataSize];
+    UInt16              buttons = 0;
+    UInt64              toggleAt[kNumOfButtons];
+    UInt64              start, end, nextFrame, nextStep;
+    UInt32              frames = 0, maxRunning = 0, leftBehind = 0;
+    bool                armed = false, stalled = false, failed = false;
+    
+    for(int i = 1; i < argc; i++)
+    {
+        if(i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            count = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "-t") == 0)
+            seconds = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "-b") == 0)
+            bound = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "-s") == 0)
+            seed = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [-n macros] [-t seconds] [-b bound us] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    srand(seed);
+    
+    // a mix on every button: autofire, pulse trains and one shot holds
+    engine->init();
+    for(int i = 0; i < count; i++)
+    {
+        int button = i % kNumOfButtons;
+        
+        if(i % 4 == 0)
+            engine->add(button, button, 0, 10 + rand() % 50, 10 + rand() % 50, 0);
+        else if(i % 4 == 1)
+            engine->add(button, (i * 7) % kNumOfButtons, rand() % 200, 300 + rand() % 700, 1, 1);
+        else
+            engine->add(button, (i * 7) % kNumOfButtons, rand() % 200, 5 + rand() % 40, 5 + rand() % 40, 1 + rand() % 20);
+    }
+    if(engine->fCount != count)
+    {
+        fprintf(stderr, "%s: only %d macros fit\n", argv[0], engine->fCount);
+        count = engine->fCount;
+    }
+    
+    // what a frame costs when it changes nothing the macros care about
+    memset(control, 0, sizeof(control));
+    start = TMNanoseconds();
+    for(int i = 0; i < 10000000; i++)
+    {
+        control[kXAxisByte] = i;
+        engine->update(i, control);
+    }
+    end = TMNanoseconds();
+    printf("%d macros, %.2f ns/frame with no trigger changing\n", count, (end - start) / 1e7);
+    
+    // now in real time, each button goes down and up every second or two
+    start = TMNanoseconds();
+    for(int i = 0; i < kNumOfButtons; i++)
+    {
+        toggleAt[i] = start + (rand() % 1000) * 1000000ULL;
+    }
+    nextFrame = start;
+    end = start + seconds * 1000000000ULL;
+    while(true)
+    {
+        UInt64  now;
+        bool    frame = !armed || nextFrame <= nextStep;
+        int     running = 0;
+        
+        sleepUntil(frame ? nextFrame : nextStep);
+        now = TMNanoseconds();
+        if(!stalled && now >= start + (end - start) / 2)
+        {
+            sleepUntil(now + kStall);
+            now = TMNanoseconds();
+            stalled = true;
+        }
+        
+        if(!frame)
+        {
+            wakeLateness.push_back(now - nextStep);
+            for(int i = 0; i < count; i++)
+            {
+                due[i] = engine->fMacros[i].running ? engine->fMacros[i].due * kMacroTickNS : ~0ULL;
+            }
+            engine->advance(now);
+            
+            // how long before the wakeup each step that ran was due, which
+            // is how late the engine made it. Nothing due may be left over.
+            for(int i = 0; i < count; i++)
+            {
+                TMMacro *macro = &engine->fMacros[i];
+                
+                if(due[i] <= now && (!macro->running || macro->due * kMacroTickNS != due[i]))
+                {
+                    stepLateness.push_back(nextStep > due[i] ? nextStep - due[i] : 0);
+                }
+                if(macro->running && macro->due * kMacroTickNS <= now - now % kMacroTickNS)
+                {
+                    leftBehind++;
+                }
+            }
+        }
+        else
+        {
+            nextFrame += kFrameInterval;
+            frames++;
+            if(now >= end + 2000000000ULL)
+            {
+                break;
+            }
+            for(int i = 0; i < kNumOfButtons; i++)
+            {
+                if(now >= toggleAt[i])
+                {
+                    buttons ^= 1 << i;
+                    toggleAt[i] = now + ((buttons & (1 << i)) ? 500 + rand() % 1500 : 200 + rand() % 800) * 1000000ULL;
+                }
+            }
+            
+            // let go of everything at the end and give the rest time to finish
+            if(now >= end)
+            {
+                buttons = 0;
+            }
+            setButtons(control, buttons);
+            engine->update(now, control);
+        }
+        armed = engine->nextStep(&nextStep);
+        
+        for(int i = 0; i < count; i++)
+        {
+            running += engine->fMacros[i].running;
+        }
+        maxRunning = std::max(maxRunning, (UInt32)running);
+    }
+    
+    printf("%u frames, %u steps in %u wakeups (%.2f a wakeup), %u running at once at most\n",
+           (unsigned)frames, (unsigned)engine->fSteps, (unsigned)engine->fWakeups,
+           engine->fWakeups ? (double)engine->fSteps / engine->fWakeups : 0.0, (unsigned)maxRunning);
+    printf("wakeup lateness us: p50 %.1f p99 %.1f max %.1f\n", percentile(wakeLateness, 50) / 1e3,
+           percentile(wakeLateness, 99) / 1e3, percentile(wakeLateness, 100) / 1e3);
+    printf("step lateness us: p50 <%.1f p99 <%.1f max %.1f\n", engine->fLateness.percentile(50) / 1e3,
+           engine->fLateness.percentile(99) / 1e3, engine->fLateness.fMax / 1e3);
+    printf("step lateness past the wakeup us: p50 %.1f p99 %.1f max %.1f, %u steps left behind\n",
+           percentile(stepLateness, 50) / 1e3, percentile(stepLateness, 99) / 1e3,
+           percentile(stepLateness, 100) / 1e3, (unsigned)leftBehind);
+    
+    if(percentile(stepLateness, 99) > (UInt64)bound * 1000)
+    {
+        printf("p99 step lateness past the wakeup is over %d us\n", bound);
+        failed = true;
+    }
+    if(leftBehind)
+    {
+        printf("%u steps were due and left behind\n", (unsigned)leftBehind);
+        failed = true;
+    }
+    if(engine->fScheduled || engine->fOwnedFCS || engine->fOwnedWCS || engine->fPressedFCS || engine->fPressedWCS)
+    {
+        printf("%d macros still running with every button up\n", engine->fScheduled);
+        failed = true;
+    }
+    
+    delete engine;
+    return failed ? 1 : 0;
+}
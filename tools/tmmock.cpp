@@ -0,0 +1,641 @@
+/*
+ File:		tmmock.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Runs TMLink through a whole connection against TMMockTransport: the init
+ sequence, the read ring, frames through TMCore, and unplugging it. With -i
+ it does it again and again, which together with -a and -w is the startup
+ benchmark. Prints
+ how long startup took and how fast frames went through, and checks that
+ the interface got closed exactly once with nothing still queued on it.
+ Exits with 1 if that didn't happen.
+
+ usage: tmmock [options]
+     -s script   play a script, see TMMockTransport.h
+     -c capture  play a frame capture from the driver
+     -N halves   play this many made up halves (the default, 20000)
+     -r          play captures with their recorded timing, and the made up
+                 halves one every 2 ms like an autopolling iMate
+     -l loops    play the script this many times before unplugging
+     -n reads    reads to keep queued (default 2)
+     -d ms       pause before each init command (default 50)
+     -a          adaptive init, what it learns stays with the iMate until
+                 it is unplugged
+     -g us       the iMate needs this long between init requests
+     -f n        fail init request n
+     -i runs     do the whole thing this many times
+     -w          between runs only reload the driver, the iMate stays plugged in
+     -A devices  put more ADB devices on the bus and probe for them after
+                 init, address:handler[,address:handler...]. The script
+                 has to still be going, -r with a capture does it. Whatever
+                 is found gets polled like the kext does, while the stick
+                 keeps sending its own. Each half has to end up with the
+                 device it came from, and every device has to get frames
+                 with nothing bad or unpaired.
+     -I timeout:interval
+                 back off the reads after timeout ms without a change, see
+                 TMIdle.h. With -r it prints the wakeups a second each way
+                 and how late the first input after backing off was, both
+                 as the driver sees it and as the mock does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "TMCore.h"
+#include "TMLink.h"
+#include "TMIdle.h"
+#include "TMCounters.h"
+#include "TMMockTransport.h"
+
+// ns between the made up halves with -r
+#define kMadeUpHalfInterval     2000000
+
+struct Options
+{
+    const char  *script;
+    const char  *capture;
+    int         halves;
+    bool        realTime;
+    int         loops;
+    int         reads;
+    int         initDelay;
+    bool        adaptive;
+    int         minGap;
+    int         failRequest;
+    int         runs;
+    bool        reload;
+    const char  *adb;
+    int         idleTimeout;
+    int         idleInterval;
+};
+
+// stands in for the kext: the link, the core, and the command gate
+struct Harness
+{
+    TMLink      link;
+    TMCore      *core;
+    TMMockTransport *mock;
+    TMPollScheduler poll;
+    bool        probe;
+    UInt64      probeTime;
+    
+    // a core for each polled device, cores[0] is core
+    TMCore      *cores[kMaxADBDevices];
+    UInt32      deviceHalves[kMaxADBDevices];
+    UInt32      unrouted;
+    UInt32      misrouted;
+    std::mutex  gate;
+    UInt32      halves;
+    UInt32      reports;
+    UInt64      start;
+    UInt64      initDone;
+    UInt64      firstReport;
+    UInt64      lastFrame;
+    
+    // the idle timer, a thread standing in for the IOTimerEventSource
+    TMIdlePolicy idle;
+    std::condition_variable idleWake;
+    bool        idleStop;
+};
+
+// whether a half has one of the mock devices' register 0 in it, and which
+static int registerOwner(Harness *harness, const UInt8 *data)
+{
+    int half = data[kHalfFrameTagByte] == kFirstHalfTag ? 0 : 1;
+    
+    for(size_t i = 0; i < harness->mock->fADBDevices.size(); i++)
+    {
+        if(memcmp(&data[kHalfFrameSize - kHalfFrameDataSize],
+                  &harness->mock->fADBDevices[i].register0[half * kHalfFrameDataSize], kHalfFrameDataSize) == 0)
+        {
+            return harness->mock->fADBDevices[i].address;
+        }
+    }
+    return -1;
+}
+
+static void frameReceived(void *target, const UInt8 *data, UInt32 length, UInt64 timestamp)
+{
+    Harness *harness = (Harness*)target;
+    UInt8   report[kMaxReportSize];
+    UInt8   half[kHalfFrameSize];
+    int     index = 0;
+    
+    // the mock completes reads one at a time, so this doesn't need the gate
+    harness->halves++;
+    harness->lastFrame = timestamp;
+    if(harness->idle.isEnabled())
+    {
+        std::lock_guard<std::mutex> lock(harness->gate);
+        harness->idle.wakeup();
+    }
+    
+    // dispatchFrames, the poll thread calls next() and the init thread adds
+    // what it found under the gate
+    if(harness->probe && length == kHalfFrameSize)
+    {
+        std::lock_guard<std::mutex> lock(harness->gate);
+        
+        if(harness->poll.isEnabled())
+        {
+            memcpy(half, data, length);
+            data = half;
+            index = harness->poll.route(half);
+            if(index < 0)
+            {
+                harness->unrouted++;
+                index = 0;
+            }
+            else
+            {
+                int owner = registerOwner(harness, half);
+            
+                if(owner != (index ? harness->poll.fDevices[index].address : -1))
+                {
+                    harness->misrouted++;
+                }
+                harness->deviceHalves[index]++;
+            }
+        }
+    }
+    if(index > 0)
+    {
+        harness->cores[index]->handleHalfFrame(data, length);
+        return;
+    }
+    if(harness->core->handleHalfFrame(data, length))
+    {
+        harness->core->translate(harness->core->fControlData, report);
+        if(harness->reports++ == 0)
+        {
+            harness->firstReport = timestamp;
+        }
+        
+        // back to full rate, this read goes straight back on the pipe
+        std::lock_guard<std::mutex> lock(harness->gate);
+        if(harness->idle.isEnabled() && harness->idle.changed(timestamp, harness->link.fBlindSince))
+        {
+            harness->link.fHoldReads = false;
+            harness->link.resumeReads();
+            harness->idleWake.notify_one();
+        }
+    }
+}
+
+static void idleThread(Harness *harness)
+{
+    std::unique_lock<std::mutex> lock(harness->gate);
+    UInt64                       next = TMNanoseconds() + harness->idle.fTimeout * 1000000ULL;
+    
+    // handleIdleTick, a change brings it back early to start the timeout over
+    while(!harness->idleStop)
+    {
+        UInt64 now = TMNanoseconds();
+        
+        if(now < next)
+        {
+            bool backedOff = harness->idle.fBackedOff;
+            
+            harness->idleWake.wait_for(lock, std::chrono::nanoseconds(next - now));
+            if(backedOff && !harness->idle.fBackedOff)
+            {
+                next = harness->idle.fLastChange + harness->idle.fTimeout * 1000000ULL;
+            }
+            continue;
+        }
+        if(harness->link.fNeedToClose)
+        {
+            break;
+        }
+        harness->idle.wakeup();
+        if(harness->idle.tick(now, &next))
+        {
+            harness->link.fEmptySince = 0;
+            harness->link.fBlindSince = 0;
+            harness->link.fHoldReads = true;
+        }
+        if(harness->idle.fBackedOff)
+        {
+            harness->link.resumeReads();
+        }
+    }
+}
+
+static void pollThread(Harness *harness)
+{
+    std::unique_lock<std::mutex> lock(harness->gate);
+    
+    // handlePoll, frameReceived has already handed out the last answer
+    while(!harness->link.fNeedToClose)
+    {
+        if(harness->link.fCommandBusy)
+        {
+            harness->poll.fSkipped++;
+        }
+        else
+        {
+            int device = harness->poll.next();
+            
+            harness->link.postADBCommand(ADBCommand(harness->poll.fDevices[device].address, kADBTalk, 0));
+        }
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::microseconds(harness->poll.fInterval));
+        lock.lock();
+    }
+}
+
+static void removed(void *target)
+{
+    Harness *harness = (Harness*)target;
+    
+    // willTerminate, then didTerminate under the gate
+    harness->link.abort();
+    std::lock_guard<std::mutex> lock(harness->gate);
+    harness->link.terminate();
+}
+
+static void initThread(Harness *harness)
+{
+    UInt8   found[kMaxADBDevices];
+    int     numFound = 0;
+    
+    if(harness->link.runInitSequence() == kIOReturnSuccess && harness->probe)
+    {
+        UInt64 start = TMNanoseconds();
+        
+        numFound = harness->link.probeDevices(&harness->poll, found, kMaxADBDevices - harness->poll.fNumDevices);
+        harness->probeTime = TMNanoseconds() - start;
+    }
+    
+    // handleInitFinshed, which hands what the probe found to the dispatch
+    // loop, and startDevices
+    std::lock_guard<std::mutex> lock(harness->gate);
+    harness->initDone = TMNanoseconds();
+    harness->link.finishInit();
+    for(int i = 0; i < numFound; i++)
+    {
+        int index = harness->poll.addDevice(found[i], kTMHandlerID, 1);
+        
+        harness->cores[index] = new TMCore;
+        harness->cores[index]->init();
+        harness->cores[index]->loadProperties(NULL);
+    }
+}
+
+static void makeHalves(TMMockTransport *mock, int count)
+{
+    TMMockEvent event;
+    
+    // sweep the stick around and mash the buttons
+    memset(&event, 0, sizeof(event));
+    event.type = TMMockEvent::kData;
+    event.delay = kMadeUpHalfInterval;
+    event.length = kHalfFrameSize;
+    for(int i = 0; i < count; i++)
+    {
+        event.data[kHalfFrameTagByte] = (i & 1) ? kSecondHalfTag : kFirstHalfTag;
+        for(int j = kHalfFrameSize - kHalfFrameDataSize; j < kHalfFrameSize; j++)
+        {
+            event.data[j] = (i * 7 + j * 31) >> 2;
+        }
+        mock->fScript.push_back(event);
+    }
+}
+
+static double ms(UInt64 ns)
+{
+    return ns / 1000000.0;
+}
+
+static int run(const Options &options, TMMockTransport *mock, bool verbose)
+{
+    Harness         *harness = new Harness;
+    int             failures = 0;
+    
+    mock->reset(!options.reload);
+    mock->fRemoved = removed;
+    mock->fTarget = harness;
+    
+    harness->core = new TMCore;
+    harness->core->init();
+    harness->core->loadProperties(NULL);
+    harness->mock = mock;
+    for(int i = 0; i < kMaxADBDevices; i++)
+    {
+        harness->cores[i] = NULL;
+        harness->deviceHalves[i] = 0;
+    }
+    harness->cores[0] = harness->core;
+    harness->unrouted = harness->misrouted = 0;
+    harness->halves = harness->reports = 0;
+    harness->initDone = harness->firstReport = harness->lastFrame = 0;
+    harness->poll.loadProperties(NULL);
+    harness->probe = !mock->fADBDevices.empty();
+    harness->probeTime = 0;
+    harness->idle.init();
+    harness->idle.fTimeout = options.idleTimeout;
+    harness->idle.fInterval = options.idleInterval;
+    harness->idleStop = false;
+    
+    // handleStart
+    harness->start = TMNanoseconds();
+    harness->link.init(mock, harness, frameReceived, options.reads);
+    harness->link.setInitDelay(options.initDelay);
+    harness->link.fAdaptiveInit = options.adaptive;
+    if(harness->link.startReadLoop() != kIOReturnSuccess)
+    {
+        fprintf(stderr, "tmmock: couldn't start the read loop\n");
+        exit(1);
+    }
+    mock->start();
+    std::thread init(initThread, harness);
+    
+    // wait for the init to finish and the mock to be unplugged, backing
+    // off from when init is done like handleInitFinshed
+    init.join();
+    std::thread idle;
+    if(harness->idle.isEnabled())
+    {
+        idle = std::thread(idleThread, harness);
+    }
+    std::thread poll;
+    if(harness->poll.isEnabled())
+    {
+        poll = std::thread(pollThread, harness);
+    }
+    mock->wait();
+    if(poll.joinable())
+    {
+        poll.join();
+    }
+    if(idle.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(harness->gate);
+            harness->idleStop = true;
+        }
+        harness->idleWake.notify_one();
+        idle.join();
+    }
+    
+    if(mock->fCloses != 1)
+    {
+        fprintf(stderr, "tmmock: closed %u times\n", (unsigned)mock->fCloses);
+        failures++;
+    }
+    if(mock->fPendingAtClose || mock->fReadsAfterClose || mock->fCompletionsAfterClose)
+    {
+        fprintf(stderr, "tmmock: closed with IO going, %u queued, %u reads and %u completions after\n",
+                (unsigned)mock->fPendingAtClose, (unsigned)mock->fReadsAfterClose,
+                (unsigned)mock->fCompletionsAfterClose);
+        failures++;
+    }
+    if(harness->link.fOutstandingIOOps != 0)
+    {
+        fprintf(stderr, "tmmock: %d IO ops still outstanding\n", (int)harness->link.fOutstandingIOOps);
+        failures++;
+    }
+    if(harness->link.fOverlappedReads)
+    {
+        fprintf(stderr, "tmmock: %d read completions ran at the same time\n", (int)harness->link.fOverlappedReads);
+        failures++;
+    }
+    if(harness->misrouted)
+    {
+        fprintf(stderr, "tmmock: %u halves went to the wrong device\n", (unsigned)harness->misrouted);
+        failures++;
+    }
+    for(int i = 0; i < harness->poll.fNumDevices && harness->poll.isEnabled(); i++)
+    {
+        TMCore *core = harness->cores[i];
+        
+        if(!core->fFrames || core->fBadHalves || core->fUnpairedHalves)
+        {
+            fprintf(stderr, "tmmock: ADB address %d got %u frames, %u bad halves and %u unpaired\n",
+                    harness->poll.fDevices[i].address, (unsigned)core->fFrames,
+                    (unsigned)core->fBadHalves, (unsigned)core->fUnpairedHalves);
+            failures++;
+        }
+    }
+    if(mock->fBadRequests)
+    {
+        fprintf(stderr, "tmmock: %u init requests weren't vendor requests\n", (unsigned)mock->fBadRequests);
+        failures++;
+    }
+    
+    if(verbose)
+    {
+        UInt64 ready = mock->fReady > harness->start ? mock->fReady : harness->start;
+        UInt64 busy = harness->lastFrame > ready ? harness->lastFrame - ready : 0;
+        
+        printf("init:       %u requests, %.1f ms, %s%u%% of the delays\n", (unsigned)mock->fRequests,
+               ms(harness->initDone - harness->start), harness->link.fSkippedInit ? "skipped, " : "",
+               (unsigned)harness->link.fInitScale);
+        if(harness->reports)
+        {
+            printf("first:      %.3f ms to the first report, %.3f ms after the iMate was ready\n",
+                   ms(harness->firstReport - harness->start), ms(harness->firstReport - ready));
+        }
+        printf("frames:     %u halves, %u reports, %u bad, %u unpaired\n",
+               (unsigned)harness->halves, (unsigned)harness->reports,
+               (unsigned)harness->core->fBadHalves, (unsigned)harness->core->fUnpairedHalves);
+        if(busy)
+        {
+            printf("throughput: %.0f halves/s\n", harness->halves / (busy / 1e9));
+        }
+        if(harness->probe)
+        {
+            printf("adb:        probed in %.1f ms, found", ms(harness->probeTime));
+            for(int i = 0; i < harness->poll.fNumDevices; i++)
+            {
+                printf(" %d:%d", harness->poll.fDevices[i].address, harness->poll.fDevices[i].handlerID);
+            }
+            printf("\n");
+        }
+        if(harness->poll.isEnabled())
+        {
+            printf("polling:    %u polls, %u missed, %u skipped, %u halves nobody owned, %u misrouted\n",
+                   (unsigned)harness->poll.fPolls, (unsigned)harness->poll.fMissed, (unsigned)harness->poll.fSkipped,
+                   (unsigned)harness->unrouted, (unsigned)harness->misrouted);
+            for(int i = 0; i < harness->poll.fNumDevices; i++)
+            {
+                printf("            %d: %u polls, %u answers, %u halves, %u frames\n",
+                       harness->poll.fDevices[i].address, (unsigned)harness->poll.fDevices[i].polls,
+                       (unsigned)harness->poll.fDevices[i].answers, (unsigned)harness->deviceHalves[i],
+                       (unsigned)harness->cores[i]->fFrames);
+            }
+        }
+        if(harness->idle.isEnabled())
+        {
+            UInt64 now = TMNanoseconds();
+            
+            printf("idle:       %u back offs, %u wakeups/s at full rate, %u backed off\n",
+                   (unsigned)harness->idle.fBackOffs, (unsigned)harness->idle.rate(kIdleFullRate, now),
+                   (unsigned)harness->idle.rate(kIdleBackedOff, now));
+            printf("            first input after backing off at most %.1f ms p50, %.1f ms p99, %.1f ms max\n",
+                   ms(harness->idle.fFirstInput.percentile(50)), ms(harness->idle.fFirstInput.percentile(99)),
+                   ms(harness->idle.fFirstInput.fMax));
+            if(mock->fRealTime)
+            {
+                printf("            halves went out late by %.1f ms p50, %.1f ms p99, %.1f ms max\n",
+                       ms(mock->fLateness.percentile(50)), ms(mock->fLateness.percentile(99)),
+                       ms(mock->fLateness.fMax));
+            }
+        }
+        
+        // what the kext would have in the registry
+        TMCounters counters;
+        
+        counters.init(harness->start);
+        counters.update(&harness->link, harness->core, TMNanoseconds());
+        printf("counters:   %u halves, %u changed, %u re-arms, %d IO ops outstanding at most, %u read errors",
+               (unsigned)counters.fCounts[kCountHalves], (unsigned)counters.fCounts[kCountChangedFrames],
+               (unsigned)counters.fCounts[kCountRearms], (int)counters.fPeakOutstandingIO,
+               (unsigned)counters.fCounts[kCountReadErrors]);
+        for(int i = 0; i < kMaxReadErrorCodes && harness->link.fReadErrors[i].status; i++)
+        {
+            printf("%s %08x x%d", i ? "," : ":", (unsigned)harness->link.fReadErrors[i].status,
+                   (int)harness->link.fReadErrors[i].count);
+        }
+        printf("\n");
+        printf("reads:      %u queued, %u completed, %u aborted%s\n",
+               (unsigned)mock->fReads, (unsigned)mock->fCompletions, (unsigned)mock->fAborted,
+               !mock->fStarved ? "" : mock->fReady ? ", driver stopped reading" : ", iMate never got going");
+        printf("close:      %s\n", failures ? "FAILED" : "ok");
+    }
+    else
+    {
+        printf("%6.1f ms to init, %6.1f ms to the first report, %s%u%% of the delays%s\n",
+               ms(harness->initDone - harness->start),
+               harness->reports ? ms(harness->firstReport - harness->start) : 0.0,
+               harness->link.fSkippedInit ? "skipped, " : "", (unsigned)harness->link.fInitScale,
+               failures ? ", FAILED" : "");
+    }
+    
+    for(int i = 0; i < kMaxADBDevices; i++)
+    {
+        delete harness->cores[i];
+    }
+    delete harness;
+    
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    Options         options;
+    TMMockTransport *mock = new TMMockTransport;
+    int             failed = 0;
+    
+    options.script = NULL;
+    options.capture = NULL;
+    options.halves = 20000;
+    options.realTime = false;
+    options.loops = 1;
+    options.reads = kDefaultReadsInFlight;
+    options.initDelay = kInitCommandDelay;
+    options.adaptive = false;
+    options.minGap = 0;
+    options.failRequest = -1;
+    options.runs = 1;
+    options.reload = false;
+    options.adb = NULL;
+    options.idleTimeout = 0;
+    options.idleInterval = kDefaultIdlePollInterval;
+    
+    for(int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        
+        if(strcmp(arg, "-r") == 0 || strcmp(arg, "-a") == 0 || strcmp(arg, "-w") == 0)
+        {
+            options.realTime |= arg[1] == 'r';
+            options.adaptive |= arg[1] == 'a';
+            options.reload |= arg[1] == 'w';
+            continue;
+        }
+        if(!value || arg[0] != '-' || strlen(arg) != 2)
+        {
+            fprintf(stderr, "usage: %s [-s script | -c capture | -N halves] [-r] [-l loops] [-n reads] [-d ms] [-a] [-g us] [-f n] [-i runs] [-w] [-A devices] [-I timeout:interval]\n", argv[0]);
+            return 2;
+        }
+        i++;
+        switch(arg[1])
+        {
+            case 's': options.script = value; break;
+            case 'c': options.capture = value; break;
+            case 'N': options.halves = atoi(value); break;
+            case 'l': options.loops = atoi(value); break;
+            case 'n': options.reads = atoi(value); break;
+            case 'd': options.initDelay = atoi(value); break;
+            case 'g': options.minGap = atoi(value); break;
+            case 'f': options.failRequest = atoi(value); break;
+            case 'i': options.runs = atoi(value); break;
+            case 'A': options.adb = value; break;
+            case 'I': sscanf(value, "%d:%d", &options.idleTimeout, &options.idleInterval); break;
+            default:
+                fprintf(stderr, "%s: unknown option %s\n", argv[0], arg);
+                return 2;
+        }
+    }
+    
+    if(options.script && !mock->loadScript(options.script))
+    {
+        fprintf(stderr, "%s: can't load %s\n", argv[0], options.script);
+        return 2;
+    }
+    else if(options.capture && !mock->loadCapture(options.capture))
+    {
+        fprintf(stderr, "%s: %s isn't a capture\n", argv[0], options.capture);
+        return 2;
+    }
+    else if(!options.script && !options.capture)
+    {
+        makeHalves(mock, options.halves);
+    }
+    mock->fLoops = options.loops;
+    mock->fRealTime = options.realTime;
+    mock->fFailRequest = options.failRequest;
+    mock->fMinGap = options.minGap;
+    for(const char *device = options.adb; device; device = strchr(device, ','))
+    {
+        TMMockADBDevice adb;
+        int             address, handlerID;
+        
+        if(*device == ',')
+            device++;
+        if(sscanf(device, "%d:%d", &address, &handlerID) != 2)
+        {
+            fprintf(stderr, "%s: -A wants address:handler[,address:handler...]\n", argv[0]);
+            return 2;
+        }
+        adb.address = address;
+        adb.handlerID = handlerID;
+        for(int j = 0; j < kControlDataSize; j++)
+        {
+            adb.register0[j] = (address << 4) | j;
+        }
+        mock->fADBDevices.push_back(adb);
+    }
+    
+    for(int i = 0; i < options.runs; i++)
+    {
+        if(run(options, mock, options.runs == 1))
+        {
+            failed++;
+        }
+    }
+    if(options.runs > 1)
+    {
+        printf("%d of %d runs failed\n", failed, options.runs);
+    }
+    delete mock;
+    
+    return failed ? 1 : 0;
+}
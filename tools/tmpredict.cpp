@@ -0,0 +1,183 @@
+/*
+ File:		tmpredict.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Runs a frame capture through TMPredictor to see how good its guesses are.
+ At every real frame the guess each predictor would have sent just before it
+ is compared with what the frame actually said. "hold" is what the driver
+ does without prediction: keep reporting the last frame.
+
+ Holding is a full frame late by the time the next frame shows up, so the
+ latency hidden is estimated as the frame interval times how much of hold's
+ error the predictor got rid of.
+
+ usage: tmpredict [-a alpha] [-b beta] [-l limit ms] capture
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#include "TMCore.h"
+#include "TMCapture.h"
+#include "TMPredictor.h"
+
+static const char   *gModeNames[] = {"hold", "linear", "alpha-beta"};
+static const UInt8  gAxisBytes[kNumAxes] = {kXAxisByte, kYAxisByte, kRuddersByte, kThrottleByte};
+
+struct Score
+{
+    double      sumSquared;
+    double      sumAbsolute;
+    UInt32      overshoots;     // guessed past where the axis ended up, or the wrong way
+    UInt32      count;
+};
+
+static int axisValue(const UInt8 *data, int axis)
+{
+    return data[gAxisBytes[axis]] ^ ((axis == kThrottleAxis) ? 0 : 0x80);
+}
+
+int main(int argc, char **argv)
+{
+    const char          *path = NULL;
+    int                 alpha = kPredictDefaultAlpha, beta = kPredictDefaultBeta, limit = 0;
+    std::vector<UInt8>  capture;
+    TMCaptureReader     reader;
+    TMCaptureRecord     record;
+    TMCore              *core = new TMCore;
+    TMPredictor         predictors[3];
+    Score               scores[3];
+    UInt8               last[kControlDataSize];
+    UInt64              firstFrame = 0, lastFrame = 0;
+    UInt32              frames = 0;
+    FILE                *file;
+    int                 c;
+    
+    for(int i = 1; i < argc; i++)
+    {
+        if(i + 1 < argc && strcmp(argv[i], "-a") == 0)
+            alpha = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "-b") == 0)
+            beta = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "-l") == 0)
+            limit = atoi(argv[++i]);
+        else if(!path && argv[i][0] != '-')
+            path = argv[i];
+        else
+            path = NULL, i = argc;
+    }
+    if(!path)
+    {
+        fprintf(stderr, "usage: %s [-a alpha] [-b beta] [-l limit ms] capture\n", argv[0]);
+        return 2;
+    }
+    
+    if(!(file = fopen(path, "rb")))
+    {
+        fprintf(stderr, "%s: can't read %s\n", argv[0], path);
+        return 1;
+    }
+    while((c = fgetc(file)) != EOF)
+    {
+        capture.push_back(c);
+    }
+    fclose(file);
+    if(capture.empty() || !reader.init(&capture[0], capture.size()))
+    {
+        fprintf(stderr, "%s: %s isn't a capture\n", argv[0], path);
+        return 1;
+    }
+    
+    core->init();
+    reader.applySettings(core);
+    for(int m = 0; m < 3; m++)
+    {
+        predictors[m].init();
+        predictors[m].fMode = m;
+        predictors[m].fAlpha = alpha * 256 / 100;
+        predictors[m].fBeta = beta * 256 / 100;
+        predictors[m].fLimit = limit * 1000;
+        memset(&scores[m], 0, sizeof(scores[m]));
+    }
+    memset(last, 0, sizeof(last));
+    
+    while(reader.next(&record))
+    {
+        UInt32 before = core->fFrames;
+        
+        core->handleHalfFrame(record.data, record.length);
+        if(core->fFrames == before)
+        {
+            continue;
+        }
+        
+        // score what each one would be showing right before this frame
+        for(int m = 0; m < 3 && frames > 1; m++)
+        {
+            UInt8 guess[kControlDataSize];
+            
+            if(m == kPredictNone || !predictors[m].predict(record.timestamp, guess))
+            {
+                memcpy(guess, predictors[m].fLastData, sizeof(guess));
+            }
+            for(int i = 0; i < kNumAxes; i++)
+            {
+                int actual = axisValue(core->fControlData, i);
+                int previous = axisValue(last, i);
+                int guessed = axisValue(guess, i);
+                int error = guessed - actual;
+                
+                scores[m].sumSquared += error * error;
+                scores[m].sumAbsolute += abs(error);
+                int moved = actual - previous;
+                int guessedMove = guessed - previous;
+                
+                // moved when it didn't, went the wrong way, or went too far
+                if(guessedMove != 0 && (moved == 0 || (guessedMove > 0) != (moved > 0) || abs(guessedMove) > abs(moved)))
+                {
+                    scores[m].overshoots++;
+                }
+                scores[m].count++;
+            }
+        }
+        
+        for(int m = 0; m < 3; m++)
+        {
+            UInt8 data[kControlDataSize];
+            predictors[m].update(record.timestamp, core->fControlData, data);
+        }
+        memcpy(last, core->fControlData, sizeof(last));
+        
+        if(frames++ == 0)
+        {
+            firstFrame = record.timestamp;
+        }
+        lastFrame = record.timestamp;
+    }
+    
+    if(frames < 3)
+    {
+        fprintf(stderr, "%s: not enough frames in %s\n", argv[0], path);
+        return 1;
+    }
+    
+    double interval = (lastFrame - firstFrame) / 1e6 / (frames - 1);
+    double holdError = scores[0].sumAbsolute;
+    
+    printf("%u frames, %.2f ms apart\n", (unsigned)frames, interval);
+    printf("%-12s %10s %10s %10s %12s\n", "", "rms", "mean abs", "overshoot", "hidden ms");
+    for(int m = 0; m < 3; m++)
+    {
+        double hidden = holdError > 0 ? interval * (1 - scores[m].sumAbsolute / holdError) : 0;
+        
+        printf("%-12s %10.3f %10.3f %10u %12.2f\n", gModeNames[m],
+               sqrt(scores[m].sumSquared / scores[m].count), scores[m].sumAbsolute / scores[m].count,
+               (unsigned)scores[m].overshoots, hidden);
+    }
+    
+    delete core;
+    return 0;
+}
@@ -0,0 +1,462 @@
+/*
+ File:		tmprofile.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Makes, checks and prints settings profiles, see TMProfile.h.
+
+ usage: tmprofile check profile...
+        tmprofile dump profile
+        tmprofile make text profile
+        tmprofile capture capture profile
+        tmprofile plist profile
+
+     check    says what is wrong with each profile, if anything, and exits
+              with 1 if any of them are bad
+     dump     prints a profile as text that make takes back
+     make     turns text into a profile. Each line is a key = value, keys
+              that are left out keep the driver's defaults, # starts a
+              comment:
+                  Name = Pedals and throttle
+                  HasRudder = yes
+                  RockerIsModifier = yes
+                  Buttons = 0 2          (the buttons that differ by layer)
+                  LayerButtons = 4       (the buttons that pick the layer)
+                  X.Deadzone = 4
+                  Throttle.Invert = yes
+     capture  the settings a frame capture was made with, see TMCapture.h
+     plist    prints the Profile key for an Info.plist personality
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+
+#include "TMCore.h"
+#include "TMProfile.h"
+#include "TMCapture.h"
+
+static const char *gAxisNames[kNumAxes] = {"X", "Y", "Rudder", "Throttle"};
+
+// the settings byte, in the order dump prints them
+static const struct
+{
+    const char  *key;
+    UInt8       bit;
+} gSettings[] =
+{
+    {"HasRudder",           kProfileHasRudder},
+    {"HasThrottle",         kProfileHasThrottle},
+    {"RockerIsModifier",    kProfileRockerIsModifier},
+    {"ModifierEffectsHat",  kProfileModifierEffectsHat},
+    {"TwistRudder",         kProfileTwistRudder},
+    {"HighResolutionAxes",  kProfileHighResAxes},
+    {NULL,                  0}
+};
+
+static const char *gAxisKeys[] = {"Min", "Max", "Center", "Deadzone", "Expo", "SCurve", "Invert", "Hysteresis", "Smoothing", NULL};
+
+static bool readFile(const char *path, std::vector<UInt8> *out)
+{
+    FILE    *file = fopen(path, "rb");
+    int     c;
+    
+    if(!file)
+    {
+        return false;
+    }
+    while((c = fgetc(file)) != EOF)
+    {
+        out->push_back(c);
+    }
+    fclose(file);
+    
+    return true;
+}
+
+static bool writeProfile(const char *path, const TMProfile *profile)
+{
+    UInt8   buffer[kProfileSize];
+    UInt32  length = profile->write(buffer, sizeof(buffer));
+    FILE    *file = fopen(path, "wb");
+    bool    ok;
+    
+    if(!file)
+    {
+        return false;
+    }
+    ok = fwrite(buffer, 1, length, file) == length;
+    return fclose(file) == 0 && ok;
+}
+
+static int loadProfile(const char *path, TMProfile *profile)
+{
+    std::vector<UInt8>  data;
+    int                 error;
+    
+    if(!readFile(path, &data))
+    {
+        fprintf(stderr, "tmprofile: can't read %s\n", path);
+        return -1;
+    }
+    error = data.empty() ? kProfileTooShort : profile->read(&data[0], data.size());
+    if(error != kProfileOK)
+    {
+        fprintf(stderr, "tmprofile: %s: %s\n", path, TMProfile::errorString(error));
+    }
+    return error;
+}
+
+// what a new core starts out with, so left out keys match the driver
+static void defaultProfile(TMProfile *profile)
+{
+    TMCore  *core = new TMCore;
+    
+    core->init();
+    profile->init(core, NULL);
+    delete core;
+}
+
+static int *axisField(TMAxisCalibration *cal, int key)
+{
+    int *fields[] = {&cal->min, &cal->max, &cal->center, &cal->deadzone, &cal->expo,
+                     &cal->sCurve, NULL, &cal->hysteresis, &cal->smoothing};
+    
+    return fields[key];
+}
+
+static void printButtons(const char *key, UInt16 buttons)
+{
+    printf("%s =", key);
+    for(int i = 0; i < kNumOfButtons; i++)
+    {
+        if(buttons & (1 << i))
+        {
+            printf(" %d", i);
+        }
+    }
+    printf("\n");
+}
+
+static void dump(const TMProfile *profile)
+{
+    printf("Name = %s\n", profile->fName);
+    for(int i = 0; gSettings[i].key; i++)
+    {
+        printf("%s = %s\n", gSettings[i].key, (profile->fSettings & gSettings[i].bit) ? "yes" : "no");
+    }
+    printButtons("Buttons", profile->fButtons);
+    printButtons("LayerButtons", profile->fLayerButtons);
+    
+    for(int i = 0; i < kNumAxes; i++)
+    {
+        TMAxisCalibration   cal = profile->fAxes[i];
+        
+        for(int j = 0; gAxisKeys[j]; j++)
+        {
+            if(j == 6)
+                printf("%s.%s = %s\n", gAxisNames[i], gAxisKeys[j], cal.invert ? "yes" : "no");
+            else if(j == 2 && cal.center == kNoCenter)
+                printf("%s.%s = none\n", gAxisNames[i], gAxisKeys[j]);
+            else
+                printf("%s.%s = %d\n", gAxisNames[i], gAxisKeys[j], *axisField(&cal, j));
+        }
+    }
+}
+
+static bool parseBool(const char *value, bool *result)
+{
+    if(strcmp(value, "yes") == 0 || strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
+        *result = true;
+    else if(strcmp(value, "no") == 0 || strcmp(value, "false") == 0 || strcmp(value, "0") == 0)
+        *result = false;
+    else
+        return false;
+    return true;
+}
+
+static bool parseNumber(const char *value, int *result)
+{
+    char    *end;
+    long    number = strtol(value, &end, 10);
+    
+    if(end == value || *end || number < 0 || number > 255)
+    {
+        return false;
+    }
+    *result = number;
+    return true;
+}
+
+static bool parseButtons(char *value, UInt16 *buttons)
+{
+    *buttons = 0;
+    for(char *word = strtok(value, " \t"); word; word = strtok(NULL, " \t"))
+    {
+        int button;
+        
+        if(!parseNumber(word, &button) || button >= kNumOfButtons)
+        {
+            return false;
+        }
+        *buttons |= 1 << button;
+    }
+    return true;
+}
+
+static bool parseLine(TMProfile *profile, char *key, char *value)
+{
+    const char  *dot = strchr(key, '.');
+    bool        flag;
+    
+    if(strcmp(key, "Name") == 0)
+    {
+        if(strlen(value) >= kProfileNameSize)
+        {
+            return false;
+        }
+        memset(profile->fName, 0, kProfileNameSize);
+        strcpy(profile->fName, value);
+        return true;
+    }
+    if(strcmp(key, "Buttons") == 0)
+    {
+        return parseButtons(value, &profile->fButtons);
+    }
+    if(strcmp(key, "LayerButtons") == 0)
+    {
+        return parseButtons(value, &profile->fLayerButtons);
+    }
+    for(int i = 0; gSettings[i].key; i++)
+    {
+        if(strcmp(key, gSettings[i].key) == 0)
+        {
+            if(!parseBool(value, &flag))
+            {
+                return false;
+            }
+            profile->fSettings = flag ? (profile->fSettings | gSettings[i].bit) : (profile->fSettings & ~gSettings[i].bit);
+            return true;
+        }
+    }
+    
+    for(int i = 0; dot && i < kNumAxes; i++)
+    {
+        TMAxisCalibration   *cal = &profile->fAxes[i];
+        
+        if(strncmp(key, gAxisNames[i], dot - key) != 0 || gAxisNames[i][dot - key] != 0)
+        {
+            continue;
+        }
+        for(int j = 0; gAxisKeys[j]; j++)
+        {
+            if(strcmp(dot + 1, gAxisKeys[j]) != 0)
+            {
+                continue;
+            }
+            if(j == 6)
+            {
+                if(!parseBool(value, &flag))
+                    return false;
+                cal->invert = flag;
+                return true;
+            }
+            if(j == 2 && strcmp(value, "none") == 0)
+            {
+                cal->center = kNoCenter;
+                return true;
+            }
+            return parseNumber(value, axisField(cal, j));
+        }
+    }
+    return false;
+}
+
+static char *trim(char *s)
+{
+    char *end;
+    
+    while(isspace((unsigned char)*s))
+    {
+        s++;
+    }
+    end = s + strlen(s);
+    while(end > s && isspace((unsigned char)end[-1]))
+    {
+        *--end = 0;
+    }
+    return s;
+}
+
+static bool make(const char *path, TMProfile *profile)
+{
+    FILE    *file = fopen(path, "r");
+    char    line[256];
+    int     number = 0;
+    bool    ok = true;
+    
+    if(!file)
+    {
+        fprintf(stderr, "tmprofile: can't read %s\n", path);
+        return false;
+    }
+    
+    defaultProfile(profile);
+    while(fgets(line, sizeof(line), file))
+    {
+        char    *equals, *comment = strchr(line, '#');
+        
+        number++;
+        if(comment)
+        {
+            *comment = 0;
+        }
+        if(*trim(line) == 0)
+        {
+            continue;
+        }
+        equals = strchr(line, '=');
+        if(equals)
+        {
+            *equals = 0;
+        }
+        if(!equals || !parseLine(profile, trim(line), trim(equals + 1)))
+        {
+            fprintf(stderr, "tmprofile: %s:%d: don't know what to do with this\n", path, number);
+            ok = false;
+        }
+    }
+    fclose(file);
+    
+    // a profile can't have more than the driver would use
+    for(int i = 0, count = 0; ok && i < kNumOfButtons; i++)
+    {
+        count += (profile->fLayerButtons >> i) & 1;
+        if(count > kMaxLayerButtons)
+        {
+            fprintf(stderr, "tmprofile: %s: only %d LayerButtons fit\n", path, kMaxLayerButtons);
+            ok = false;
+        }
+    }
+    for(int i = 0; ok && i < kNumAxes; i++)
+    {
+        if(!TMProfile::isAxisValid(&profile->fAxes[i]))
+        {
+            fprintf(stderr, "tmprofile: %s: the calibration for the %s axis doesn't make sense\n", path, gAxisNames[i]);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static void plist(const TMProfile *profile)
+{
+    static const char   digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    UInt8               buffer[kProfileSize];
+    UInt32              length = profile->write(buffer, sizeof(buffer));
+    
+    printf("<key>Profile</key>\n<data>\n");
+    for(UInt32 i = 0; i < length; i += 3)
+    {
+        UInt32  bits = buffer[i] << 16;
+        
+        if(i + 1 < length)
+            bits |= buffer[i + 1] << 8;
+        if(i + 2 < length)
+            bits |= buffer[i + 2];
+        putchar(digits[(bits >> 18) & 63]);
+        putchar(digits[(bits >> 12) & 63]);
+        putchar(i + 1 < length ? digits[(bits >> 6) & 63] : '=');
+        putchar(i + 2 < length ? digits[bits & 63] : '=');
+    }
+    printf("\n</data>\n");
+}
+
+static int usage()
+{
+    fprintf(stderr, "usage: tmprofile check profile...\n"
+                    "       tmprofile dump profile\n"
+                    "       tmprofile make text profile\n"
+                    "       tmprofile capture capture profile\n"
+                    "       tmprofile plist profile\n");
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    TMProfile   profile;
+    
+    if(argc < 3)
+    {
+        return usage();
+    }
+    
+    if(strcmp(argv[1], "check") == 0)
+    {
+        int bad = 0;
+        
+        for(int i = 2; i < argc; i++)
+        {
+            if(loadProfile(argv[i], &profile) != kProfileOK)
+            {
+                bad++;
+                continue;
+            }
+            printf("%s: ok, %s\n", argv[i], profile.fName[0] ? profile.fName : "no name");
+        }
+        return bad ? 1 : 0;
+    }
+    if(strcmp(argv[1], "dump") == 0 && argc == 3)
+    {
+        if(loadProfile(argv[2], &profile) != kProfileOK)
+        {
+            return 1;
+        }
+        dump(&profile);
+        return 0;
+    }
+    if(strcmp(argv[1], "plist") == 0 && argc == 3)
+    {
+        if(loadProfile(argv[2], &profile) != kProfileOK)
+        {
+            return 1;
+        }
+        plist(&profile);
+        return 0;
+    }
+    if(strcmp(argv[1], "make") == 0 && argc == 4)
+    {
+        if(!make(argv[2], &profile))
+        {
+            return 1;
+        }
+    }
+    else if(strcmp(argv[1], "capture") == 0 && argc == 4)
+    {
+        std::vector<UInt8>  data;
+        TMCaptureReader     reader;
+        TMCore              *core = new TMCore;
+        
+        if(!readFile(argv[2], &data) || data.empty() || !reader.init(&data[0], data.size()))
+        {
+            fprintf(stderr, "tmprofile: %s isn't a capture\n", argv[2]);
+            return 1;
+        }
+        core->init();
+        reader.applySettings(core);
+        profile.init(core, argv[2]);
+        delete core;
+    }
+    else
+    {
+        return usage();
+    }
+    
+    if(!writeProfile(argv[3], &profile))
+    {
+        fprintf(stderr, "tmprofile: can't write %s\n", argv[3]);
+        return 1;
+    }
+    return 0;
+}
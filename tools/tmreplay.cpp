@@ -0,0 +1,257 @@
+/*
+ File:		tmreplay.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Runs a frame capture (see TMCapture.h) back through TMCore and prints the
+ reports the driver would have sent, one per line:
+
+     <ns since the first half frame> <report bytes in hex>
+
+ Two runs over the same capture print the same thing, so the output of a
+ changed TMCore can be diffed against a known good one.
+
+ usage: tmreplay [-r] [-x] [-q] [-j hysteresis[:smoothing]] [-R rate] [-L buttons] capture
+     -r  sleep between halves like the stick did instead of going flat out
+     -x  the capture is hex text, like ioreg prints the FrameCapture property
+     -q  don't print the reports, just the summary. They are still built,
+         so the ns/half includes translating them.
+     -j  use this jitter filter on every axis instead of the captured one,
+         -j 0 turns it off. Compare the reports/s in the summary to see what
+         a filter setting saves.
+     -R  hold the reports down to this many a second like the ReportRate
+         setting does, see TMGovernor.h. The summary says how much later
+         the held reports went out.
+     -L  use these buttons, comma separated and numbered like the Buttons
+         key, as LayerButtons instead of the captured ones
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <vector>
+
+#include "TMCore.h"
+#include "TMCapture.h"
+#include "TMGovernor.h"
+
+static bool readFile(const char *path, bool hex, std::vector<UInt8> *out)
+{
+    FILE    *file = fopen(path, "rb");
+    int     c, high = -1;
+    
+    if(!file)
+    {
+        return false;
+    }
+    
+    while((c = fgetc(file)) != EOF)
+    {
+        if(!hex)
+        {
+            out->push_back(c);
+            continue;
+        }
+        
+        // skip anything that isn't a hex digit, ioreg wraps the data in <>
+        if(!isxdigit(c))
+        {
+            continue;
+        }
+        c = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+        if(high < 0)
+        {
+            high = c;
+        }
+        else
+        {
+            out->push_back((high << 4) | c);
+            high = -1;
+        }
+    }
+    fclose(file);
+    
+    return true;
+}
+
+// builds the report the way the driver does, so -q times the translation too
+static void sendReport(TMCore *core, IOBufferMemoryDescriptor *buffer, bool quiet, UInt64 offset, const UInt8 *data)
+{
+    const UInt8 *report = (const UInt8*)buffer->getBytesNoCopy();
+    
+    core->getReport(buffer, data);
+    if(quiet)
+    {
+        return;
+    }
+    printf("%llu", (unsigned long long)offset);
+    for(int i = 0; i < core->fReportSize; i++)
+    {
+        printf(" %02x", report[i]);
+    }
+    printf("\n");
+}
+
+static void sleepUntil(UInt64 start, UInt64 offset)
+{
+    UInt64          now = TMNanoseconds();
+    struct timespec delay;
+    
+    if(now - start >= offset)
+    {
+        return;
+    }
+    offset -= now - start;
+    delay.tv_sec = offset / 1000000000ULL;
+    delay.tv_nsec = offset % 1000000000ULL;
+    nanosleep(&delay, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    bool                realTime = false, hex = false, quiet = false;
+    const char          *path = NULL;
+    std::vector<UInt8>  capture;
+    TMCaptureReader     reader;
+    TMCaptureRecord     record;
+    TMCore              *core = new TMCore;
+    IOBufferMemoryDescriptor *buffer = IOBufferMemoryDescriptor::withCapacity(kMaxReportSize, kIODirectionOutIn);
+    TMGovernor          governor;
+    UInt8               sent[kControlDataSize] = {0}, held[kControlDataSize];
+    UInt64              first = 0, last = 0, start, elapsed, tick;
+    UInt32              halves = 0, reports = 0, rate = 0;
+    int                 hysteresis = -1, smoothing = 0, layers = -1;
+    
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-r") == 0)
+            realTime = true;
+        else if(strcmp(argv[i], "-x") == 0)
+            hex = true;
+        else if(strcmp(argv[i], "-q") == 0)
+            quiet = true;
+        else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            sscanf(argv[++i], "%d:%d", &hysteresis, &smoothing);
+        else if(strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+            rate = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-L") == 0 && i + 1 < argc)
+        {
+            layers = 0;
+            for(char *button = strtok(argv[++i], ","); button; button = strtok(NULL, ","))
+                if(atoi(button) >= 0 && atoi(button) < kNumOfButtons)
+                    layers |= 1 << atoi(button);
+        }
+        else if(!path && argv[i][0] != '-')
+            path = argv[i];
+        else
+            path = NULL, i = argc;
+    }
+    if(!path)
+    {
+        fprintf(stderr, "usage: %s [-r] [-x] [-q] [-j hysteresis[:smoothing]] [-R rate] capture\n", argv[0]);
+        return 2;
+    }
+    
+    if(!readFile(path, hex, &capture))
+    {
+        fprintf(stderr, "%s: can't read %s\n", argv[0], path);
+        return 1;
+    }
+    if(capture.empty() || !reader.init(&capture[0], capture.size()))
+    {
+        fprintf(stderr, "%s: %s isn't a version %d capture\n", argv[0], path, kCaptureVersion);
+        return 1;
+    }
+    
+    // translate with the settings the driver had when it recorded
+    core->init();
+    reader.applySettings(core);
+    first = reader.fTimestamp;
+    if(hysteresis >= 0)
+    {
+        for(int i = 0; i < kNumAxes; i++)
+        {
+            core->fAxisCalibration[i].hysteresis = hysteresis;
+            core->fAxisCalibration[i].smoothing = smoothing;
+        }
+        core->buildTranslationTables();
+    }
+    if(layers >= 0)
+    {
+        core->layoutButtons(core->fShiftedButtons, layers);
+        core->buildTranslationTables();
+        core->fReportDescriptorLength = core->buildReportDescriptor(core->fReportDescriptor);
+    }
+    
+    governor.init();
+    if(rate)
+    {
+        OSDictionary    *properties = OSDictionary::withCapacity(1);
+        OSNumber        *number = OSNumber::withNumber(rate, 32);
+        
+        properties->setObject("ReportRate", number);
+        governor.loadProperties(properties);
+        number->release();
+        properties->release();
+    }
+    
+    start = TMNanoseconds();
+    while(reader.next(&record))
+    {
+        if(realTime)
+        {
+            sleepUntil(start, record.timestamp - first);
+        }
+        
+        // the governor's timer goes off right on the tick
+        while(governor.fHolding && (tick = governor.fNextTick) <= record.timestamp)
+        {
+            if(governor.tick(tick, sent, held))
+            {
+                memcpy(sent, held, sizeof(sent));
+                reports++;
+                sendReport(core, buffer, quiet, tick - first, sent);
+            }
+        }
+        
+        halves++;
+        last = record.timestamp;
+        if(core->handleHalfFrame(record.data, record.length) &&
+           memcmp(core->fControlData, governor.latest(sent), sizeof(sent)) != 0 &&
+           governor.offer(record.timestamp, core->fControlData, sent) == kGovernorSend)
+        {
+            memcpy(sent, core->fControlData, sizeof(sent));
+            reports++;
+            sendReport(core, buffer, quiet, record.timestamp - first, sent);
+        }
+    }
+    tick = governor.fNextTick;
+    if(governor.tick(tick, sent, held))
+    {
+        memcpy(sent, held, sizeof(sent));
+        reports++;
+        sendReport(core, buffer, quiet, tick - first, sent);
+    }
+    elapsed = TMNanoseconds() - start;
+    
+    fprintf(stderr, "%u halves, %u reports, %u bad, %u unpaired, %u suppressed, %.1f ns/half\n",
+            (unsigned)halves, (unsigned)reports, (unsigned)core->fBadHalves,
+            (unsigned)core->fUnpairedHalves, (unsigned)core->fSuppressedFrames,
+            halves ? (double)elapsed / halves : 0.0);
+    if(last > first)
+    {
+        fprintf(stderr, "%.1f s captured, %.1f reports/s\n", (last - first) / 1e9, reports / ((last - first) / 1e9));
+    }
+    if(rate && last > first)
+    {
+        fprintf(stderr, "%u Hz: %u coalesced, %u button flushes, %.1f wakeups/s, %.2f ms mean / %.2f ms max added delay\n",
+                (unsigned)governor.fRate, (unsigned)governor.fCoalesced, (unsigned)governor.fButtonFlushes,
+                governor.fWakeups / ((last - first) / 1e9),
+                governor.fDelayed ? governor.fTotalDelay / 1e6 / governor.fDelayed : 0.0, governor.fMaxDelay / 1e6);
+    }
+    
+    buffer->release();
+    delete core;
+    return 0;
+}
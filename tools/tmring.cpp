@@ -0,0 +1,246 @@
+/*
+ File:		tmring.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Beats on TMFrameRing from two threads the way the kext does, the read
+ completion pushing and the dispatch loop popping, and checks that:
+
+     every frame that comes out is one that went in, not half of one and
+     half of another
+     they come out in the order they went in
+     every frame either comes out or is counted in fOverruns
+     the newest frame always gets through
+
+ It does that three times: with the consumer keeping up, with it stopping
+ now and then so the ring fills up and has to throw the oldest away, and
+ with nobody popping at all until the producer is done, when only the last
+ kFrameRingSize may be left. A timer keeps switching threads from wherever
+ they are, so they get caught part way through a push or a pop even with
+ only one CPU. Exits with 1 if anything was off, "ctest" runs it.
+
+ usage: tmring [-n frames] [-p pause]
+     -n  frames to push each time (default 1000000)
+     -p  the stopping consumer pauses for this many us every so often
+         (default 200)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <thread>
+
+#include "TMFrameRing.h"
+
+// us between the interruptions, see interrupted()
+#define kInterruptInterval  20
+
+struct Test
+{
+    const char      *name;
+    TMFrameRing     ring;
+    UInt32          frames;
+    UInt32          pause;              // us, 0 for a consumer that keeps up
+    bool            waitForProducer;    // don't pop until everything is pushed
+    volatile bool   done;
+    
+    // what the consumer saw
+    UInt32          popped;
+    UInt32          torn;
+    UInt32          outOfOrder;
+    UInt32          last;
+};
+
+// the frame number goes in the timestamp, and every data byte is made from
+// it, so a frame that got written over while it was being copied shows up
+static void makeFrame(UInt32 n, UInt8 *data, UInt32 *length)
+{
+    *length = kHalfFrameSize - (n % 3 == 0);
+    for(int i = 0; i < kHalfFrameSize; i++)
+    {
+        data[i] = (UInt8)((n >> (8 * (i & 3))) ^ (i * 37));
+    }
+}
+
+static bool checkFrame(const TMRawFrame *frame)
+{
+    UInt8   data[kHalfFrameSize];
+    UInt32  length;
+    
+    makeFrame((UInt32)frame->timestamp, data, &length);
+    return frame->length == length && memcmp(frame->data, data, length) == 0;
+}
+
+static void producer(Test *test)
+{
+    UInt8   data[kHalfFrameSize];
+    UInt32  length;
+    UInt32  seed = 2;
+    
+    // give the consumer a go now and then, so they take turns even with only
+    // one CPU, and get interrupted part way through as well
+    for(UInt32 n = 0; n < test->frames; n++)
+    {
+        makeFrame(n, data, &length);
+        test->ring.push(data, length, n);
+        seed = seed * 1103515245 + 12345;
+        if((seed >> 16) % 16 == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+    OSMemoryBarrier();
+    test->done = true;
+}
+
+static void consumer(Test *test)
+{
+    TMRawFrame  frame;
+    UInt32      seed = 1;
+    bool        first = true;
+    
+    while(test->waitForProducer && !test->done)
+    {
+        std::this_thread::yield();
+    }
+    
+    // one more go once the producer is done, for whatever it pushed last
+    for(;;)
+    {
+        bool finished = test->done;
+        
+        OSMemoryBarrier();
+        while(test->ring.pop(&frame))
+        {
+            if(!checkFrame(&frame))
+            {
+                test->torn++;
+            }
+            if(!first && (UInt32)frame.timestamp <= test->last)
+            {
+                test->outOfOrder++;
+            }
+            test->last = (UInt32)frame.timestamp;
+            test->popped++;
+            first = false;
+            
+            // stop now and then and let it fill up
+            seed = seed * 1103515245 + 12345;
+            if(test->pause && (seed >> 16) % 1000 == 0)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(test->pause));
+            }
+        }
+        if(finished)
+        {
+            break;
+        }
+        std::this_thread::yield();
+    }
+}
+
+// switches threads from wherever they happen to be, not just where they
+// yield, which with only one CPU is the only way they get caught half way
+static void interrupted(int signal)
+{
+    sched_yield();
+}
+
+static int run(Test *test)
+{
+    int failures = 0;
+    
+    test->ring.init();
+    test->done = false;
+    test->popped = test->torn = test->outOfOrder = test->last = 0;
+    
+    std::thread pop(consumer, test);
+    std::thread push(producer, test);
+    push.join();
+    pop.join();
+    
+    printf("%-10s %u pushed, %u popped, %u overruns, %u torn, %u out of order, last %u\n", test->name,
+           (unsigned)test->frames, (unsigned)test->popped, (unsigned)test->ring.fOverruns,
+           (unsigned)test->torn, (unsigned)test->outOfOrder, (unsigned)test->last);
+    if(test->torn || test->outOfOrder)
+    {
+        failures++;
+    }
+    if(test->popped + test->ring.fOverruns != test->frames)
+    {
+        fprintf(stderr, "tmring: %s lost %d frames without counting them\n", test->name,
+                (int)(test->frames - test->popped - test->ring.fOverruns));
+        failures++;
+    }
+    if(test->frames && test->last != test->frames - 1)
+    {
+        fprintf(stderr, "tmring: %s never got the newest frame\n", test->name);
+        failures++;
+    }
+    if(test->waitForProducer && test->popped != (test->frames < kFrameRingSize ? test->frames : kFrameRingSize))
+    {
+        fprintf(stderr, "tmring: %s should have had the last %d left\n", test->name, kFrameRingSize);
+        failures++;
+    }
+    if(!test->ring.isEmpty())
+    {
+        fprintf(stderr, "tmring: %s wasn't empty at the end\n", test->name);
+        failures++;
+    }
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    UInt32  frames = 1000000, pause = 200;
+    int     failures = 0;
+    
+    for(int i = 1; i < argc; i++)
+    {
+        if(i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            frames = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "-p") == 0)
+            pause = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [-n frames] [-p pause]\n", argv[0]);
+            return 2;
+        }
+    }
+    
+    Test                *tests = new Test[3];
+    struct sigaction    action;
+    struct itimerval    timer;
+    
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = interrupted;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &action, NULL);
+    memset(&timer, 0, sizeof(timer));
+    timer.it_interval.tv_usec = kInterruptInterval;
+    timer.it_value.tv_usec = kInterruptInterval;
+    setitimer(ITIMER_REAL, &timer, NULL);
+    
+    tests[0].name = "keeping up";
+    tests[0].pause = 0;
+    tests[0].waitForProducer = false;
+    tests[1].name = "stopping";
+    tests[1].pause = pause;
+    tests[1].waitForProducer = false;
+    tests[2].name = "full";
+    tests[2].pause = 0;
+    tests[2].waitForProducer = true;
+    for(int i = 0; i < 3; i++)
+    {
+        tests[i].frames = frames;
+        failures += run(&tests[i]);
+    }
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_REAL, &timer, NULL);
+    delete[] tests;
+    
+    printf("ring:      %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,363 @@
+/*
+ File:		tmtranslate.cpp
+ Creater:	Michael Milvich, michael@milvich.com
+
+ Checks that the table driven translation in TMCore builds the same reports,
+ bit for bit, as the getReport() the driver started out with, which worked
+ out every button and hat one at a time. That one is kept here as it was,
+ along with the part of init() that set it up.
+
+ Every one of the 65536 pairs of button bytes goes through both, under
+ every combination of the HasThrottle, HasRudder, RockerIsModifier,
+ ModifierEffectsHat and TwistRudder settings, with no Buttons shifted, the
+ FCS buttons, all of them, and each one on its own. Then every value of
+ each axis byte. Prints the first few differences and exits with 1 if there
+ were any, "ctest" runs it.
+
+ usage: tmtranslate [-v]
+     -v  print every difference, not just the first few
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TMCore.h"
+
+#define kNumSettings        5
+#define kMaxPrinted         10
+
+static const char   *gSettingNames[kNumSettings] =
+    {"HasThrottle", "HasRudder", "RockerIsModifier", "ModifierEffectsHat", "TwistRudder"};
+
+// what the old driver kept in com_milvich_driver_Thrustmaster for getReport()
+struct OldDriver
+{
+    bool                        fHasRudders;
+    bool                        fHasThrottle;
+    bool                        fRockerIsModifier;
+    int                         fButtonShifts[kNumOfButtons * kNumModifiers];
+    int                         fNumButtons;
+    bool                        fHatIsModified;
+    bool                        fTwistRudder;
+};
+
+// the settings part of the old init(), the properties came from the personality
+static void oldInit(OldDriver *driver, int settings, UInt16 shifted)
+{
+    int count;
+    
+    driver->fHasThrottle = settings & 1;
+    driver->fHasRudders = settings & 2;
+    driver->fRockerIsModifier = driver->fHasThrottle && (settings & 4);
+    driver->fNumButtons = 0;
+    
+    // setup buttons
+    if(driver->fHasThrottle)
+    {
+        count = kNumOfButtons;
+    }
+    else
+    {
+        count = kNumOfFCSButtons;
+    }
+    if(driver->fRockerIsModifier)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            if(shifted & (1 << i))
+            {
+                for(int j = 0; j < kNumModifiers; j++)
+                {
+                    driver->fButtonShifts[i * kNumModifiers + j] = driver->fNumButtons;
+                    driver->fNumButtons++;
+                }
+            }
+            else
+            {
+                for(int j = 0; j < kNumModifiers; j++)
+                {
+                    driver->fButtonShifts[i * kNumModifiers + j] = driver->fNumButtons;
+                }
+                driver->fNumButtons++;
+            }
+        }
+    }
+    else
+    {
+        for(int i = 0; i < count; i++)
+        {
+            for(int j = 0; j < kNumModifiers; j++)
+            {
+                driver->fButtonShifts[i * kNumModifiers + j] = driver->fNumButtons;
+            }
+            driver->fNumButtons++;
+        }
+    }
+    
+    driver->fHatIsModified = (settings & 8) && driver->fRockerIsModifier;
+    driver->fTwistRudder = settings & 16;
+}
+
+// the old getReport(), only writing into data instead of a memory descriptor
+static void oldGetReport(const OldDriver *driver, const UInt8 *TMData, UInt8 *data)
+{
+    int             rockerPosition;
+    unsigned int    buttons = 0;
+    UInt8           hat;
+    
+    if(TMData[kWCSButtonsByte] & kWCSRockerUPMask)
+    {
+        rockerPosition = 0;
+    }
+    else if(TMData[kWCSButtonsByte] & kWCSRockerDownMask)
+    {
+        rockerPosition = 2;
+    }
+    else
+    {
+        rockerPosition = 1;
+    }
+    
+    // zero everything
+    for(int i = 0; i < kReportSize; i++)
+    {
+        data[i] = 0;
+    }
+    
+    // FCS Buttons
+    buttons = buttons | ((bool)(TMData[kFCSButtonsByte] & kFCSTriggerMask)) << driver->fButtonShifts[0 + rockerPosition];
+    buttons = buttons | ((bool)(TMData[kFCSButtonsByte] & kFCSThumbHighMask)) << driver->fButtonShifts[3 + rockerPosition];
+    buttons = buttons | ((bool)(TMData[kFCSButtonsByte] & kFCSThumbLowMask)) << driver->fButtonShifts[6 + rockerPosition];
+    buttons = buttons | ((bool)(TMData[kFCSButtonsByte] & kFCSPinkyMask)) << driver->fButtonShifts[9 + rockerPosition];
+    
+    // do the WCS
+    if(driver->fHasThrottle)
+    {
+        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 1)) << driver->fButtonShifts[12 + rockerPosition];
+        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 2)) << driver->fButtonShifts[15 + rockerPosition];
+        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 4)) << driver->fButtonShifts[18 + rockerPosition];
+        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 8)) << driver->fButtonShifts[21 + rockerPosition];
+        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 16)) << driver->fButtonShifts[24 + rockerPosition];
+        buttons = buttons |  ((bool)(TMData[kWCSButtonsByte] & 32)) << driver->fButtonShifts[27 + rockerPosition];
+    }
+    
+    // swap bytes around, HostToUSBLong
+    OSWriteLittleInt32(data, 0, buttons);
+    
+    // the hat switch is a pain
+    if(TMData[kFCSButtonsByte] & kFCSHatUpMask && TMData[kFCSButtonsByte] & kFCSHatRightMask)
+    {
+        hat = 2;
+    }
+    else if(TMData[kFCSButtonsByte] & kFCSHatRightMask && TMData[kFCSButtonsByte] & kFCSHatDownMask)
+    {
+        hat = 4;
+    }
+    else if(TMData[kFCSButtonsByte] & kFCSHatDownMask && TMData[kFCSButtonsByte] & kFCSHatleftMask)
+    {
+        hat = 6;
+    }
+    else if(TMData[kFCSButtonsByte] & kFCSHatleftMask && TMData[kFCSButtonsByte] & kFCSHatUpMask)
+    {
+        hat = 8;
+    }
+    else if(TMData[kFCSButtonsByte] & kFCSHatUpMask)
+    {
+        hat = 1;
+    }
+    else if(TMData[kFCSButtonsByte] & kFCSHatRightMask)
+    {
+        hat = 3;
+    }
+    else if(TMData[kFCSButtonsByte] & kFCSHatDownMask)
+    {
+        hat = 5;
+    }
+    else if(TMData[kFCSButtonsByte] & kFCSHatleftMask)
+    {
+        hat = 7;
+    }
+    else
+    {
+        hat = 0;	// should be null
+    }
+    
+    // move the data around based on the rockers position
+    if(driver->fHatIsModified)
+    {
+        if(rockerPosition == 0)
+        {
+            data[kFCSHatReportByte] = 0xf0 | hat;
+            data[kFCSHatReportByte + 1] = 0xff;
+        }
+        if(rockerPosition == 1)
+        {
+            data[kFCSHatReportByte] = (hat << 4) | 0x0f;
+            data[kFCSHatReportByte + 1] = 0xff;
+        }
+        else if(rockerPosition == 2)
+        {
+            data[kFCSHatReportByte] = 0xff;
+            data[kFCSHatReportByte + 1] = hat;
+        }
+    }
+    else
+    {
+        data[kFCSHatReportByte] = hat;
+    }
+    
+    if(!driver->fRockerIsModifier)
+    {
+        // and the rocker swtich
+        if(TMData[kWCSButtonsByte] & kWCSRockerUPMask)
+        {
+            hat = 1;
+        }
+        else if(TMData[kWCSButtonsByte] & kWCSRockerDownMask)
+        {
+            hat = 5;
+        }
+        else
+        {
+            hat = 0;
+        }
+        
+        data[kWCSHatReportByte] = data[kWCSHatReportByte] | hat << 4;
+    }
+    
+    // then do the axis
+    data[kXAxisReportByte] = (TMData[kXAxisByte] + 128);	// x axis
+    data[kYAxisReportByte] = (TMData[kYAxisByte] + 128);	// y axis
+    data[kThrottleReportByte] = (255 - TMData[kThrottleByte]);	// throttle (slider)
+    data[kRuddersReportByte] = (TMData[kRuddersByte] + 128); 	// rudder (z)... I think
+}
+
+static TMCore *makeCore(int settings, UInt16 shifted)
+{
+    TMCore          *core = new TMCore;
+    OSDictionary    *properties = OSDictionary::withCapacity(kNumSettings + 1);
+    OSArray         *buttons = OSArray::withCapacity(kNumOfButtons);
+    
+    for(int i = 0; i < kNumSettings; i++)
+    {
+        properties->setObject(gSettingNames[i], (settings & (1 << i)) ? kOSBooleanTrue : kOSBooleanFalse);
+    }
+    for(int i = 0; i < kNumOfButtons; i++)
+    {
+        buttons->setObject((shifted & (1 << i)) ? kOSBooleanTrue : kOSBooleanFalse);
+    }
+    properties->setObject("Buttons", buttons);
+    
+    core->init();
+    core->loadProperties(properties);
+    buttons->release();
+    properties->release();
+    return core;
+}
+
+// compares the two reports for one input, says what was different
+static bool compare(const OldDriver *driver, const TMCore *core, const UInt8 *TMData, int settings, UInt16 shifted,
+                    UInt32 *differences, bool verbose)
+{
+    UInt8   expected[kReportSize], report[kMaxReportSize];
+    
+    oldGetReport(driver, TMData, expected);
+    memset(report, 0, sizeof(report));
+    core->translate(TMData, report);
+    if(memcmp(expected, report, kReportSize) == 0)
+    {
+        return true;
+    }
+    
+    if(verbose || *differences < kMaxPrinted)
+    {
+        printf("settings %02x shifted %03x, input", settings, shifted);
+        for(int i = 0; i < kControlDataSize; i++)
+            printf(" %02x", TMData[i]);
+        printf("\n    old");
+        for(int i = 0; i < kReportSize; i++)
+            printf(" %02x", expected[i]);
+        printf("\n    new");
+        for(int i = 0; i < kReportSize; i++)
+            printf(" %02x", report[i]);
+        printf("\n");
+    }
+    (*differences)++;
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    UInt16      shiftedSets[3 + kNumOfButtons];
+    int         numShiftedSets = 0;
+    UInt32      differences = 0, checked = 0;
+    bool        verbose = false;
+    
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+    
+    // none, the FCS buttons, all of them, and each on its own
+    shiftedSets[numShiftedSets++] = 0;
+    shiftedSets[numShiftedSets++] = (1 << kNumOfFCSButtons) - 1;
+    shiftedSets[numShiftedSets++] = (1 << kNumOfButtons) - 1;
+    for(int i = 0; i < kNumOfButtons; i++)
+    {
+        shiftedSets[numShiftedSets++] = 1 << i;
+    }
+    
+    for(int settings = 0; settings < (1 << kNumSettings); settings++)
+    {
+        for(int s = 0; s < numShiftedSets; s++)
+        {
+            OldDriver   driver;
+            TMCore      *core = makeCore(settings, shiftedSets[s]);
+            UInt8       TMData[kControlDataSize];
+            
+            oldInit(&driver, settings, shiftedSets[s]);
+            if(core->fNumButtons != driver.fNumButtons || core->fReportSize != kReportSize)
+            {
+                printf("settings %02x shifted %03x: %d buttons in a %d byte report, was %d in %d\n", settings,
+                       shiftedSets[s], core->fNumButtons, core->fReportSize, driver.fNumButtons, kReportSize);
+                differences++;
+            }
+            
+            // every pair of button bytes, with the axes somewhere off center
+            memset(TMData, 0, sizeof(TMData));
+            TMData[kXAxisByte] = 0x12;
+            TMData[kYAxisByte] = 0xe5;
+            TMData[kThrottleByte] = 0x40;
+            TMData[kRuddersByte] = 0x9c;
+            for(int buttons = 0; buttons < 0x10000; buttons++, checked++)
+            {
+                TMData[kWCSButtonsByte] = buttons & 0xff;
+                TMData[kFCSButtonsByte] = buttons >> 8;
+                compare(&driver, core, TMData, settings, shiftedSets[s], &differences, verbose);
+            }
+            
+            // and every value of each axis
+            memset(TMData, 0, sizeof(TMData));
+            for(int axis = 0; axis < 4; axis++)
+            {
+                for(int value = 0; value < 256; value++, checked++)
+                {
+                    TMData[axis] = value;
+                    compare(&driver, core, TMData, settings, shiftedSets[s], &differences, verbose);
+                }
+                TMData[axis] = 0;
+            }
+            delete core;
+        }
+    }
+    
+    printf("%u inputs checked, %u differences\n", (unsigned)checked, (unsigned)differences);
+    return differences ? 1 : 0;
+}